@@ -8,3 +8,15 @@ if [ $? -eq 0 ] ; then
     echo "-DMISSING_CLOCK_GETTIME"
   fi
 fi
+
+# libxkbcommon 1.6 can iterate compose tables, which lets us type characters
+# missing from the keymap with Compose and dead key sequences.
+if pkg-config --atleast-version=1.6.0 xkbcommon 2> /dev/null ; then
+  echo "-DHAVE_XKB_COMPOSE_ITERATOR"
+fi
+
+# XInput 2 lets libxdo follow the pointer from raw events instead of asking
+# the X server where it is; see xdo_track_pointer.
+if pkg-config --exists xi 2> /dev/null ; then
+  echo "-DHAVE_XI2"
+fi
@@ -0,0 +1,246 @@
+#include "xdo_cmd.h"
+#include <string.h>
+#include <X11/keysym.h>
+
+/* So we can invoke xdotool from within this command */
+extern int context_execute(context_t *context);
+
+typedef struct binding {
+  const char *chord;
+  KeyCode keycode;
+  unsigned int modmask;
+  char **argv; /* the action, split into arguments */
+  int argc;
+} binding_t;
+
+/* Modifiers that are only there because of a lock, like NumLock, and must
+ * not keep a binding from firing */
+static unsigned int lock_mods[4];
+
+static int grab_failed = 0;
+static int (*orig_error_handler)(Display *, XErrorEvent *) = NULL;
+
+static int note_grab_failure(Display *dpy, XErrorEvent *xerr) {
+  if (xerr->error_code != BadAccess) {
+    return orig_error_handler(dpy, xerr);
+  }
+  grab_failed = 1;
+  return 0;
+}
+
+/* The modifier NumLock is on, if any */
+static unsigned int numlock_mask(Display *dpy) {
+  XModifierKeymap *modmap = XGetModifierMapping(dpy);
+  KeyCode numlock = XKeysymToKeycode(dpy, XK_Num_Lock);
+  unsigned int mask = 0;
+  int i;
+
+  for (i = 0; numlock != 0 && i < 8 * modmap->max_keypermod; i++) {
+    if (modmap->modifiermap[i] == numlock) {
+      mask = 1 << (i / modmap->max_keypermod);
+    }
+  }
+  XFreeModifiermap(modmap);
+  return mask;
+}
+
+/* Split an action like "type 'hello world'" into arguments. Arguments are
+ * separated by whitespace; single or double quotes keep them together. */
+static char **split_action(const char *action, int *argc_ret) {
+  size_t len = strlen(action);
+  char **argv = calloc(len / 2 + 2, sizeof(char *));
+  char *arg = malloc(len + 1);
+  int argc = 0;
+
+  while (*action != '\0') {
+    char *out = arg;
+    action += strspn(action, " \t\n");
+    if (*action == '\0') {
+      break;
+    }
+    while (*action != '\0' && !strchr(" \t\n", *action)) {
+      if (*action == '"' || *action == '\'') {
+        char quote = *action++;
+        while (*action != '\0' && *action != quote) {
+          *out++ = *action++;
+        }
+        if (*action == quote) {
+          action++;
+        }
+      } else {
+        *out++ = *action++;
+      }
+    }
+    *out = '\0';
+    argv[argc++] = strdup(arg);
+  }
+
+  free(arg);
+  argv[argc] = NULL;
+  *argc_ret = argc;
+  return argv;
+}
+
+/* Run a binding's action, with its own copy of the window stack and
+ * arguments since commands consume and replace them */
+static int run_action(context_t *context, const binding_t *binding) {
+  context_t tmpcontext = *context;
+  char **argv = malloc((binding->argc + 1) * sizeof(char *));
+  int ret;
+
+  memcpy(argv, binding->argv, (binding->argc + 1) * sizeof(char *));
+  tmpcontext.argv = argv;
+  tmpcontext.argc = binding->argc;
+  tmpcontext.windows = NULL;
+  if (context->nwindows > 0) {
+    tmpcontext.windows = malloc(context->nwindows * sizeof(Window));
+    memcpy(tmpcontext.windows, context->windows, context->nwindows * sizeof(Window));
+  }
+
+  ret = context_execute(&tmpcontext);
+
+  free(tmpcontext.windows);
+  free(argv);
+  return ret;
+}
+
+int cmd_bind(context_t *context) {
+  int ret = EXIT_SUCCESS;
+  char *cmd = *context->argv;
+  Display *dpy = context->xdo->xdpy;
+  Window root;
+  binding_t *bindings;
+  int nbindings = 0;
+  int on_release = 0;
+  int i, j;
+
+  int c;
+  typedef enum {
+    opt_unused, opt_help, opt_release
+  } optlist_t;
+  static struct option longopts[] = {
+    { "help", no_argument, NULL, opt_help },
+    { "release", no_argument, NULL, opt_release },
+    { 0, 0, 0, 0 },
+  };
+  static const char *usage =
+    "Usage: %s [--release] chord action [chord action ...]\n"
+    "Grab each chord, such as ctrl+alt+t, and run its action whenever it is\n"
+    "pressed. The action is any valid xdotool command (chains OK here) given\n"
+    "as one argument, such as 'key --clearmodifiers ctrl+c'.\n"
+    "Caps Lock and Num Lock don't matter when matching chords.\n"
+    "--release   - run actions when the key is released, not pressed\n"
+    HELP_CHAINING_ENDS;
+
+  int option_index;
+  while ((c = getopt_long_only(context->argc, context->argv, "+h",
+                               longopts, &option_index)) != -1) {
+    switch (c) {
+      case 'h':
+      case opt_help:
+        printf(usage, cmd);
+        consume_args(context, context->argc);
+        return EXIT_SUCCESS;
+        break;
+      case opt_release:
+        on_release = 1;
+        break;
+      default:
+        fprintf(stderr, usage, cmd);
+        return EXIT_FAILURE;
+    }
+  }
+
+  consume_args(context, optind);
+
+  if (context->argc < 2 || context->argc % 2 != 0) {
+    fprintf(stderr, "Expected pairs of chord and action\n");
+    fprintf(stderr, usage, cmd);
+    return EXIT_FAILURE;
+  }
+
+  /* Parse everything up front, so a key press only has to look it up */
+  bindings = calloc(context->argc / 2, sizeof(binding_t));
+  for (i = 0; i < context->argc; i += 2) {
+    binding_t *binding = bindings + nbindings;
+    xdo_keyseq_t *keyseq = xdo_keyseq_compile(context->xdo, context->argv[i]);
+
+    binding->chord = context->argv[i];
+    if (xdo_keyseq_get_chord(context->xdo, keyseq, &binding->keycode,
+                             &binding->modmask) != XDO_SUCCESS) {
+      fprintf(stderr, "Can't bind '%s': it must be modifiers and one key "
+              "from the keyboard\n", context->argv[i]);
+      xdo_keyseq_free(keyseq);
+      return EXIT_FAILURE;
+    }
+    xdo_keyseq_free(keyseq);
+
+    binding->argv = split_action(context->argv[i + 1], &binding->argc);
+    if (binding->argc == 0 || !is_command(binding->argv[0])) {
+      fprintf(stderr, "Invalid action for '%s': '%s'\n", context->argv[i],
+              context->argv[i + 1]);
+      return EXIT_FAILURE;
+    }
+    xdotool_debug(context, "Binding %s (keycode %d, modifiers 0x%x) to '%s'",
+                  binding->chord, binding->keycode, binding->modmask,
+                  context->argv[i + 1]);
+    nbindings++;
+  }
+
+  lock_mods[0] = 0;
+  lock_mods[1] = LockMask;
+  lock_mods[2] = numlock_mask(dpy);
+  lock_mods[3] = LockMask | lock_mods[2];
+
+  /* Grab every chord with every combination of the locks */
+  root = DefaultRootWindow(dpy);
+  orig_error_handler = XSetErrorHandler(note_grab_failure);
+  for (i = 0; i < nbindings; i++) {
+    grab_failed = 0;
+    for (j = 0; j < 4; j++) {
+      XGrabKey(dpy, bindings[i].keycode, bindings[i].modmask | lock_mods[j],
+               root, False, GrabModeAsync, GrabModeAsync);
+    }
+    XSync(dpy, False);
+    if (grab_failed) {
+      fprintf(stderr, "Can't bind '%s': another program has grabbed it\n",
+              bindings[i].chord);
+      ret = EXIT_FAILURE;
+    }
+  }
+  XSetErrorHandler(orig_error_handler);
+  if (ret != EXIT_SUCCESS) {
+    /* Running on without some of the chords would only hide that */
+    return ret;
+  }
+
+  while (True) {
+    XEvent e;
+    unsigned int state;
+
+    XNextEvent(dpy, &e);
+    if (e.type != (on_release ? KeyRelease : KeyPress)) {
+      continue;
+    }
+
+    /* The grab made the keyboard ours until the key goes up. Give it back
+     * right away, so the keys an action sends go to the focused window. */
+    XUngrabKeyboard(dpy, CurrentTime);
+
+    /* Only the modifiers count, not the locks, buttons or group */
+    state = e.xkey.state & (ShiftMask | ControlMask | Mod1Mask | Mod2Mask
+                            | Mod3Mask | Mod4Mask | Mod5Mask);
+    state &= ~lock_mods[2];
+    for (i = 0; i < nbindings; i++) {
+      if (bindings[i].keycode == e.xkey.keycode && bindings[i].modmask == state) {
+        xdotool_debug(context, "Running action for %s", bindings[i].chord);
+        if (run_action(context, &bindings[i]) != XDO_SUCCESS) {
+          xdotool_output(context, "Command failed.");
+        }
+        break;
+      }
+    }
+  }
+
+  return ret;
+}
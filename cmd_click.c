@@ -6,16 +6,17 @@ int cmd_click(context_t *context) {
   char *cmd = context->argv[0];
   int ret = 0;
   int clear_modifiers = 0;
-  charcodemap_t *active_mods = NULL;
-  int active_mods_n;
+  xdo_modifiers_t *active_mods = NULL;
   char *window_arg = NULL;
   useconds_t delay = 100000; /* 100ms */
   int repeat = 1;
+  int server_delay = 0;
+  int old_server_delay = context->xdo->server_delay;
 
   int c;
   typedef enum { 
     opt_unused, opt_help, opt_clearmodifiers, opt_window, opt_delay,
-    opt_repeat
+    opt_repeat, opt_server_delay
   } optlist_t;
   static struct option longopts[] = {
     { "clearmodifiers", no_argument, NULL, opt_clearmodifiers },
@@ -23,6 +24,7 @@ int cmd_click(context_t *context) {
     { "window", required_argument, NULL, opt_window },
     { "delay", required_argument, NULL, opt_delay },
     { "repeat", required_argument, NULL, opt_repeat },
+    { "server-delay", no_argument, NULL, opt_server_delay },
     { 0, 0, 0, 0 },
   };
   static const char *usage = 
@@ -33,6 +35,7 @@ int cmd_click(context_t *context) {
             "--delay MILLISECONDS   - delay in milliseconds between clicks.\n"
             "    This has no effect if you do not use --repeat.\n"
             "    Default is 100ms\n"
+            "--server-delay         - let the X server carry out the delays\n"
             "\n"
             "Button is a button number. Generally, left = 1, middle = 2, \n"
             "right = 3, wheel up = 4, wheel down = 5\n";
@@ -69,6 +72,9 @@ int cmd_click(context_t *context) {
           return EXIT_FAILURE;
         }
         break;
+      case opt_server_delay:
+        server_delay = 1;
+        break;
       default:
         fprintf(stderr, usage, cmd);
         return EXIT_FAILURE;
@@ -85,24 +91,30 @@ int cmd_click(context_t *context) {
 
   button = atoi(context->argv[0]);
 
+  if (server_delay) {
+    context->xdo->server_delay = True;
+  }
+
   window_each(context, window_arg, {
     if (clear_modifiers) {
-      xdo_get_active_modifiers(context->xdo, &active_mods, &active_mods_n);
-      xdo_clear_active_modifiers(context->xdo, window, active_mods, active_mods_n);
+      active_mods = xdo_modifiers_save(context->xdo);
+      xdo_modifiers_clear(context->xdo, window, active_mods);
     }
 
     ret = xdo_click_window_multiple(context->xdo, window, button, repeat, delay);
     if (ret != XDO_SUCCESS) {
       fprintf(stderr, "xdo_click_window failed on window %ld\n", window);
+      context->xdo->server_delay = old_server_delay;
       return ret;
     }
 
     if (clear_modifiers) {
-      xdo_set_active_modifiers(context->xdo, window, active_mods, active_mods_n);
-      free(active_mods);
+      xdo_modifiers_restore(context->xdo, window, active_mods);
+      xdo_modifiers_free(active_mods);
     }
   }); /* window_each(...) */
 
+  context->xdo->server_delay = old_server_delay;
   consume_args(context, 1);
   return ret;
 }
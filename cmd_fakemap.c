@@ -94,11 +94,10 @@ int cmd_fakemap(context_t *context) {
   waitpid(child, NULL, 0);
   xdotool_debug(context, "disabled deadkeys");
 
-  // refresh the keymap
-  xdo_t* old_xdo = context->xdo;
-  context->xdo = xdo_new_with_opened_display(old_xdo->xdpy, old_xdo->display_name, 1);
-  old_xdo->close_display_when_freed = 0;
-  xdo_free(old_xdo);
+  // refresh the keymap; the sync makes sure we have received the change
+  // notifications caused by setxkbmap
+  XSync(context->xdo->xdpy, False);
+  xdo_ensure_keymap(context->xdo);
 
   // read original charcodes
   int orig_charcodes_len = context->xdo->charcodes_len;
@@ -125,10 +124,8 @@ int cmd_fakemap(context_t *context) {
   debug_dump_current_xbklayout(context, "faked keyboard settings:");
 
   // refresh the keymap
-  old_xdo = context->xdo;
-  context->xdo = xdo_new_with_opened_display(old_xdo->xdpy, old_xdo->display_name, 1);
-  old_xdo->close_display_when_freed = 0;
-  xdo_free(old_xdo);
+  XSync(context->xdo->xdpy, False);
+  xdo_ensure_keymap(context->xdo);
 
   // check which keys we need to rebind
   charcodemap_t** map_by_char = calloc(sizeof(charcodemap_t*), 1<<16);
@@ -1,4 +1,90 @@
 #include "xdo_cmd.h"
+#include <sys/time.h>
+
+/* How often --follow looks at the mouse when it can't be told it moved */
+#define FOLLOW_POLL_INTERVAL 50000
+
+static void print_location(context_t *context, int x, int y, int screen_num,
+                           Window window, int output_shell, int output_json,
+                           int follow, const char *out_prefix) {
+  if (output_json) {
+    xdotool_output(context, "{\"x\":%d,\"y\":%d,\"screen\":%d,\"window\":%ld}",
+                   x, y, screen_num, window);
+  } else if (output_shell && follow) {
+    /* One line per sample, for 'while read line; do eval "$line"; ...' */
+    xdotool_output(context, "%sX=%d %sY=%d %sSCREEN=%d %sWINDOW=%ld",
+                   out_prefix, x, out_prefix, y, out_prefix, screen_num,
+                   out_prefix, window);
+  } else if (output_shell) {
+    xdotool_output(context, "%sX=%d", out_prefix, x);
+    xdotool_output(context, "%sY=%d", out_prefix, y);
+    xdotool_output(context, "%sSCREEN=%d", out_prefix, screen_num);
+    xdotool_output(context, "%sWINDOW=%d", out_prefix, window);
+  } else {
+    xdotool_output(context, "x:%d y:%d screen:%d window:%ld", x, y, screen_num, window);
+  }
+}
+
+static long long now_usec(void) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+/* Print the mouse location whenever it changes, at most 'rate' times a
+ * second. Runs until killed. */
+static int follow_location(context_t *context, int output_shell, int output_json,
+                           const char *out_prefix, int rate) {
+  long long interval = rate > 0 ? 1000000 / rate : 0;
+  /* How long to go without looking. Warps and windows moving under the
+   * pointer make no raw events, so even the tracker must check now and
+   * then. */
+  long long poll = interval > FOLLOW_POLL_INTERVAL ? interval : FOLLOW_POLL_INTERVAL;
+  long long last_sample = 0;
+  int last_x = 0, last_y = 0, last_screen = -1;
+  Window last_window = 0;
+  int tracking;
+
+  /* With the pointer tracker, we wake up as soon as the mouse moves and
+   * poll only for moves it can't see; without it, we only poll */
+  tracking = (xdo_track_pointer(context->xdo, True) == XDO_SUCCESS);
+  if (!tracking) {
+    xdotool_debug(context, "Polling the mouse location every %dms", (int)(poll / 1000));
+  }
+
+  while (True) {
+    int x, y, screen_num;
+    Window window;
+    int ret = xdo_get_mouse_location2(context->xdo, &x, &y, &screen_num, &window);
+
+    if (ret != XDO_SUCCESS) {
+      return ret;
+    }
+    if (x != last_x || y != last_y || screen_num != last_screen
+        || window != last_window) {
+      print_location(context, x, y, screen_num, window, output_shell,
+                     output_json, True, out_prefix);
+      last_x = x;
+      last_y = y;
+      last_screen = screen_num;
+      last_window = window;
+      last_sample = now_usec();
+    }
+
+    if (tracking) {
+      /* Hold off until the next sample is allowed; all the motion in the
+       * meantime becomes that one sample */
+      long long wait = last_sample + interval - now_usec();
+      if (wait > 0) {
+        usleep(wait);
+      }
+      xdo_wait_for_pointer_event(context->xdo, poll);
+    } else {
+      usleep(poll);
+    }
+  }
+  return EXIT_SUCCESS;
+}
 
 int cmd_getmouselocation(context_t *context) {
   int x, y, screen_num;
@@ -11,14 +97,23 @@ int cmd_getmouselocation(context_t *context) {
     { "help", no_argument, NULL, 'h' },
     { "shell", no_argument, NULL, 's' },
     { "prefix", required_argument, NULL, 'p' },
+    { "json", no_argument, NULL, 'j' },
+    { "follow", no_argument, NULL, 'f' },
+    { "rate", required_argument, NULL, 'r' },
     { 0, 0, 0, 0 },
   };
   static const char *usage = 
-    "Usage: %s [--shell] [--prefix <STR>]\n"
+    "Usage: %s [--shell] [--prefix <STR>] [--json] [--follow [--rate <HZ>]]\n"
     "--shell      - output shell variables for use with eval\n"
-    "--prefix STR - use prefix for shell variables names (max 16 chars) \n";
+    "--prefix STR - use prefix for shell variables names (max 16 chars) \n"
+    "--json       - output a JSON object\n"
+    "--follow     - keep running, printing a line each time the mouse moves\n"
+    "--rate HZ    - with --follow, print at most HZ lines per second\n";
   int option_index;
   int output_shell = 0;
+  int output_json = 0;
+  int follow = 0;
+  int rate = 0;
   char out_prefix[17] = {'\0'};
 
   while ((c = getopt_long_only(context->argc, context->argv, "+h",
@@ -36,6 +131,19 @@ int cmd_getmouselocation(context_t *context) {
         strncpy(out_prefix, optarg, sizeof(out_prefix)-1);
         out_prefix[ sizeof(out_prefix)-1 ] = '\0'; //just in case
         break;
+      case 'j':
+        output_json = 1;
+        break;
+      case 'f':
+        follow = 1;
+        break;
+      case 'r':
+        rate = atoi(optarg);
+        if (rate <= 0) {
+          fprintf(stderr, "Invalid rate '%s', must be a number above 0\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
       default:
         fprintf(stderr, usage, cmd);
         return EXIT_FAILURE;
@@ -44,16 +152,17 @@ int cmd_getmouselocation(context_t *context) {
 
   consume_args(context, optind);
 
-  ret = xdo_get_mouse_location2(context->xdo, &x, &y, &screen_num, &window);
+  if (output_shell && output_json) {
+    fprintf(stderr, "--shell and --json can't be used together\n");
+    return EXIT_FAILURE;
+  }
 
-  if (output_shell) {
-    xdotool_output(context, "%sX=%d", out_prefix, x);
-    xdotool_output(context, "%sY=%d", out_prefix, y);
-    xdotool_output(context, "%sSCREEN=%d", out_prefix, screen_num);
-    xdotool_output(context, "%sWINDOW=%d", out_prefix, window);
-  } else {
-    xdotool_output(context, "x:%d y:%d screen:%d window:%ld", x, y, screen_num, window);
+  if (follow) {
+    return follow_location(context, output_shell, output_json, out_prefix, rate);
   }
+
+  ret = xdo_get_mouse_location2(context->xdo, &x, &y, &screen_num, &window);
+  print_location(context, x, y, screen_num, window, output_shell, output_json,
+                 False, out_prefix);
   return ret;
 }
-
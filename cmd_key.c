@@ -12,8 +12,8 @@ int cmd_key(context_t *context) {
   int i, j;
   int c;
   char *cmd = *context->argv;
-  charcodemap_t *active_mods = NULL;
-  int active_mods_n;
+  xdo_modifiers_t *active_mods = NULL;
+  xdo_keyseq_t **keyseqs = NULL;
   useconds_t key_delay = 12000;
   useconds_t repeat_delay = 0;
   int repeat = 1;
@@ -22,6 +22,9 @@ int cmd_key(context_t *context) {
 
   /* Options */
   int clear_modifiers = 0;
+  int server_delay = 0;
+  int interleave = 0;
+  int old_server_delay = context->xdo->server_delay;
 
   static struct option longopts[] = {
     { "clearmodifiers", no_argument, NULL, 'c' },
@@ -30,6 +33,8 @@ int cmd_key(context_t *context) {
     { "help", no_argument, NULL, 'h' },
     { "window", required_argument, NULL, 'w' },
     { "repeat", required_argument, NULL, 'r' },
+    { "server-delay", no_argument, NULL, 'S' },
+    { "interleave", no_argument, NULL, 'I' },
     { 0, 0, 0, 0 },
   };
 
@@ -39,6 +44,9 @@ int cmd_key(context_t *context) {
      "--delay DELAY        - Use DELAY milliseconds between keystrokes\n"
      "--repeat TIMES       - How many times to repeat the key sequence\n"
      "--repeat-delay DELAY - DELAY milliseconds between repetitions\n"
+     "--server-delay       - let the X server carry out the delays\n"
+     "--interleave         - send to all windows at the same time instead of\n"
+     "                       one after another (for XSendEvent targets)\n"
      "--window WINDOW      - send keystrokes to a specific window\n"
      "Each keysequence can be any number of modifiers and keys, separated by plus (+)\n"
      "  For example: alt+r\n"
@@ -81,6 +89,12 @@ int cmd_key(context_t *context) {
         /* Argument is in milliseconds, keysequence delay is in microseconds. */
         repeat_delay = strtoul(optarg, NULL, 0) * 1000;
         break;
+      case 'S': // --server-delay
+        server_delay = 1;
+        break;
+      case 'I': // --interleave
+        interleave = 1;
+        break;
       default:
         fprintf(stderr, usage, cmd);
         return EXIT_FAILURE;
@@ -100,52 +114,117 @@ int cmd_key(context_t *context) {
     window_arg = "%1";
   }
 
-  int (*keyfunc)(const xdo_t *, Window, const char *, useconds_t) = NULL;
+  int (*keyfunc)(const xdo_t *, Window, xdo_keyseq_t *, useconds_t) = NULL;
+  int (*multifunc)(const xdo_t *, const Window *, int, xdo_keyseq_t *, useconds_t) = NULL;
 
   if (!strcmp(cmd, "key")) {
-    keyfunc = xdo_send_keysequence_window;
+    keyfunc = xdo_keyseq_send_window;
+    multifunc = xdo_keyseq_send_windows;
   } else if (!strcmp(cmd, "keyup")) {
-    keyfunc = xdo_send_keysequence_window_up;
+    keyfunc = xdo_keyseq_send_window_up;
+    multifunc = xdo_keyseq_send_windows_up;
   } else if (!strcmp(cmd, "keydown")) {
-    keyfunc = xdo_send_keysequence_window_down;
+    keyfunc = xdo_keyseq_send_window_down;
+    multifunc = xdo_keyseq_send_windows_down;
   } else {
     fprintf(stderr, "Unknown command '%s'\n", cmd);
     return 1;
   }
 
+  if (server_delay) {
+    context->xdo->server_delay = True;
+  }
+
+  /* Resolve each key sequence once, no matter how often it is sent */
   int max_arg = context->argc;
-  window_each(context, window_arg, {
+  for (i = 0; i < context->argc; i++) {
+    if (is_command(context->argv[i])) {
+      max_arg = i;
+      break;
+    }
+  }
+  keyseqs = calloc(max_arg, sizeof(xdo_keyseq_t *));
+  for (i = 0; i < max_arg; i++) {
+    keyseqs[i] = xdo_keyseq_compile(context->xdo, context->argv[i]);
+  }
+
+  if (interleave) {
+    Window *windows;
+    int nwindows;
+    window_list(context, window_arg, &windows, &nwindows, False);
+
     if (clear_modifiers) {
-      xdo_get_active_modifiers(context->xdo, &active_mods, &active_mods_n);
-      xdo_clear_active_modifiers(context->xdo, window, active_mods, active_mods_n);
+      active_mods = xdo_modifiers_save(context->xdo);
+      for (i = 0; i < nwindows; i++) {
+        xdo_modifiers_clear(context->xdo, windows[i], active_mods);
+      }
     }
 
-    for (j = 0; j < repeat; j++) {
-      for (i = 0; i < context->argc; i++) {
-        if (is_command(context->argv[i])) {
-          max_arg = i;
-          break;
+    for (j = 0; j < repeat && nwindows > 0; j++) {
+      for (i = 0; i < max_arg; i++) {
+        int tmp = 1;
+        if (keyseqs[i] != NULL) {
+          tmp = multifunc(context->xdo, windows, nwindows, keyseqs[i], key_delay);
         }
-        int tmp = keyfunc(context->xdo, window, context->argv[i], key_delay);
         if (tmp != 0) {
           fprintf(stderr,
-                  "xdo_send_keysequence_window reported an error for string '%s'\n",
+                  "xdo_keyseq_send_windows reported an error for string '%s'\n",
                   context->argv[i]);
         }
         ret += tmp;
       } /* each keysequence */
 
-      /* Sleep if --repeat-delay given and not on the last repetition */
       if (repeat_delay > 0 && j < (repeat-1))  {
-        usleep(repeat_delay);
+        xdo_delay_input(context->xdo, windows[0], repeat_delay);
       }
     } /* repeat */
 
     if (clear_modifiers) {
-      xdo_set_active_modifiers(context->xdo, window, active_mods, active_mods_n);
-      free(active_mods);
+      for (i = 0; i < nwindows; i++) {
+        xdo_modifiers_restore(context->xdo, windows[i], active_mods);
+      }
+      xdo_modifiers_free(active_mods);
     }
-  }); /* window_each(...) */
+  } else {
+    window_each(context, window_arg, {
+      if (clear_modifiers) {
+        active_mods = xdo_modifiers_save(context->xdo);
+        xdo_modifiers_clear(context->xdo, window, active_mods);
+      }
+
+      for (j = 0; j < repeat; j++) {
+        for (i = 0; i < max_arg; i++) {
+          int tmp = 1;
+          if (keyseqs[i] != NULL) {
+            tmp = keyfunc(context->xdo, window, keyseqs[i], key_delay);
+          }
+          if (tmp != 0) {
+            fprintf(stderr,
+                    "xdo_send_keysequence_window reported an error for string '%s'\n",
+                    context->argv[i]);
+          }
+          ret += tmp;
+        } /* each keysequence */
+
+        /* Sleep if --repeat-delay given and not on the last repetition */
+        if (repeat_delay > 0 && j < (repeat-1))  {
+          xdo_delay_input(context->xdo, window, repeat_delay);
+        }
+      } /* repeat */
+
+      if (clear_modifiers) {
+        xdo_modifiers_restore(context->xdo, window, active_mods);
+        xdo_modifiers_free(active_mods);
+      }
+    }); /* window_each(...) */
+  }
+
+  context->xdo->server_delay = old_server_delay;
+
+  for (i = 0; i < max_arg; i++) {
+    xdo_keyseq_free(keyseqs[i]);
+  }
+  free(keyseqs);
 
   if (free_arg) {
     free((char *)window_arg);
@@ -1,4 +1,5 @@
 #include "xdo_cmd.h"
+#include <errno.h>
 #include <math.h>
 #include <string.h>
 
@@ -12,14 +13,18 @@ struct mousemove {
   int screen;
   useconds_t delay;
   int step;
+  xdo_motion_curve_t curve;
+  int jitter;
 };
 
 static int _mousemove(context_t *context, struct mousemove *mousemove);
+static int _mousemove_path(context_t *context, const char *path_arg);
 
 int cmd_mousemove(context_t *context) {
   int ret = 0;
   char *cmd = *context->argv;
   char *window_arg = NULL;
+  char *path_arg = NULL;
 
   struct mousemove mousemove;
   mousemove.clear_modifiers = 0;
@@ -29,28 +34,41 @@ int cmd_mousemove(context_t *context) {
   mousemove.x = 0;
   mousemove.y = 0;
   mousemove.step = 0;
+  mousemove.delay = 0;
+  mousemove.curve = XDO_MOTION_LINEAR;
+  mousemove.jitter = 0;
 
   int c;
   typedef enum {
     opt_unused, opt_help, opt_sync, opt_clearmodifiers, opt_polar,
-    opt_screen, opt_step, opt_delay, opt_window
+    opt_screen, opt_step, opt_delay, opt_window, opt_curve, opt_jitter,
+    opt_path
   } optlist_t;
   static struct option longopts[] = {
     { "clearmodifiers", no_argument, NULL, opt_clearmodifiers },
+    { "curve", required_argument, NULL, opt_curve },
     { "help", no_argument, NULL, opt_help},
+    { "jitter", required_argument, NULL, opt_jitter },
+    { "path", required_argument, NULL, opt_path },
     { "polar", no_argument, NULL, opt_polar },
     { "screen", required_argument, NULL, opt_screen },
-    //{ "step", required_argument, NULL, opt_step },
+    { "step", required_argument, NULL, opt_step },
     { "sync", no_argument, NULL, opt_sync },
-    //{ "delay", required_argument, NULL, opt_delay },
+    { "delay", required_argument, NULL, opt_delay },
     { "window", required_argument, NULL, opt_window },
     { 0, 0, 0, 0 },
   };
   static const char *usage = 
       "Usage: %s [options] <x> <y>\n"
+      "   or: %s --path FILE\n"
       "-c, --clearmodifiers      - reset active modifiers (alt, etc) while typing\n"
-      //"-d, --delay <MS>          - sleeptime in milliseconds between steps.\n"
-      //"--step <STEP>             - pixels to move each time along path to x,y.\n" "-p, --polar               - Use polar coordinates. X as an angle, Y as distance\n"
+      "--step <STEP>             - move along a path to x,y, STEP pixels at a time\n"
+      "-d, --delay <MS>          - sleeptime in milliseconds between steps\n"
+      "--curve <CURVE>           - shape of the path: linear, ease or bezier\n"
+      "--jitter <PIXELS>         - wander up to PIXELS off the path at each step\n"
+      "--path <FILE>             - replay the pointer path recorded in FILE,\n"
+      "                            '-' for stdin, and report the timing drift\n"
+      "-p, --polar               - Use polar coordinates. X as an angle, Y as distance\n"
       "--screen SCREEN           - which screen to move on, default is current screen\n"
       "--sync                    - only exit once the mouse has moved\n"
       "-w, --window <windowid>   - specify a window to move relative to.\n";
@@ -65,7 +83,7 @@ int cmd_mousemove(context_t *context) {
         break;
       case 'h':
       case opt_help:
-        printf(usage, cmd);
+        printf(usage, cmd, cmd);
         consume_args(context, context->argc);
         return EXIT_SUCCESS;
         break;
@@ -82,26 +100,57 @@ int cmd_mousemove(context_t *context) {
         break;
       case opt_step:
         mousemove.step = atoi(optarg);
+        if (mousemove.step <= 0) {
+          fprintf(stderr, "Invalid step '%s', must be a number above 0\n", optarg);
+          return EXIT_FAILURE;
+        }
         break;
       case 'd':
       case opt_delay:
-        mousemove.delay = strtoul(optarg, NULL, 0) * 1000;
+        /* Fractions are fine; a path can take many steps per frame */
+        mousemove.delay = strtod(optarg, NULL) * 1000;
+        break;
+      case opt_curve:
+        if (!strcmp(optarg, "linear")) {
+          mousemove.curve = XDO_MOTION_LINEAR;
+        } else if (!strcmp(optarg, "ease")) {
+          mousemove.curve = XDO_MOTION_EASE;
+        } else if (!strcmp(optarg, "bezier")) {
+          mousemove.curve = XDO_MOTION_BEZIER;
+        } else {
+          fprintf(stderr, "Unknown curve '%s', expected linear, ease or bezier\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case opt_jitter:
+        mousemove.jitter = atoi(optarg);
+        break;
+      case opt_path:
+        path_arg = optarg;
         break;
       case opt_sync:
         mousemove.opsync = 1;
         break;
       default:
         printf("unknown opt: %d\n", c);
-        fprintf(stderr, usage, cmd);
+        fprintf(stderr, usage, cmd, cmd);
         return EXIT_FAILURE;
     }
   }
 
   consume_args(context, optind);
 
+  if (path_arg != NULL) {
+    if (window_arg != NULL || mousemove.polar_coordinates || mousemove.step > 0) {
+      fprintf(stderr, "--path can't be used with --window, --polar or --step\n");
+      return EXIT_FAILURE;
+    }
+    return _mousemove_path(context, path_arg);
+  }
+
   if (context->argc < 1 \
       || (strcmp(context->argv[0], "restore") && context->argc < 2)) {
-    fprintf(stderr, usage, cmd);
+    fprintf(stderr, usage, cmd, cmd);
     fprintf(stderr, "You specified the wrong number of args (expected 2 coordinates or 'restore').\n");
     return 1;
   }
@@ -136,8 +185,7 @@ int cmd_mousemove(context_t *context) {
 
 static int _mousemove(context_t *context, struct mousemove *mousemove) {
   int ret;
-  charcodemap_t *active_mods = NULL;
-  int active_mods_n;
+  xdo_modifiers_t *active_mods = NULL;
 
   int x = mousemove->x;
   int y = mousemove->y;
@@ -187,8 +235,8 @@ static int _mousemove(context_t *context, struct mousemove *mousemove) {
 
 
   if (mousemove->clear_modifiers) {
-    xdo_get_active_modifiers(context->xdo, &active_mods, &active_mods_n);
-    xdo_clear_active_modifiers(context->xdo, window, active_mods, active_mods_n);
+    active_mods = xdo_modifiers_save(context->xdo);
+    xdo_modifiers_clear(context->xdo, window, active_mods);
   }
 
   if (mousemove->step == 0) {
@@ -198,18 +246,32 @@ static int _mousemove(context_t *context, struct mousemove *mousemove) {
       ret = xdo_move_mouse(context->xdo, x, y, screen);
     }
   } else {
+    xdo_motion_t motion;
+
+    if (window != CURRENTWINDOW && !mousemove->polar_coordinates) {
+      int win_x, win_y;
+      Screen *win_screen;
+      xdo_get_window_location(context->xdo, window, &win_x, &win_y, &win_screen);
+      x += win_x;
+      y += win_y;
+      screen = XScreenNumberOfScreen(win_screen);
+    }
+
     if (mx == x && my == y && mscreen == screen) {
       /* Nothing to move. Quit now. */
+      if (mousemove->clear_modifiers) {
+        xdo_modifiers_restore(context->xdo, window, active_mods);
+        xdo_modifiers_free(active_mods);
+      }
       return 0;
     }
-    
-    fprintf(stderr, "--step support not yet implemented\n");
 
-    if (window > 0) {
-      ret = xdo_move_mouse_relative_to_window(context->xdo, window, x, y);
-    } else {
-      ret = xdo_move_mouse(context->xdo, x, y, screen);
-    }
+    memset(&motion, 0, sizeof(motion));
+    motion.curve = mousemove->curve;
+    motion.step = mousemove->step;
+    motion.delay = mousemove->delay;
+    motion.jitter = mousemove->jitter;
+    ret = xdo_move_mouse_smooth(context->xdo, x, y, screen, &motion);
   }
 
   if (ret) {
@@ -222,9 +284,32 @@ static int _mousemove(context_t *context, struct mousemove *mousemove) {
   }
 
   if (mousemove->clear_modifiers) {
-    xdo_set_active_modifiers(context->xdo, window, active_mods, active_mods_n);
-    free(active_mods);
+    xdo_modifiers_restore(context->xdo, window, active_mods);
+    xdo_modifiers_free(active_mods);
   }
 
   return 0;
 } /* int mousemove ... */
+
+static int _mousemove_path(context_t *context, const char *path_arg) {
+  xdo_path_stats_t stats;
+  FILE *path = stdin;
+  int ret;
+
+  if (strcmp(path_arg, "-")) {
+    path = fopen(path_arg, "r");
+    if (path == NULL) {
+      fprintf(stderr, "Failure opening '%s': %s\n", path_arg, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  ret = xdo_move_mouse_path(context->xdo, path, &stats);
+  if (path != stdin) {
+    fclose(path);
+  }
+
+  xdotool_output(context, "points:%ld seconds:%.3f drift_mean:%lldus drift_max:%lldus",
+                 stats.points, stats.seconds, stats.drift_mean, stats.drift_max);
+  return ret;
+}
@@ -10,8 +10,7 @@ int cmd_mousemove_relative(context_t *context) {
   int opsync = 0;
   int origin_x = -1, origin_y = -1;
 
-  charcodemap_t *active_mods = NULL;
-  int active_mods_n;
+  xdo_modifiers_t *active_mods = NULL;
   int c;
   typedef enum {
     opt_unused, opt_help, opt_sync, opt_clearmodifiers, opt_polar
@@ -96,8 +95,8 @@ int cmd_mousemove_relative(context_t *context) {
   }
  
   if (clear_modifiers) {
-    xdo_get_active_modifiers(context->xdo, &active_mods, &active_mods_n);
-    xdo_clear_active_modifiers(context->xdo, CURRENTWINDOW, active_mods, active_mods_n);
+    active_mods = xdo_modifiers_save(context->xdo);
+    xdo_modifiers_clear(context->xdo, CURRENTWINDOW, active_mods);
   }
 
   if (opsync) {
@@ -116,8 +115,8 @@ int cmd_mousemove_relative(context_t *context) {
   }
 
   if (clear_modifiers) {
-    xdo_set_active_modifiers(context->xdo, CURRENTWINDOW, active_mods, active_mods_n);
-    free(active_mods);
+    xdo_modifiers_restore(context->xdo, CURRENTWINDOW, active_mods);
+    xdo_modifiers_free(active_mods);
   }
 
   return ret;
@@ -6,8 +6,7 @@ int cmd_mouseup(context_t *context) {
   int button;
   char *cmd = *context->argv;
   char *window_arg = NULL;
-  charcodemap_t *active_mods = NULL;
-  int active_mods_n;
+  xdo_modifiers_t *active_mods = NULL;
   int clear_modifiers = 0;
 
   int c;
@@ -55,15 +54,15 @@ int cmd_mouseup(context_t *context) {
 
   window_each(context, window_arg, {
     if (clear_modifiers) {
-      xdo_get_active_modifiers(context->xdo, &active_mods, &active_mods_n);
-      xdo_clear_active_modifiers(context->xdo, window, active_mods, active_mods_n);
+      active_mods = xdo_modifiers_save(context->xdo);
+      xdo_modifiers_clear(context->xdo, window, active_mods);
     }
 
     ret = xdo_mouse_up(context->xdo, window, button);
 
     if (clear_modifiers) {
-      xdo_set_active_modifiers(context->xdo, window, active_mods, active_mods_n);
-      free(active_mods);
+      xdo_modifiers_restore(context->xdo, window, active_mods);
+      xdo_modifiers_free(active_mods);
     }
 
     if (ret) {
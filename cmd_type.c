@@ -2,6 +2,189 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* How long to wait for the window to ask for pasted text */
+#define PASTE_TIMEOUT 5000000
+
+/* How long to wait for the selection's owner when saving what it holds */
+#define SAVE_SELECTION_TIMEOUT 1000000
+
+/* How much of --file to read at a time. Each read is typed as soon as it
+ * is in, so this bounds memory use, not how soon typing starts. */
+#define FILE_CHUNK 65536
+
+/* Longest delay between keystrokes --adaptive backs off to, unless
+ * --delay says otherwise */
+#define ADAPTIVE_MAX_DELAY 50000
+
+typedef struct type_options {
+  int via_selection;
+  const char *selection;
+  const char *paste_keys;
+  int batch;
+  int adaptive;
+  int interleave;
+  useconds_t delay;
+
+  /* What --adaptive achieved so far */
+  size_t adaptive_chars;
+  double adaptive_seconds;
+} type_options_t;
+
+static int type_string(context_t *context, Window window, const char *text,
+                       type_options_t *opts) {
+  int ret;
+
+  if (opts->via_selection) {
+    ret = xdo_enter_text_window_selection(context->xdo, window, text, opts->selection,
+                                          opts->paste_keys, PASTE_TIMEOUT);
+  } else if (opts->adaptive) {
+    xdo_typing_stats_t stats;
+    ret = xdo_enter_text_window_adaptive(context->xdo, window, text, opts->delay, &stats);
+    xdotool_debug(context, "Adaptive typing: %.0f chars/sec, ending with a %uus delay "
+                  "after %d backoffs (%s)", stats.chars_per_sec,
+                  (unsigned int)stats.final_delay, stats.backoffs,
+                  stats.used_ping ? "_NET_WM_PING" : "XSync");
+    opts->adaptive_chars += stats.chars;
+    opts->adaptive_seconds += stats.seconds;
+  } else if (opts->batch) {
+    ret = xdo_enter_text_window_batch(context->xdo, window, text, 0, opts->delay);
+  } else {
+    ret = xdo_enter_text_window(context->xdo, window, text, opts->delay);
+  }
+
+  if (ret) {
+    fprintf(stderr, "xdo_enter_text_window reported an error\n");
+  }
+  return ret;
+}
+
+/* Put back the text that was in the selection before we pasted through
+ * it. Its owner lost it to us, so a process of our own has to serve it
+ * from now on, until another client takes the selection. */
+static void restore_selection(context_t *context, const char *selection,
+                              const char *text) {
+  pid_t child = fork();
+
+  if (child == 0) {
+    /* Fork again so the server is nobody's child to wait for */
+    if (fork() == 0) {
+      int devnull = open("/dev/null", O_RDWR);
+      xdo_t *xdo;
+
+      /* Don't keep whoever ran us waiting for our output */
+      dup2(devnull, 0);
+      dup2(devnull, 1);
+      dup2(devnull, 2);
+      setsid();
+      xdo = xdo_new(context->xdo->display_name);
+      if (xdo != NULL) {
+        xdo_serve_selection(xdo, selection, text);
+        xdo_free(xdo);
+      }
+    }
+    _exit(0);
+  } else if (child < 0) {
+    fprintf(stderr, "Can't restore the %s selection: %s\n", selection,
+            strerror(errno));
+  } else {
+    waitpid(child, NULL, 0);
+  }
+}
+
+/* Type text into every window of window_arg */
+static int type_windows(context_t *context, const char *window_arg, const char *text,
+                        type_options_t *opts) {
+  int ret = 0;
+
+  if (opts->interleave) {
+    Window *windows;
+    int nwindows;
+    window_list(context, window_arg, &windows, &nwindows, False);
+    if (nwindows > 0) {
+      ret = xdo_enter_text_windows(context->xdo, windows, nwindows, text, opts->delay);
+      if (ret) {
+        fprintf(stderr, "xdo_enter_text_windows reported an error\n");
+      }
+    }
+    return ret;
+  }
+
+  window_each(context, window_arg, {
+    ret += type_string(context, window, text, opts);
+  }); /* window_each(...) */
+  return ret;
+}
+
+/* How much of buf can be typed now: everything up to a UTF-8 sequence cut
+ * off at the end, which has to wait for the next read. */
+static size_t utf8_complete_length(const char *buf, size_t len) {
+  size_t back;
+
+  for (back = 1; back <= 3 && back <= len; back++) {
+    unsigned char c = buf[len - back];
+    size_t need;
+    if ((c & 0xc0) == 0x80) {
+      continue; /* continuation byte, keep looking for the lead byte */
+    }
+    need = (c >= 0xf0) ? 4 : (c >= 0xe0) ? 3 : (c >= 0xc0) ? 2 : 1;
+    return (need > back) ? len - back : len;
+  }
+  return len;
+}
+
+/* Type what is read from fd as it comes in, with constant memory use */
+static int type_stream(context_t *context, const char *window_arg, int fd,
+                       const char *file, type_options_t *opts) {
+  char *buffer = malloc(FILE_CHUNK + 1);
+  size_t have = 0, len;
+  ssize_t bytes;
+  int ret = 0;
+  int eof = 0;
+
+  if (buffer == NULL) {
+    fprintf(stderr, "Failure allocating for '%s': %s\n", file, strerror(errno));
+    return 1;
+  }
+
+  while (!eof) {
+    bytes = read(fd, buffer + have, FILE_CHUNK - have);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failure reading '%s': %s\n", file, strerror(errno));
+      ret++;
+      break;
+    }
+
+    if (bytes == 0) {
+      /* Type whatever is left, so a broken sequence at the end is reported */
+      eof = 1;
+      len = have;
+    } else {
+      have += bytes;
+      len = utf8_complete_length(buffer, have);
+    }
+    if (len == 0) {
+      continue;
+    }
+
+    char saved = buffer[len];
+    buffer[len] = '\0';
+    ret += type_windows(context, window_arg, buffer, opts);
+    buffer[len] = saved;
+
+    memmove(buffer, buffer + len, have - len);
+    have -= len;
+  }
+
+  free(buffer);
+  return ret;
+}
 
 int cmd_type(context_t *context) {
   int ret = 0;
@@ -12,25 +195,33 @@ int cmd_type(context_t *context) {
   int arity = -1;
   char *terminator = NULL;
   char *file = NULL;
-
-  FILE *input = NULL;
-  char *buffer = NULL;
-  char *marker = NULL;
-  size_t bytes_read = 0;
+  int input = -1;
 
   char **data = NULL; /* stuff to type */
   int data_count = 0;
   int args_count = 0;
-  charcodemap_t *active_mods = NULL;
-  int active_mods_n;
+  xdo_modifiers_t *active_mods = NULL;
+  char *saved_selection = NULL; /* what --via-selection pastes over */
 
   /* Options */
   int clear_modifiers = 0;
-  useconds_t delay = 12000; /* 12ms between keystrokes default */
+  int server_delay = 0;
+  int old_server_delay = context->xdo->server_delay;
+  int delay_given = 0;
+  type_options_t opts = {
+    .via_selection = 0,
+    .selection = "CLIPBOARD",
+    .paste_keys = NULL,
+    .batch = 0,
+    .adaptive = 0,
+    .interleave = 0,
+    .delay = 12000, /* 12ms between keystrokes default */
+  };
 
   typedef enum {
     opt_unused, opt_clearmodifiers, opt_delay, opt_help, opt_window, opt_args,
-    opt_terminator, opt_file
+    opt_terminator, opt_file, opt_batch, opt_server_delay, opt_via_selection,
+    opt_selection, opt_paste_keys, opt_adaptive, opt_interleave
   } optlist_t;
 
   struct option longopts[] = {
@@ -41,6 +232,13 @@ int cmd_type(context_t *context) {
     { "args", required_argument, NULL, opt_args },
     { "terminator", required_argument, NULL, opt_terminator },
     { "file", required_argument, NULL, opt_file },
+    { "batch", no_argument, NULL, opt_batch },
+    { "server-delay", no_argument, NULL, opt_server_delay },
+    { "via-selection", no_argument, NULL, opt_via_selection },
+    { "selection", required_argument, NULL, opt_selection },
+    { "paste-keys", required_argument, NULL, opt_paste_keys },
+    { "adaptive", no_argument, NULL, opt_adaptive },
+    { "interleave", no_argument, NULL, opt_interleave },
     { 0, 0, 0, 0 },
   };
 
@@ -59,6 +257,23 @@ int cmd_type(context_t *context) {
     "--file <filepath> - specify a file, the contents of which will be\n"
     "                    be typed as if passed as an argument. The filepath\n"
     "                    may also be '-' to read from stdin.\n"
+    "--batch           - send the text as one batch of events, flushing\n"
+    "                    once per chunk instead of syncing every key.\n"
+    "                    --delay then applies between chunks.\n"
+    "--server-delay    - let the X server carry out --delay and send the\n"
+    "                    text in one go.\n"
+    "--via-selection   - paste the text instead of typing it. Much faster\n"
+    "                    for large texts. The selection is restored.\n"
+    "--selection NAME  - selection to paste through, CLIPBOARD (default)\n"
+    "                    or PRIMARY. Implies --via-selection.\n"
+    "--paste-keys KEYS - keys that paste the selection. Defaults to\n"
+    "                    ctrl+v for CLIPBOARD and shift+Insert otherwise.\n"
+    "--adaptive        - type as fast as the window keeps up with, and\n"
+    "                    print the chars/sec achieved. --delay is the\n"
+    "                    slowest it will go (default 50).\n"
+    "--interleave      - type into all windows at the same time instead\n"
+    "                    of one after another. Only for windows that get\n"
+    "                    keys with XSendEvent.\n"
             "-h, --help             - show this help output\n"
     HELP_SEE_WINDOW_STACK;
   int option_index;
@@ -71,7 +286,8 @@ int cmd_type(context_t *context) {
         break;
       case opt_delay:
         /* --delay is in milliseconds, convert to microseconds */
-        delay = strtoul(optarg, NULL, 0) * 1000;
+        opts.delay = strtoul(optarg, NULL, 0) * 1000;
+        delay_given = 1;
         break;
       case opt_clearmodifiers:
         clear_modifiers = 1;
@@ -90,6 +306,27 @@ int cmd_type(context_t *context) {
       case opt_file:
 	file = strdup(optarg);
 	break;
+      case opt_batch:
+        opts.batch = 1;
+        break;
+      case opt_server_delay:
+        server_delay = 1;
+        break;
+      case opt_selection:
+        opts.selection = optarg;
+        /* fall through */
+      case opt_via_selection:
+        opts.via_selection = 1;
+        break;
+      case opt_paste_keys:
+        opts.paste_keys = optarg;
+        break;
+      case opt_adaptive:
+        opts.adaptive = 1;
+        break;
+      case opt_interleave:
+        opts.interleave = 1;
+        break;
       default:
         fprintf(stderr, usage, cmd);
         return EXIT_FAILURE;
@@ -115,49 +352,38 @@ int cmd_type(context_t *context) {
     return EXIT_FAILURE;
   }
 
-  if (file != NULL) {
-    data = calloc(1 + context->argc, sizeof(char *));
+  if (opts.interleave && (opts.via_selection || opts.adaptive || opts.batch)) {
+    fprintf(stderr, "--interleave can't be used with --via-selection, --adaptive "
+            "or --batch.\n");
+    return EXIT_FAILURE;
+  }
 
-    /* determine whether reading from a file or from stdin */
+  if (opts.paste_keys == NULL) {
+    opts.paste_keys = strcmp(opts.selection, "CLIPBOARD") ? "shift+Insert" : "ctrl+v";
+  }
+
+  /* The per-keystroke default delay makes no sense between whole chunks */
+  if (opts.batch && !delay_given) {
+    opts.delay = 0;
+  }
+  if (opts.adaptive && !delay_given) {
+    opts.delay = ADAPTIVE_MAX_DELAY;
+  }
+
+  if (file != NULL) {
+    /* determine whether reading from a file or from stdin. The file is
+     * typed as it is read, see type_stream. */
     if (!strcmp(file, "-")) {
-      input = fdopen(0, "r");
+      input = 0;
     } else {
-      input = fopen(file, "r");
-      if (input == NULL) {
+      input = open(file, O_RDONLY);
+      if (input < 0) {
         fprintf(stderr, "Failure opening '%s': %s\n", file, strerror(errno));
         return EXIT_FAILURE;
       }
     }
-
-    while (feof(input) == 0) {
-      marker = realloc(buffer, bytes_read + 4096);
-      if (marker == NULL) {
-        fprintf(stderr, "Failure allocating for '%s': %s\n", file, strerror(errno));
-        return EXIT_FAILURE;
-      }
-
-      buffer = marker;
-      marker = buffer + bytes_read;
-      if (fgets(marker, 4096, input) != NULL) {
-        bytes_read = (marker - buffer) + strlen(marker);
-      } else {
-        *marker = 0;
-      }
-
-      if (ferror(input) != 0) {
-        fprintf(stderr, "Failure reading '%s': %s\n", file, strerror(errno));
-        return EXIT_FAILURE;
-      }
-    }
-
-    data[0] = buffer;
-    data_count++;
-
-    fclose(input);
-  }
-  else {
-    data = calloc(context->argc, sizeof(char *));
   }
+  data = calloc(context->argc + 1, sizeof(char *));
 
   /* Apply any --arity or --terminator */
   for (i=0; i < context->argc; i++) {
@@ -179,29 +405,61 @@ int cmd_type(context_t *context) {
     args_count++;
   }
 
-  window_each(context, window_arg, {
-    if (clear_modifiers) {
-      xdo_get_active_modifiers(context->xdo, &active_mods, &active_mods_n);
-      xdo_clear_active_modifiers(context->xdo, window, active_mods, active_mods_n);
-    }
+  if (server_delay) {
+    context->xdo->server_delay = True;
+  }
 
-    for (i = 0; i < data_count; i++) {
-      //printf("Typing: '%s'\n", context->argv[i]);
-      int tmp = xdo_enter_text_window(context->xdo, window, data[i], delay);
+  if (clear_modifiers) {
+    active_mods = xdo_modifiers_save(context->xdo);
+    window_each(context, window_arg, {
+      xdo_modifiers_clear(context->xdo, window, active_mods);
+    }); /* window_each(...) */
+  }
 
-      if (tmp) {
-        fprintf(stderr, "xdo_enter_text_window reported an error\n");
-      }
+  if (opts.via_selection) {
+    xdo_get_selection(context->xdo, opts.selection, &saved_selection,
+                      SAVE_SELECTION_TIMEOUT);
+  }
 
-      ret += tmp;
+  if (input >= 0) {
+    ret += type_stream(context, window_arg, input, file, &opts);
+    if (input != 0) {
+      close(input);
     }
+  }
 
-    if (clear_modifiers) {
-      xdo_set_active_modifiers(context->xdo, window, active_mods, active_mods_n);
-      free(active_mods);
+  if (opts.interleave) {
+    for (i = 0; i < data_count; i++) {
+      ret += type_windows(context, window_arg, data[i], &opts);
     }
-  }); /* window_each(...) */
+  } else {
+    window_each(context, window_arg, {
+      for (i = 0; i < data_count; i++) {
+        //printf("Typing: '%s'\n", context->argv[i]);
+        ret += type_string(context, window, data[i], &opts);
+      }
+    }); /* window_each(...) */
+  }
+
+  if (saved_selection != NULL) {
+    restore_selection(context, opts.selection, saved_selection);
+    free(saved_selection);
+  }
+
+  if (clear_modifiers) {
+    window_each(context, window_arg, {
+      xdo_modifiers_restore(context->xdo, window, active_mods);
+    }); /* window_each(...) */
+    xdo_modifiers_free(active_mods);
+  }
+
+  if (opts.adaptive) {
+    xdotool_output(context, "%lu chars in %.3f seconds (%.0f chars/sec)",
+                   (unsigned long)opts.adaptive_chars, opts.adaptive_seconds,
+                   opts.adaptive_seconds > 0 ? opts.adaptive_chars / opts.adaptive_seconds : 0);
+  }
 
+  context->xdo->server_delay = old_server_delay;
   free(data);
 
   consume_args(context, args_count);
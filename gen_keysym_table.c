@@ -0,0 +1,328 @@
+/* Generate xdo_keysym_table.h, the key name tables used by libxdo.
+ *
+ * Reads the keysym definitions from X11/keysymdef.h and friends, adds the
+ * aliases from xdo_util.h and writes out:
+ *   - keysym_names, every name and its keysym, grouped by case-folded name
+ *   - a perfect hash (hash and displace) over the case-folded names
+ *   - keysym_values, indexes into keysym_names sorted by keysym
+ *
+ * usage: gen_keysym_table keysymdef.h [XF86keysym.h ...] > xdo_keysym_table.h
+ */
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 500
+#endif /* _XOPEN_SOURCE */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "xdo_util.h"
+
+/* Kernel keycodes mapped by XF86keysym.h's _EVDEVK() */
+#define EVDEVK_BASE 0x10081000UL
+
+/* The perfect hash has KEYSYM_NAME_SLOTS >= 9/8 of the folded names and
+ * about three names per bucket, which finds displacements quickly. */
+#define SLOT_LOAD_NUM 9
+#define SLOT_LOAD_DEN 8
+#define BUCKET_SIZE 3
+#define MAX_DISPLACEMENT 1000000
+
+typedef struct entry {
+  char *name;
+  unsigned long keysym;
+  int order; /* the order names were read in */
+  int alias;
+  unsigned int hash; /* keysym_name_hash(name) */
+} entry_t;
+
+static entry_t *entries = NULL;
+static int nentries = 0;
+static int entries_size = 0;
+
+static void add_entry(const char *name, unsigned long keysym, int alias) {
+  int i;
+
+  for (i = 0; i < nentries; i++) {
+    if (strcmp(entries[i].name, name) == 0) {
+      return;
+    }
+  }
+
+  if (nentries == entries_size) {
+    entries_size = entries_size ? entries_size * 2 : 1024;
+    entries = realloc(entries, entries_size * sizeof(entry_t));
+  }
+  entries[nentries].name = strdup(name);
+  entries[nentries].keysym = keysym;
+  entries[nentries].order = nentries;
+  entries[nentries].alias = alias;
+  nentries++;
+}
+
+static int find_entry(const char *name) {
+  int i;
+  for (i = 0; i < nentries; i++) {
+    if (strcmp(entries[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Parse '#define [XF86]XK_name value' lines. Anything else is skipped. */
+static int read_keysyms(const char *path) {
+  FILE *fp = fopen(path, "r");
+  char line[1024];
+
+  if (fp == NULL) {
+    perror(path);
+    return 1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char symbol[256], value[256], name[256];
+    unsigned long keysym;
+    char *end;
+
+    if (sscanf(line, "#define %255s %255s", symbol, value) != 2) {
+      continue;
+    }
+
+    if (strncmp(symbol, "XK_", 3) == 0) {
+      snprintf(name, sizeof(name), "%s", symbol + 3);
+    } else if (strncmp(symbol, "XF86XK_", 7) == 0) {
+      snprintf(name, sizeof(name), "XF86%s", symbol + 7);
+    } else {
+      continue;
+    }
+
+    if (strncmp(value, "_EVDEVK(", 8) == 0) {
+      keysym = EVDEVK_BASE + strtoul(value + 8, &end, 16);
+      if (*end != ')') {
+        continue;
+      }
+    } else {
+      keysym = strtoul(value, &end, 16);
+      if (strncmp(value, "0x", 2) != 0 || *end != '\0') {
+        continue;
+      }
+    }
+    add_entry(name, keysym, 0);
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+static int cmp_folded(const void *a, const void *b) {
+  const entry_t *x = a, *y = b;
+  int ret = strcasecmp(x->name, y->name);
+  return ret ? ret : x->order - y->order;
+}
+
+static int cmp_keysym(const void *a, const void *b) {
+  const entry_t *x = entries + *(const int *)a, *y = entries + *(const int *)b;
+  if (x->keysym != y->keysym) {
+    return x->keysym < y->keysym ? -1 : 1;
+  }
+  return x->order - y->order;
+}
+
+typedef struct bucket {
+  int *groups; /* index of the first entry of each name in this bucket */
+  int len;
+  int size;
+  int hash; /* where the bucket's displacement goes */
+} bucket_t;
+
+static int cmp_bucket_len(const void *a, const void *b) {
+  return ((const bucket_t *)b)->len - ((const bucket_t *)a)->len;
+}
+
+int main(int argc, char **argv) {
+  int naliases = 0;
+  int ngroups = 0;
+  int nbuckets, nslots, nvalues = 0;
+  int *slots, *values, *slot_owner;
+  unsigned int *displacements;
+  bucket_t *buckets;
+  int i, j, k;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s keysymdef.h [more keysym headers ...]\n", argv[0]);
+    return 1;
+  }
+
+  for (i = 1; i < argc; i++) {
+    if (read_keysyms(argv[i]) != 0) {
+      return 1;
+    }
+  }
+
+  /* Aliases must name known keysyms */
+  for (i = 0; symbol_map[i] != NULL; i += 2) {
+    int target = find_entry(symbol_map[i + 1]);
+    if (target < 0) {
+      fprintf(stderr, "Alias '%s' names unknown keysym '%s'\n",
+              symbol_map[i], symbol_map[i + 1]);
+      return 1;
+    }
+    add_entry(symbol_map[i], entries[target].keysym, 1);
+    naliases++;
+  }
+
+  /* Aliases match in any case and win, so names they shadow are dropped */
+  for (i = 0, j = 0; i < nentries; i++) {
+    int shadowed = 0;
+    if (!entries[i].alias) {
+      for (k = 0; symbol_map[k] != NULL; k += 2) {
+        if (strcasecmp(entries[i].name, symbol_map[k]) == 0) {
+          shadowed = 1;
+        }
+      }
+    }
+    if (shadowed) {
+      free(entries[i].name);
+    } else {
+      entries[j++] = entries[i];
+    }
+  }
+  nentries = j;
+
+  qsort(entries, nentries, sizeof(entry_t), cmp_folded);
+  for (i = 0; i < nentries; i++) {
+    if (i == 0 || strcasecmp(entries[i - 1].name, entries[i].name) != 0) {
+      ngroups++;
+    }
+  }
+
+  nslots = ngroups * SLOT_LOAD_NUM / SLOT_LOAD_DEN + 1;
+  nbuckets = ngroups / BUCKET_SIZE + 1;
+  buckets = calloc(nbuckets, sizeof(bucket_t));
+  displacements = calloc(nbuckets, sizeof(unsigned int));
+  slots = malloc(nslots * sizeof(int));
+  slot_owner = calloc(nslots, sizeof(int));
+  for (i = 0; i < nslots; i++) {
+    slots[i] = -1;
+  }
+
+  for (i = 0; i < nentries; i++) {
+    bucket_t *b;
+    if (i > 0 && strcasecmp(entries[i - 1].name, entries[i].name) == 0) {
+      continue;
+    }
+    entries[i].hash = keysym_name_hash(entries[i].name);
+    b = buckets + keysym_name_seed(entries[i].hash, 0) % nbuckets;
+    if (b->len == b->size) {
+      b->size = b->size ? b->size * 2 : 4;
+      b->groups = realloc(b->groups, b->size * sizeof(int));
+    }
+    b->groups[b->len++] = i;
+  }
+
+  /* Place the biggest buckets first, while the table is still empty */
+  for (i = 0; i < nbuckets; i++) {
+    buckets[i].hash = i;
+  }
+  qsort(buckets, nbuckets, sizeof(bucket_t), cmp_bucket_len);
+
+  for (i = 0; i < nbuckets && buckets[i].len > 0; i++) {
+    bucket_t *b = buckets + i;
+    unsigned int d;
+
+    for (d = 1; d < MAX_DISPLACEMENT; d++) {
+      int ok = 1;
+      for (j = 0; j < b->len && ok; j++) {
+        int slot = keysym_name_seed(entries[b->groups[j]].hash, d) % nslots;
+        /* slot_owner tells our own tentative slots apart from taken ones */
+        if (slots[slot] != -1 || slot_owner[slot] == (int)d + 1) {
+          ok = 0;
+        }
+        slot_owner[slot] = d + 1;
+      }
+      for (j = 0; j < b->len; j++) {
+        slot_owner[keysym_name_seed(entries[b->groups[j]].hash, d) % nslots] = 0;
+      }
+      if (ok) {
+        break;
+      }
+    }
+    if (d == MAX_DISPLACEMENT) {
+      fprintf(stderr, "Failed to build the key name hash table\n");
+      return 1;
+    }
+
+    displacements[b->hash] = d;
+    for (j = 0; j < b->len; j++) {
+      slots[keysym_name_seed(entries[b->groups[j]].hash, d) % nslots] = b->groups[j];
+    }
+  }
+
+  /* One name per keysym for keysym_values: the first one defined */
+  values = malloc(nentries * sizeof(int));
+  for (i = 0; i < nentries; i++) {
+    if (!entries[i].alias) {
+      values[nvalues++] = i;
+    }
+  }
+  qsort(values, nvalues, sizeof(int), cmp_keysym);
+  for (i = 0, j = 0; i < nvalues; i++) {
+    if (j == 0 || entries[values[j - 1]].keysym != entries[values[i]].keysym) {
+      values[j++] = values[i];
+    }
+  }
+  nvalues = j;
+
+  printf("/* Generated by gen_keysym_table from");
+  for (i = 1; i < argc; i++) {
+    printf(" %s", argv[i]);
+  }
+  printf(".\n * Do not edit. */\n\n");
+  printf("#ifndef _XDO_KEYSYM_TABLE_H_\n");
+  printf("#define _XDO_KEYSYM_TABLE_H_\n\n");
+  printf("typedef struct keysym_name {\n");
+  printf("  const char *name;\n");
+  printf("  KeySym keysym;\n");
+  printf("} keysym_name_t;\n\n");
+  printf("#define KEYSYM_NAMES_LEN %d\n", nentries);
+  printf("#define KEYSYM_NAME_ALIASES %d\n", naliases);
+  printf("#define KEYSYM_NAME_BUCKETS %d\n", nbuckets);
+  printf("#define KEYSYM_NAME_SLOTS %d\n", nslots);
+  printf("#define KEYSYM_NAME_EMPTY 0xffff\n");
+  printf("#define KEYSYM_VALUES_LEN %d\n\n", nvalues);
+
+  printf("/* Sorted by case-folded name, so names that differ only in case are\n");
+  printf(" * adjacent */\n");
+  printf("static const keysym_name_t keysym_names[KEYSYM_NAMES_LEN] = {\n");
+  for (i = 0; i < nentries; i++) {
+    printf("  { \"%s\", 0x%lx },\n", entries[i].name, entries[i].keysym);
+  }
+  printf("};\n\n");
+
+  printf("/* Seed for the second hash, by keysym_name_seed(hash, 0) %% KEYSYM_NAME_BUCKETS */\n");
+  printf("static const unsigned int keysym_name_displacements[KEYSYM_NAME_BUCKETS] = {");
+  for (i = 0; i < nbuckets; i++) {
+    printf("%s%u,", (i % 12) ? " " : "\n  ", displacements[i]);
+  }
+  printf("\n};\n\n");
+
+  printf("/* First entry of each name, by keysym_name_seed(hash, seed) %% KEYSYM_NAME_SLOTS */\n");
+  printf("static const unsigned short keysym_name_slots[KEYSYM_NAME_SLOTS] = {");
+  for (i = 0; i < nslots; i++) {
+    printf("%s%d,", (i % 12) ? " " : "\n  ", slots[i] < 0 ? 0xffff : slots[i]);
+  }
+  printf("\n};\n\n");
+
+  printf("/* Indexes into keysym_names, sorted by keysym */\n");
+  printf("static const unsigned short keysym_values[KEYSYM_VALUES_LEN] = {");
+  for (i = 0; i < nvalues; i++) {
+    printf("%s%d,", (i % 12) ? " " : "\n  ", values[i]);
+  }
+  printf("\n};\n\n");
+  printf("#endif /* ifndef _XDO_KEYSYM_TABLE_H_ */\n");
+
+  return 0;
+}
@@ -0,0 +1,92 @@
+/* Microbenchmark for charcode map lookups.
+ *
+ * Compares the old linear walk of xdo->charcodes against the hashed
+ * indexes built by _xdo_populate_charcode_map. Needs a running X server;
+ * 'make bench' runs it under an ephemeral Xvfb.
+ */
+
+/* Yes, I know including .c files is insanity. */
+#include "../xdo.c"
+
+#include <time.h>
+
+#define ITERATIONS 200
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The lookups as they were before the charcode map was indexed */
+static int linear_by_char(const xdo_t *xdo, wchar_t key) {
+  int i;
+  for (i = 0; i < xdo->charcodes_len; i++) {
+    if (xdo->charcodes[i].key == key) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int linear_by_keysym(const xdo_t *xdo, KeySym keysym) {
+  int i;
+  for (i = 0; i < xdo->charcodes_len; i++) {
+    if (xdo->charcodes[i].symbol == keysym) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int main(void) {
+  xdo_t *xdo = xdo_new(NULL);
+  wchar_t text[128];
+  int ntext = 0;
+  int i, iter;
+  long found = 0, lookups = 0;
+  double start, linear_time, indexed_time;
+
+  if (xdo == NULL) {
+    return 1;
+  }
+  xdo_ensure_keymap(xdo);
+
+  /* Printable ASCII is what most 'type' payloads consist of */
+  for (i = 0x20; i < 0x7f; i++) {
+    text[ntext++] = i;
+  }
+
+  start = now();
+  for (iter = 0; iter < ITERATIONS; iter++) {
+    for (i = 0; i < ntext; i++) {
+      int idx = linear_by_char(xdo, text[i]);
+      if (idx >= 0) {
+        found += linear_by_keysym(xdo, xdo->charcodes[idx].symbol) >= 0;
+      }
+      lookups++;
+    }
+  }
+  linear_time = now() - start;
+
+  start = now();
+  for (iter = 0; iter < ITERATIONS; iter++) {
+    for (i = 0; i < ntext; i++) {
+      int idx = _xdo_charcode_index_by_char(xdo, text[i]);
+      if (idx >= 0) {
+        found -= _xdo_charcode_index_by_keysym(xdo, xdo->charcodes[idx].symbol) >= 0;
+      }
+    }
+  }
+  indexed_time = now() - start;
+
+  printf("charcode map: %d entries, index size %d\n",
+         xdo->charcodes_len, xdo->charcodes_index_size);
+  printf("linear:  %.0f lookups/sec\n", lookups / linear_time);
+  printf("indexed: %.0f lookups/sec\n", lookups / indexed_time);
+
+  xdo_free(xdo);
+
+  /* Both passes must agree on what they found */
+  return found != 0;
+}
@@ -0,0 +1,91 @@
+/* Window-targeted click benchmark.
+ *
+ * Sends clicks to a window with XSendEvent the way _xdo_mousebutton used
+ * to, querying the pointer location, modifiers and input state for every
+ * press and release, and then with xdo_click_window and
+ * xdo_click_window_multiple, and reports clicks per second for each.
+ * Needs a running X server; 'make bench' runs it under an ephemeral Xvfb.
+ */
+
+/* Yes, I know including .c files is insanity. */
+#include "../xdo.c"
+
+#include <time.h>
+
+#define CLICKS 2000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One edge of a click as it was sent before the event template */
+static void old_mousebutton(const xdo_t *xdo, Window window, int button, int is_press) {
+  int screen = 0;
+  XButtonEvent xbpe;
+  charcodemap_t *active_mod;
+  int active_mod_n;
+
+  xdo_get_mouse_location(xdo, &xbpe.x_root, &xbpe.y_root, &screen);
+  xdo_get_active_modifiers(xdo, &active_mod, &active_mod_n);
+
+  xbpe.window = window;
+  xbpe.button = button;
+  xbpe.display = xdo->xdpy;
+  xbpe.root = RootWindow(xdo->xdpy, screen);
+  xbpe.same_screen = True;
+  xbpe.state = xdo_get_input_state(xdo);
+  xbpe.subwindow = None;
+  xbpe.time = CurrentTime;
+  xbpe.type = (is_press ? ButtonPress : ButtonRelease);
+  XTranslateCoordinates(xdo->xdpy, xbpe.root, xbpe.window,
+                        xbpe.x_root, xbpe.y_root, &xbpe.x, &xbpe.y, &xbpe.subwindow);
+  if (!is_press) {
+    xbpe.state |= Button1MotionMask << (button - 1);
+  }
+  XSendEvent(xdo->xdpy, window, True, ButtonPressMask, (XEvent *)&xbpe);
+  XFlush(xdo->xdpy);
+  free(active_mod);
+}
+
+int main(void) {
+  xdo_t *xdo = xdo_new(NULL);
+  Window window;
+  double start, elapsed;
+  int i;
+
+  if (xdo == NULL) {
+    return 1;
+  }
+  window = XCreateSimpleWindow(xdo->xdpy, DefaultRootWindow(xdo->xdpy),
+                               0, 0, 100, 100, 0, 0, 0);
+
+  start = now();
+  for (i = 0; i < CLICKS; i++) {
+    old_mousebutton(xdo, window, 1, True);
+    xdo_delay_input(xdo, window, DEFAULT_DELAY);
+    old_mousebutton(xdo, window, 1, False);
+  }
+  XSync(xdo->xdpy, False);
+  elapsed = now() - start;
+  printf("query per edge:   %.0f clicks/sec\n", CLICKS / elapsed);
+
+  start = now();
+  for (i = 0; i < CLICKS; i++) {
+    xdo_click_window(xdo, window, 1);
+  }
+  XSync(xdo->xdpy, False);
+  elapsed = now() - start;
+  printf("query per click:  %.0f clicks/sec\n", CLICKS / elapsed);
+
+  start = now();
+  xdo_click_window_multiple(xdo, window, 1, CLICKS, 0);
+  XSync(xdo->xdpy, False);
+  elapsed = now() - start;
+  printf("query per burst:  %.0f clicks/sec\n", CLICKS / elapsed);
+
+  XDestroyWindow(xdo->xdpy, window);
+  xdo_free(xdo);
+  return 0;
+}
@@ -0,0 +1,76 @@
+/* Microbenchmark for key name lookups.
+ *
+ * Compares the old alias walk of symbol_map followed by XStringToKeysym
+ * against the generated table in xdo_keysym_table.h, for the kind of names
+ * found in hotkey chords. 'make bench' runs it under an ephemeral Xvfb,
+ * though it does not talk to the X server.
+ */
+
+/* Yes, I know including .c files is insanity. */
+#include "../xdo.c"
+
+#include <time.h>
+
+#define ITERATIONS 20000
+
+static const char *names[] = {
+  "ctrl", "alt", "shift", "super", "Return", "Escape", "Tab", "space",
+  "a", "z", "A", "Z", "1", "F1", "F12", "Left", "Page_Down", "BackSpace",
+  "Delete", "Home", "KP_Enter", "Print", "XF86AudioPlay", "XF86AudioRaiseVolume",
+  "XF86MonBrightnessUp", "Super_L", "Control_R", "bracketleft", "aacute", "Multi_key",
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The lookup as it was before the generated table */
+static KeySym old_lookup(const char *tok) {
+  int i;
+  for (i = 0; symbol_map[i] != NULL; i += 2) {
+    if (!strcasecmp(tok, symbol_map[i])) {
+      tok = symbol_map[i + 1];
+    }
+  }
+  return XStringToKeysym(tok);
+}
+
+int main(void) {
+  int nnames = sizeof(names) / sizeof(names[0]);
+  int i, iter, mismatches = 0;
+  long lookups = 0;
+  unsigned long sum_old = 0, sum_new = 0;
+  double start, old_time, new_time;
+
+  for (i = 0; i < nnames; i++) {
+    if (old_lookup(names[i]) != _xdo_keysym_from_name(names[i])) {
+      fprintf(stderr, "Lookups disagree on '%s'\n", names[i]);
+      mismatches++;
+    }
+  }
+
+  start = now();
+  for (iter = 0; iter < ITERATIONS; iter++) {
+    for (i = 0; i < nnames; i++) {
+      sum_old += old_lookup(names[i]);
+      lookups++;
+    }
+  }
+  old_time = now() - start;
+
+  start = now();
+  for (iter = 0; iter < ITERATIONS; iter++) {
+    for (i = 0; i < nnames; i++) {
+      sum_new += _xdo_keysym_from_name(names[i]);
+    }
+  }
+  new_time = now() - start;
+
+  printf("keysym table: %d names, %d slots\n", KEYSYM_NAMES_LEN, KEYSYM_NAME_SLOTS);
+  printf("xlib:   %.0f lookups/sec\n", lookups / old_time);
+  printf("table:  %.0f lookups/sec\n", lookups / new_time);
+
+  return mismatches != 0 || sum_old != sum_new;
+}
@@ -0,0 +1,90 @@
+/* Mouse motion benchmark.
+ *
+ * Moves the mouse along a 1000 step path twice: once with an
+ * xdo_move_mouse and a usleep per step, the way scripts had to do it, and
+ * once with xdo_move_mouse_smooth. Reports how long each took, first as
+ * fast as possible, then paced at 1ms a step, where 1 second is ideal.
+ * Last, it replays the same path from a file with xdo_move_mouse_path and
+ * reports how far behind schedule points were sent.
+ * Needs a running X server; 'make bench' runs it under an ephemeral Xvfb.
+ */
+
+/* Yes, I know including .c files is insanity. */
+#include "../xdo.c"
+
+#include <time.h>
+
+#define STEPS 1000
+#define STEP_DELAY 1000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double step_by_step(const xdo_t *xdo, useconds_t delay) {
+  double start = now();
+  int i;
+
+  for (i = 1; i <= STEPS; i++) {
+    xdo_move_mouse(xdo, i, i / 2, 0);
+    if (delay > 0) {
+      usleep(delay);
+    }
+  }
+  return now() - start;
+}
+
+static double smooth(const xdo_t *xdo, useconds_t delay) {
+  xdo_motion_t motion;
+  double start;
+
+  memset(&motion, 0, sizeof(motion));
+  motion.curve = XDO_MOTION_LINEAR;
+  motion.step = 1;
+  motion.delay = delay;
+
+  start = now();
+  xdo_move_mouse_smooth(xdo, STEPS, STEPS / 2, 0, &motion);
+  return now() - start;
+}
+
+static void replay(const xdo_t *xdo) {
+  FILE *path = tmpfile();
+  xdo_path_stats_t stats;
+  int i;
+
+  for (i = 1; i <= STEPS; i++) {
+    fprintf(path, "%d %d %d\n", i * STEP_DELAY / 1000, i, i / 2);
+  }
+  rewind(path);
+  xdo_move_mouse_path(xdo, path, &stats);
+  fclose(path);
+
+  printf("1ms steps, replayed: %.3fs, drift mean %lldus, max %lldus\n",
+         stats.seconds, stats.drift_mean, stats.drift_max);
+}
+
+int main(void) {
+  xdo_t *xdo = xdo_new(NULL);
+
+  if (xdo == NULL) {
+    return 1;
+  }
+
+  xdo_move_mouse(xdo, 0, 0, 0);
+  printf("unpaced, step by step: %.3fs\n", step_by_step(xdo, 0));
+  xdo_move_mouse(xdo, 0, 0, 0);
+  printf("unpaced, smooth:       %.3fs\n", smooth(xdo, 0));
+
+  xdo_move_mouse(xdo, 0, 0, 0);
+  printf("1ms steps, step by step: %.3fs\n", step_by_step(xdo, STEP_DELAY));
+  xdo_move_mouse(xdo, 0, 0, 0);
+  printf("1ms steps, smooth:       %.3fs\n", smooth(xdo, STEP_DELAY));
+  xdo_move_mouse(xdo, 0, 0, 0);
+  replay(xdo);
+
+  xdo_free(xdo);
+  return 0;
+}
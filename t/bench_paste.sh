@@ -0,0 +1,53 @@
+#!/bin/sh
+# Bulk text benchmark.
+#
+# Types the same text into an xterm with keystrokes and with
+# 'type --via-selection' and reports characters per second for each,
+# counted until all of the text has arrived. Needs a running X server and
+# xterm; 'make bench' runs it under an ephemeral Xvfb.
+
+XDOTOOL=${XDOTOOL:-../xdotool}
+SIZE=${SIZE:-10000}
+TIMEOUT=${TIMEOUT:-120} # seconds
+
+payload=`mktemp`
+output=`mktemp`
+trap 'rm -f "$payload" "$output"' EXIT
+
+# Lines of 63 characters, short enough for the terminal's line discipline
+awk -v size=$SIZE 'BEGIN {
+  line = "The quick brown fox jumps over the lazy dog 0123456789 ABCDEFG"
+  for (n = 0; n + 64 <= size; n += 64) print line
+}' > "$payload"
+bytes=`wc -c < "$payload"`
+
+# Nanoseconds since the epoch (GNU date)
+now() {
+  date +%s%N
+}
+
+bench() {
+  name=$1
+  shift
+  : > "$output"
+  xterm -e sh -c "stty -echo; cat > $output" &
+  xterm_pid=$!
+  wid=`"$XDOTOOL" search --sync --pid $xterm_pid | head -1`
+  "$XDOTOOL" windowfocus --sync $wid
+
+  start=`now`
+  "$XDOTOOL" type "$@" --file "$payload"
+  deadline=`expr $start / 1000000000 + $TIMEOUT`
+  while [ `wc -c < "$output"` -lt $bytes ] && [ `date +%s` -lt $deadline ] ; do
+    sleep 0.1
+  done
+  end=`now`
+
+  got=`wc -c < "$output"`
+  echo "$name: `expr $got \* 1000000 / \( \( $end - $start \) / 1000 \)` chars/sec ($got of $bytes chars)"
+  kill $xterm_pid 2> /dev/null
+  wait $xterm_pid 2> /dev/null
+}
+
+bench keystrokes --delay 0
+bench selection --selection PRIMARY
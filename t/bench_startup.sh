@@ -0,0 +1,36 @@
+#!/bin/sh
+# Startup latency benchmark.
+#
+# Runs short xdotool commands many times and reports the average wall time
+# per run. Commands that never touch the keyboard should not pay for
+# building the keymap, so they are expected to be clearly cheaper than
+# 'key'. Needs a running X server; 'make bench' runs it under an ephemeral
+# Xvfb.
+
+XDOTOOL=${XDOTOOL:-../xdotool}
+RUNS=${RUNS:-200}
+
+# Nanoseconds since the epoch (GNU date)
+now() {
+  date +%s%N
+}
+
+bench() {
+  start=`now`
+  i=0
+  while [ $i -lt $RUNS ] ; do
+    "$XDOTOOL" "$@" > /dev/null 2>&1
+    i=`expr $i + 1`
+  done
+  end=`now`
+  echo "$*: `expr \( $end - $start \) / $RUNS / 1000` usec/run"
+}
+
+bench getmouselocation
+bench getdisplaygeometry
+bench search --limit 1 --name .
+bench mousemove 10 10
+bench get_num_desktops
+
+# For comparison, a command that needs the keymap
+bench key --delay 0 shift
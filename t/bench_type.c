@@ -0,0 +1,105 @@
+/* Typing throughput benchmark.
+ *
+ * Types the same text with xdo_enter_text_window,
+ * xdo_enter_text_window_batch and xdo_enter_text_window_adaptive and
+ * reports characters per second for each, then types text that is not in
+ * the keymap (needs a UTF-8 locale) and reports how many keymap changes
+ * that took. Last, it types into several unfocused windows one after
+ * another and with xdo_enter_text_windows.
+ * Needs a running X server; 'make bench' runs it under an ephemeral Xvfb.
+ */
+
+/* Yes, I know including .c files is insanity. */
+#include "../xdo.c"
+
+#include <time.h>
+
+#define TEXT_LENGTH 4000
+#define UNICODE_REPEAT 20
+#define WINDOWS 20
+#define WINDOW_TEXT_LENGTH 100
+#define WINDOW_DELAY 1000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+  static const char sample[] = "The Quick Brown Fox jumps over the lazy dog! 0123456789 ";
+  /* 20 distinct characters that no default keymap has */
+  static const char unicode_sample[] = "\u4f60\u597d\u4e16\u754c\u6c49\u5b57"
+    "\u03b1\u03b2\u03b3\u03b4\u2200\u2203\u2208\u2211\u221e"
+    "\u2192\u2190\u2191\u2193\u263a";
+  char text[TEXT_LENGTH + 1];
+  char unicode_text[sizeof(unicode_sample) * UNICODE_REPEAT];
+  int changes;
+  xdo_typing_stats_t stats;
+  xdo_t *xdo = xdo_new(NULL);
+  Window windows[WINDOWS];
+  double start, elapsed;
+  int i;
+
+  if (xdo == NULL) {
+    return 1;
+  }
+
+  /* Mixed case text, so modifier transitions show up in the numbers */
+  for (i = 0; i < TEXT_LENGTH; i++) {
+    text[i] = sample[i % (sizeof(sample) - 1)];
+  }
+  text[TEXT_LENGTH] = '\0';
+
+  start = now();
+  xdo_enter_text_window(xdo, CURRENTWINDOW, text, 0);
+  elapsed = now() - start;
+  printf("per-key: %.0f chars/sec\n", TEXT_LENGTH / elapsed);
+
+  start = now();
+  xdo_enter_text_window_batch(xdo, CURRENTWINDOW, text, 0, 0);
+  elapsed = now() - start;
+  printf("batch:   %.0f chars/sec\n", TEXT_LENGTH / elapsed);
+
+  xdo_enter_text_window_adaptive(xdo, CURRENTWINDOW, text, 50000, &stats);
+  printf("adaptive: %.0f chars/sec, settled on a %uus delay after %d backoffs\n",
+         stats.chars_per_sec, (unsigned int)stats.final_delay, stats.backoffs);
+
+  unicode_text[0] = '\0';
+  for (i = 0; i < UNICODE_REPEAT; i++) {
+    strcat(unicode_text, unicode_sample);
+  }
+  changes = xdo->keymap_changes;
+  start = now();
+  xdo_enter_text_window(xdo, CURRENTWINDOW, unicode_text, 0);
+  elapsed = now() - start;
+  printf("unbound: %.0f chars/sec, %d keymap changes for %d chars\n",
+         20 * UNICODE_REPEAT / elapsed, xdo->keymap_changes - changes,
+         20 * UNICODE_REPEAT);
+
+  /* Unfocused windows get their keys with XSendEvent */
+  for (i = 0; i < WINDOWS; i++) {
+    windows[i] = XCreateSimpleWindow(xdo->xdpy, DefaultRootWindow(xdo->xdpy),
+                                     0, 0, 10, 10, 0, 0, 0);
+  }
+  text[WINDOW_TEXT_LENGTH] = '\0';
+
+  start = now();
+  for (i = 0; i < WINDOWS; i++) {
+    xdo_enter_text_window(xdo, windows[i], text, WINDOW_DELAY);
+  }
+  elapsed = now() - start;
+  printf("%d windows, one by one: %.3f seconds\n", WINDOWS, elapsed);
+
+  start = now();
+  xdo_enter_text_windows(xdo, windows, WINDOWS, text, WINDOW_DELAY);
+  elapsed = now() - start;
+  printf("%d windows, interleaved: %.3f seconds\n", WINDOWS, elapsed);
+
+  for (i = 0; i < WINDOWS; i++) {
+    XDestroyWindow(xdo->xdpy, windows[i]);
+  }
+
+  xdo_free(xdo);
+  return 0;
+}
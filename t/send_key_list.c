@@ -0,0 +1,41 @@
+/* Send each argument as a key press and release through
+ * xdo_send_keysequence_window_list_do, the way programs using libxdo
+ * directly do. The tests use it to reach calls xdotool itself does not
+ * make.
+ *
+ * Build with: make send_key_list
+ */
+
+/* Yes, I know including .c files is insanity. */
+#include "xdo.c"
+
+int main(int argc, char **argv) {
+  xdo_t *xdo = NULL;
+  int ret = 0;
+  int i = 0;
+
+  xdo = xdo_new(NULL);
+  if (xdo == NULL) {
+    fprintf(stderr, "Failed creating new xdo instance\n");
+    return 1;
+  }
+
+  for (i = 1; i < argc; i++) {
+    charcodemap_t *keys = NULL;
+    int nkeys = 0;
+
+    if (_xdo_send_keysequence_window_to_keycode_list(xdo, argv[i], &keys, &nkeys) == False) {
+      fprintf(stderr, "Failure converting key sequence '%s' to keycodes\n", argv[i]);
+      ret = 1;
+      continue;
+    }
+    ret |= xdo_send_keysequence_window_list_do(xdo, CURRENTWINDOW, keys, nkeys,
+                                               True, NULL, 0);
+    ret |= xdo_send_keysequence_window_list_do(xdo, CURRENTWINDOW, keys, nkeys,
+                                               False, NULL, 0);
+    free(keys);
+  }
+
+  xdo_free(xdo);
+  return ret;
+}
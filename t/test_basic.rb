@@ -2,6 +2,7 @@
 #
 
 require "minitest"
+require "tempfile"
 require "./xdo_test_helper"
 
 class XdotoolBasicTests < MiniTest::Test
@@ -187,6 +188,27 @@ class XdotoolBasicTests < MiniTest::Test
     end
   end
 
+  def test_click_window_sends_button_events
+    skip("xev is not installed") if !system("which xev > /dev/null 2>&1")
+    title = "#{@title}_xev"
+    output = Tempfile.new("xdotool-test")
+    @launchpid = spawn("xev", "-name", title, :out => output.path,
+                       :err => "/dev/null")
+    status, lines = xdotool_ok "search --sync --name #{title}"
+    xevwid = lines.first.to_i
+
+    xdotool_ok "click --window #{xevwid} --repeat 2 --delay 0 3"
+    # Killing its connection makes xev exit, which writes out what it saw
+    xdotool_ok "windowkill #{xevwid}"
+    Process.wait(@launchpid) rescue nil
+
+    events = File.read(output.path)
+    presses = events.scan(/^ButtonPress event.*?button (\d+)/m)
+    releases = events.scan(/^ButtonRelease event.*?button (\d+)/m)
+    assert_equal([["3"], ["3"]], presses)
+    assert_equal([["3"], ["3"]], releases)
+  end
+
   def test_xdotool_exits_failure_with_bad_flags
     commands = %w{getactivewindow getwindowfocus getwindowpid search click
                   getmouselocation key keydown keyup mousedown mousemove
@@ -0,0 +1,51 @@
+#!/usr/bin/env ruby
+#
+
+require "minitest"
+require "tempfile"
+require "./xdo_test_helper"
+
+class XdotoolCommandBindTests < MiniTest::Test
+  include XdoTestHelper
+
+  def test_expected_failures
+    xdotool_fail "bind" # no arguments == failure
+    xdotool_fail "bind ctrl+alt+F12" # chord without an action
+    xdotool_fail "bind ctrl+alt+F12 'nosuchcommand'"
+    xdotool_fail "bind ctrl+alt 'key a'" # no key besides the modifiers
+    xdotool_fail "bind a+b 'key a'" # 'a' is not a modifier
+  end # def test_expected_failures
+
+  def test_chord_runs_action
+    marker = Tempfile.new("xdotool-test")
+    setup_launch(@xdotool, "bind", "ctrl+alt+F12",
+                 %Q{exec sh -c "echo fired >> #{marker.path}"})
+    sleep 1 # let bind grab the chord
+
+    # The action runs in the background, so give it a moment
+    fired = lambda do |count|
+      20.times do
+        break if File.readlines(marker.path).length >= count
+        sleep 0.1
+      end
+      File.readlines(marker.path).length
+    end
+
+    xdotool_ok "key ctrl+alt+F12"
+    assert_equal(1, fired.call(1))
+
+    # Caps Lock and Num Lock do not keep the chord from firing
+    ["Caps_Lock", "Num_Lock"].each_with_index do |lock, i|
+      xdotool_ok "key #{lock}"
+      xdotool_ok "key ctrl+alt+F12"
+      xdotool_ok "key #{lock}"
+      assert_equal(i + 2, fired.call(i + 2), "chord with #{lock} on")
+    end
+  end # def test_chord_runs_action
+
+  def test_taken_chord_fails
+    setup_launch(@xdotool, "bind", "ctrl+alt+F11", "key a")
+    sleep 1 # let bind grab the chord
+    xdotool_fail "bind ctrl+alt+F11 'key b'"
+  end # def test_taken_chord_fails
+end # class XdotoolCommandBindTests
@@ -30,6 +30,8 @@ class XdotoolCommandKeyTests < MiniTest::Test
       xdotool_fail "#{command} --window -1 Return"
 
       xdotool_ok "#{command} --delay 10 --clearmodifiers Return Return shift+Return"
+
+      xdotool_ok "#{command} --interleave --window #{@wid} Return"
     end # %w{ ... }.each
   end # def test_flags
 
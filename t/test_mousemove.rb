@@ -36,6 +36,84 @@ class XdotoolMouseMoveTests < MiniTest::Test
     end # y_list.each 
   end # def test_mousemove
 
+  def test_mousemove_step
+    xdotool_ok "mousemove --sync 0 0"
+    ["linear", "ease", "bezier"].each do |curve|
+      xdotool_ok "mousemove --sync --step 5 --delay 0.5 --curve #{curve} 300 200"
+      assert_mouse_position(300, 200)
+      xdotool_ok "mousemove --sync --step 3 --jitter 4 --curve #{curve} 10 20"
+      assert_mouse_position(10, 20)
+    end
+
+    xdotool_fail "mousemove --step 0 10 10"
+    xdotool_fail "mousemove --step 5 --curve zigzag 10 10"
+  end # def test_mousemove_step
+
+  def test_mousemove_path
+    require "tempfile"
+
+    text = Tempfile.new("path")
+    text.write("# a short drag\n0 100 100\n\n10 150 120\n20.5 200 140\n")
+    text.flush
+    status, lines = xdotool_ok "mousemove --path #{text.path}"
+    assert_mouse_position(200, 140)
+    assert_match(/^points:3 seconds:[0-9.]+ drift_mean:[0-9]+us drift_max:[0-9]+us$/,
+                 lines.first)
+
+    binary = Tempfile.new("path")
+    binary.binmode
+    binary.write("\x89XDOPATH")
+    binary.write([0, 10, 20, 0xffff, 5000, 30, 40, 0xffff].pack("Vs<s<vVs<s<v"))
+    binary.flush
+    xdotool_ok "mousemove --path #{binary.path}"
+    assert_mouse_position(30, 40)
+
+    text.truncate(0)
+    text.rewind
+    text.write("0 100 banana\n")
+    text.flush
+    xdotool_fail "mousemove --path #{text.path}"
+
+    # A bad last line counts even without a newline after it
+    text.truncate(0)
+    text.rewind
+    text.write("0 100 100\n10 150 banana")
+    text.flush
+    xdotool_fail "mousemove --path #{text.path}"
+    xdotool_fail "mousemove --path /nonexistent/path"
+  end # def test_mousemove_path
+
+  def test_mousemove_with_pointer_tracking
+    ENV["XDO_TRACK_POINTER"] = "1"
+    begin
+      status, lines = xdotool_ok "mousemove --sync 10 10 mousemove --sync 300 200 " \
+                                 "mousemove_relative --sync 5 5 getmouselocation"
+      assert_match(/^x:305 y:205 /, lines.last)
+      xdotool_ok "mousemove --sync 30 40 mousedown 1 mouseup 1 mousemove restore"
+      assert_mouse_position(305, 205)
+    ensure
+      ENV.delete("XDO_TRACK_POINTER")
+    end
+  end # def test_mousemove_with_pointer_tracking
+
+  def test_getmouselocation_json
+    xdotool_ok "mousemove --sync 120 130"
+    status, lines = xdotool_ok "getmouselocation --json"
+    assert_match(/^\{"x":120,"y":130,"screen":0,"window":[0-9]+\}$/, lines.first)
+    xdotool_fail "getmouselocation --json --shell"
+  end # def test_getmouselocation_json
+
+  def test_getmouselocation_follow
+    xdotool_ok "mousemove --sync 10 10"
+    status, lines = runcmd("sh -c '(sleep 0.3; #{@xdotool} mousemove 50 60; " \
+                           "sleep 0.3; #{@xdotool} mousemove 70 80) & " \
+                           "timeout 1 #{@xdotool} getmouselocation --follow --rate 30'")
+    assert_match(/^x:10 y:10 /, lines.first)
+    assert(lines.any? { |l| l =~ /^x:50 y:60 / }, "Expected a line for 50,60: #{lines}")
+    assert_match(/^x:70 y:80 /, lines.last)
+    xdotool_fail "getmouselocation --follow --rate 0"
+  end # def test_getmouselocation_follow
+
   def test_mousemove_with_sync
     x_list = [0, 200, 400]
     y_list = [0, 200, 400]
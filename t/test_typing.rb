@@ -43,18 +43,27 @@ class XdotoolTypingTests < MiniTest::Test
     return file.read.chomp
   end
 
-  def type(input)
+  def type(input, flags="")
     #status, lines = xdotool "type --window #{@wid} --clearmodifiers '#{input}'"
     #_xdotool "key ctrl+s ctrl+q"
     input.gsub!(/'/, "\\'")
-    status, lines = xdotool "type --clearmodifiers '#{input}'"
+    status, lines = xdotool "type --clearmodifiers #{flags} '#{input}'"
     xdotool "key ctrl+d ctrl+d"
     Process.wait(@launchpid) rescue nil
     return readfile
   end
 
-  def _test_typing(input, knownbroken=false)
-    data = type(input)
+  # Another xterm typing into 'file', which takes the synthetic key events
+  # sent to windows without focus. Returns its pid.
+  def launch_sendevent_xterm(title, file)
+    return fork do
+      exec("xterm", "-u8", "-xrm", "XTerm*allowSendEvents: true", "-T", title,
+           "-e", "exec cat >> #{file}")
+    end
+  end
+
+  def _test_typing(input, knownbroken=false, flags="")
+    data = type(input, flags)
     if (knownbroken and ENV['SKIP_KNOWN_BROKEN_TESTS'])
       puts "Skipping known-broken test"
     else
@@ -72,6 +81,155 @@ class XdotoolTypingTests < MiniTest::Test
     _test_typing(SYMBOLS)
   end
 
+  def test_us_batch_typing
+    system("setxkbmap us")
+    _test_typing(LETTERS + SYMBOLS, false, "--batch")
+  end
+
+  def test_us_se_batch_typing
+    system("setxkbmap -option grp:switch,grp:shifts_toggle us,se")
+    _test_typing(LETTERS, false, "--batch")
+  end
+
+  def test_typing_across_layout_change
+    system("setxkbmap us")
+    # 'de' swaps y and z. The second 'type' runs in the same xdotool
+    # process, which has to pick up the new layout on its own.
+    data = type("zy", "'yz' exec --sync --args 2 setxkbmap de type --clearmodifiers")
+    system("setxkbmap us")
+    assert_equal("yzzy", data)
+  end
+
+  def test_us_adaptive_typing
+    system("setxkbmap us")
+    _test_typing(LETTERS + SYMBOLS, false, "--adaptive")
+  end
+
+  def test_us_server_delay_typing
+    system("setxkbmap us")
+    _test_typing(LETTERS + SYMBOLS, false, "--server-delay --delay 1")
+  end
+
+  def test_interleaved_typing
+    system("setxkbmap us")
+    title = "#{@title}_interleave"
+    files = [Tempfile.new("xdotool-test"), Tempfile.new("xdotool-test")]
+    pids = files.collect { |file| launch_sendevent_xterm(title, file.path) }
+
+    # Neither window has focus, so both get the same XSendEvent stream.
+    # The Cyrillic, Greek and Armenian letters are not in the us layout, and
+    # there are more of them than spare keycodes to bind at once.
+    input = LETTERS + [0x410..0x44f, 0x3b1..0x3c9, 0x531..0x556].collect { |r|
+      r.to_a.pack("U*")
+    }.join
+    lines = []
+    while lines.length < 2
+      sleep 0.2
+      status, lines = xdotool "search --onlyvisible --name #{title}"
+    end
+    status, lines = xdotool "search --onlyvisible --name #{title} " \
+      "type --interleave --window %@ '#{input}' key --window %@ ctrl+d ctrl+d"
+    pids.each { |pid| Process.wait(pid) rescue nil }
+
+    assert_status_ok(status)
+    files.each do |file|
+      assert_equal(input, File.read(file.path, :encoding => "UTF-8").chomp)
+    end
+  end
+
+  def test_file_typing
+    system("setxkbmap us")
+    input = LETTERS + SYMBOLS
+    source = Tempfile.new("xdotool-test-input")
+    source.write(input)
+    source.close
+    assert_equal(input, type("", "--file #{source.path}"))
+  end
+
+  def test_selection_typing
+    _test_typing(LETTERS + SYMBOLS, false, "--selection PRIMARY")
+  end
+
+  def test_selection_typing_restores_selection
+    skip("xclip is not installed") if !system("which xclip > /dev/null 2>&1")
+    IO.popen(["xclip", "-selection", "primary"], "w") { |io| io.write("previous") }
+    _test_typing(LETTERS, false, "--selection PRIMARY")
+    assert_equal("previous", `xclip -o -selection primary`)
+  end
+
+  def test_modifiers_released_between_commands
+    system("setxkbmap us")
+    # Shift is pressed for 'A' by keydown and has to be let go of by a
+    # keyup run from another xdotool process.
+    xdotool "keydown A"
+    xdotool "keyup A"
+    xdotool "key b"
+    data = type("c")
+    assert_equal("Abc", data)
+  end
+
+  def test_own_bindings_keep_scratch_keycodes
+    system("setxkbmap us")
+    # 'é' is not in the us layout, so each 'type' binds it to a spare
+    # keycode and reverts it: two keymap changes each. Reading our own
+    # bindings back must not look like someone else changed the keymap.
+    output = `DEBUG=1 #{@xdotool} type é type é 2>&1`
+    assert_equal(1, output.scan(/Found \d+ unused keycodes/).length)
+    assert_equal(["2", "4"], output.scan(/Reverted scratch keycodes, (\d+) keymap changes/).flatten)
+  end
+
+  def test_scratch_keycodes_are_reverted
+    system("setxkbmap us")
+    before = `xmodmap -pke`
+    # CJK needs many spare keycodes, and every one bound has to be given
+    # back, however often the pool was scanned in between.
+    xdotool "type 漢字仮名交じり文 type 中文输入法测试"
+    assert_equal(before, `xmodmap -pke`)
+  end
+
+  def test_compose_typing_is_opt_in
+    if !system("pkg-config --atleast-version=1.6.0 xkbcommon")
+      skip("libxkbcommon cannot iterate compose tables")
+    end
+    system("setxkbmap -option '' -option compose:ralt us")
+    # 'é' is not in the us layout but is Multi_key ' e in the Compose file
+    env = "LC_ALL=en_US.UTF-8 DEBUG=1"
+    plain = `#{env} #{@xdotool} type é 2>&1`
+    composed = `XDO_USE_COMPOSE=1 #{env} #{@xdotool} type é 2>&1`
+    system("setxkbmap -option '' us")
+    assert_no_match(/compose sequence/, plain)
+    assert_match(/Typing U\+00E9 with a 3 key compose sequence/, composed)
+    assert_no_match(/Reverted scratch keycodes/, composed)
+  end
+
+  def test_key_list_releases_modifiers
+    system("setxkbmap us")
+    # Programs calling xdo_send_keysequence_window_list_do directly have
+    # no way to end the key operation, so Shift for 'A' has to be let go
+    # of by the call that releases it.
+    system("./send_key_list A")
+    xdotool "key b"
+    data = type("c")
+    assert_equal("Abc", data)
+  end
+
+  def test_clearmodifiers_releases_held_shift
+    system("setxkbmap us")
+    xdotool "keydown Shift_L"
+    xdotool "type --clearmodifiers abc"
+    xdotool "keyup Shift_L"
+    data = type("d")
+    assert_equal("abcd", data)
+  end
+
+  def test_key_names_ignore_case
+    system("setxkbmap us")
+    # Exact matches win, so 'a' and 'A' stay different keys
+    xdotool "key A a SHIFT+b EXCLAM"
+    data = type("c")
+    assert_equal("AaB!c", data)
+  end
+
   def test_us_se_simple_typing
     system("setxkbmap -option grp:switch,grp:shifts_toggle us,se")
     _test_typing(LETTERS)
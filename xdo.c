@@ -18,8 +18,22 @@
 #include <unistd.h>
 #include <regex.h>
 #include <ctype.h>
-#include <locale.h>
+#include <wchar.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/XKBlib.h>
@@ -32,21 +46,144 @@
 #include <X11/cursorfont.h>
 
 #include <xkbcommon/xkbcommon.h>
+#ifdef HAVE_XKB_COMPOSE_ITERATOR
+#include <xkbcommon/xkbcommon-compose.h>
+#endif
+#ifdef HAVE_XI2
+#include <X11/extensions/XInput2.h>
+#endif
 
 #include "xdo.h"
 #include "xdo_util.h"
 #include "xdo_version.h"
+#include "xdo_keysym_table.h"
 
 #define DEFAULT_DELAY 12
 
+/**
+ * How many characters xdo_enter_text_window_batch sends between flushes
+ * when the caller does not pick a chunk size.
+ */
+#define DEFAULT_BATCH_CHUNK 64
+
+/**
+ * Texts at least this long follow focus changes while they are typed.
+ */
+#define TRACK_FOCUS_MIN_LENGTH 64
+
+/**
+ * Largest property we write in one go when serving a selection. Bigger
+ * texts are sent in pieces of this size with the INCR protocol.
+ */
+#define SELECTION_CHUNK_MAX (256 * 1024)
+
+/**
+ * How many INCR transfers of pasted text can run at the same time. Further
+ * requests for large text are refused until one finishes.
+ */
+#define SELECTION_INCR_MAX 8
+
+/**
+ * Adaptive typing probes the target after every this many characters.
+ */
+#define ADAPTIVE_ROUND 32
+
+/**
+ * Per-key delay adaptive typing starts with, in microseconds.
+ */
+#define ADAPTIVE_START_DELAY 4000
+
+/**
+ * How long an adaptive typing probe may take before the target is taken
+ * to be stuck, in microseconds.
+ */
+#define ADAPTIVE_PROBE_TIMEOUT 1000000
+
+/**
+ * Probe latency above twice the best seen plus this much, in
+ * microseconds, means the target is falling behind.
+ */
+#define ADAPTIVE_SLACK 5000
+
+/**
+ * Longest Compose or dead key sequence we will type for a character.
+ */
+#define COMPOSE_MAX_SEQUENCE 4
+
 /**
  * The number of tries to check for a wait condition before aborting.
  * TODO(sissel): Make this tunable at runtime?
  */
 #define MAX_TRIES 500
 
+/**
+ * How long the pointer tracker trusts a position it has seen no motion
+ * since, in microseconds. Pointer warps by other clients don't make raw
+ * events, so this bounds how long one can go unnoticed.
+ */
+#define POINTER_TRACKER_MAX_AGE 100000
+
+/* A point on a mouse path, and when to get there */
+typedef struct motion_point {
+  int x;
+  int y;
+  long long at; /* microseconds after the start of the motion */
+} motion_point_t;
+
+/* A record of a pointer path being replayed */
+typedef struct path_record {
+  long long at; /* microseconds after the start of the replay */
+  int x;
+  int y;
+  int buttons; /* the buttons held, bit 0 for button 1, or -1 to leave them */
+} path_record_t;
+
 static void _xdo_populate_charcode_map(xdo_t *xdo);
+static void _xdo_free_charcode_map(xdo_t *xdo);
+static void _xdo_select_keymap_events(const xdo_t *xdo);
+static void _xdo_note_keymap_change(const xdo_t *xdo, int first, int count, int all);
+static int _xdo_charcodes_for_keycodes(XkbDescPtr desc, XModifierKeymap *modmap,
+                                       int first, int last, charcodemap_t *out);
+static int _xdo_refresh_charcode_map(xdo_t *xdo);
+static void _xdo_index_charcode_map(xdo_t *xdo);
+static uint64_t _xdo_keymap_fingerprint(const xdo_t *xdo, XModifierKeymap *modmap,
+                                        const KeySym *keysyms);
+static int _xdo_keymap_cache_path(char *path, size_t size, uint64_t fingerprint);
+static int _xdo_keymap_cache_load(xdo_t *xdo, uint64_t fingerprint);
+static void _xdo_keymap_cache_store(const xdo_t *xdo, uint64_t fingerprint);
+static int _xdo_charcode_index_by_char(const xdo_t *xdo, wchar_t key);
+static int _xdo_charcode_index_by_keysym(const xdo_t *xdo, KeySym keysym);
 static int _xdo_has_xtest(const xdo_t *xdo);
+static xdo_t *_xdo_mutable(const xdo_t *xdo);
+static void _xdo_check_keymap_events(const xdo_t *xdo);
+static int _xdo_scratch_pool(const xdo_t *xdo);
+static void _xdo_bind_scratch_keysyms(const xdo_t *xdo, charcodemap_t *keys, int nkeys);
+static int _xdo_scratch_round(const xdo_t *xdo, const charcodemap_t *keys, int nkeys);
+static void _xdo_release_scratch_keycodes(const xdo_t *xdo);
+static unsigned long _xdo_xtest_delay(const xdo_t *xdo);
+static int _xdo_enter_text_window_do(const xdo_t *xdo, Window window, const char *string,
+                                     int chunk, useconds_t chunk_delay,
+                                     useconds_t key_delay);
+static void _xdo_prebind_text(const xdo_t *xdo, const charcodemap_t *key,
+                              const wchar_t *rest, size_t nrest);
+static wchar_t *_xdo_utf8_decode(const char *string, size_t *nchars_ret,
+                                 int *invalid_ret);
+static void _xdo_report_unknown_char(wchar_t c);
+static int _xdo_type_composed(const xdo_t *xdo, Window window, wchar_t c,
+                              useconds_t delay);
+static void _xdo_free_compose(xdo_t *xdo);
+static int _xdo_pointer_cached(const xdo_t *xdo, int *x_ret, int *y_ret,
+                               int *screen_ret);
+static void _xdo_pointer_record(const xdo_t *xdo, int x, int y, int screen,
+                                unsigned int mask);
+static void _xdo_pointer_invalidate(const xdo_t *xdo);
+static Time _xdo_get_server_time(const xdo_t *xdo, Window window);
+static long long _xdo_now_usec(void);
+static long long _xdo_monotonic_usec(void);
+static void _xdo_sleep_until(long long deadline);
+static int _xdo_wait_for_event(const xdo_t *xdo, XEvent *event,
+                               Bool (*predicate)(Display *, XEvent *, XPointer),
+                               XPointer arg, long long deadline);
 
 static KeySym _xdo_keysym_from_char(const xdo_t *xdo, wchar_t key);
 static void _xdo_charcodemap_from_char(const xdo_t *xdo, charcodemap_t *key);
@@ -57,14 +194,32 @@ static int _xdo_send_keysequence_window_to_keycode_list(const xdo_t *xdo, const
                                             charcodemap_t **keys, int *nkeys);
 static int _xdo_send_keysequence_window_do(const xdo_t *xdo, Window window, const char *keyseq,
                                int pressed, int *modifier, useconds_t delay);
+static int _xdo_send_keysequence_window_list_do(const xdo_t *xdo, Window window,
+                                                charcodemap_t *keys, int nkeys,
+                                                int pressed, int *modifier,
+                                                useconds_t delay);
 static int _xdo_ewmh_is_supported(const xdo_t *xdo, const char *feature);
 static void _xdo_init_xkeyevent(const xdo_t *xdo, XKeyEvent *xk);
 static void _xdo_send_key(const xdo_t *xdo, Window window, charcodemap_t *key,
                           int modstate, int is_press, useconds_t delay);
-static void _xdo_send_modifier(const xdo_t *xdo, int modmask, int is_press);
+static void _xdo_send_modifier_transition(const xdo_t *xdo, XModifierKeymap *modmap,
+                                          int from_mask, int to_mask);
+static XModifierKeymap *_xdo_modmap(const xdo_t *xdo);
+static void _xdo_xtest_set_state(const xdo_t *xdo, int modmask, int group);
+static void _xdo_xtest_restore_state(const xdo_t *xdo, int release_mods);
+static int _xdo_input_use_xtest(const xdo_t *xdo, Window window);
+static void _xdo_set_input_use_xtest(const xdo_t *xdo, int use_xtest);
+static void _xdo_track_input_focus(const xdo_t *xdo, const char *string);
+static void _xdo_forget_input_window(const xdo_t *xdo);
+static void _xdo_end_key_operation(const xdo_t *xdo, int release_mods);
 
 static int _xdo_query_keycode_to_modifier(XModifierKeymap *modmap, KeyCode keycode);
 static int _xdo_mousebutton(const xdo_t *xdo, Window window, int button, int is_press);
+static void _xdo_init_xbuttonevent(const xdo_t *xdo, Window window, XButtonEvent *xbpe);
+static int _xdo_send_xbuttonevent(const xdo_t *xdo, const XButtonEvent *xbpe,
+                                  int button, int is_press);
+static int _xdo_click_xbuttonevent(const xdo_t *xdo, const XButtonEvent *xbpe,
+                                   int button);
 
 static int _is_success(const char *funcname, int code, const xdo_t *xdo);
 static void _xdo_debug(const xdo_t *xdo, const char *format, ...);
@@ -72,6 +227,8 @@ static void _xdo_eprintf(const xdo_t *xdo, int hushable, const char *format, ...
 
 /* context-free functions */
 static wchar_t _keysym_to_char(KeySym keysym);
+static KeySym _xdo_keysym_from_name(const char *name);
+static const char *_xdo_keysym_name(KeySym keysym);
 
 /* Default to -1, initialize it when we need it */
 static Atom atom_NET_WM_PID = -1;
@@ -121,6 +278,14 @@ xdo_t* xdo_new_with_opened_display(Display *xdpy, const char *display,
     xdo->quiet = True;
   }
 
+  if (getenv("XDO_USE_COMPOSE")) {
+    xdo->use_compose = True;
+  }
+
+  if (getenv("XDO_TRACK_POINTER")) {
+    xdo_track_pointer(xdo, True);
+  }
+
   if (_xdo_has_xtest(xdo)) {
     xdo_enable_feature(xdo, XDO_FEATURE_XTEST);
     _xdo_debug(xdo, "XTEST enabled.");
@@ -131,7 +296,9 @@ xdo_t* xdo_new_with_opened_display(Display *xdpy, const char *display,
     xdo_disable_feature(xdo, XDO_FEATURE_XTEST);
   }
 
-  _xdo_populate_charcode_map(xdo);
+  /* The charcode map is built on first use, see xdo_ensure_keymap */
+  XDisplayKeycodes(xdo->xdpy, &(xdo->keycode_low), &(xdo->keycode_high));
+  xdo->keymap_dirty_last = xdo->keymap_dirty_first - 1;
   return xdo;
 }
 
@@ -141,14 +308,77 @@ void xdo_free(xdo_t *xdo) {
 
   if (xdo->display_name)
     free(xdo->display_name);
-  if (xdo->charcodes)
-    free(xdo->charcodes);
+  _xdo_free_charcode_map(xdo);
+  if (xdo->scratch_keycodes) {
+    _xdo_release_scratch_keycodes(xdo);
+    free(xdo->scratch_keycodes);
+    free(xdo->scratch_keysyms);
+    free(xdo->scratch_last_used);
+  }
+  if (xdo->caps_lock_keyseq)
+    xdo_keyseq_free(xdo->caps_lock_keyseq);
+  if (xdo->modmap)
+    XFreeModifiermap(xdo->modmap);
+  _xdo_free_compose(xdo);
+  free(xdo->pointer);
   if (xdo->xdpy && xdo->close_display_when_freed)
     XCloseDisplay(xdo->xdpy);
 
   free(xdo);
 }
 
+void xdo_ensure_keymap(const xdo_t *xdo) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+
+  if (xdo->charcodes_valid) {
+    /* Notices keymap changes we have already been told about, once per
+     * library call rather than for every key looked up */
+    if (!xdo->keymap_checked) {
+      _xdo_check_keymap_events(xdo);
+    }
+    if (xdo->charcodes_valid && xdo->keymap_dirty_last < xdo->keymap_dirty_first) {
+      return;
+    }
+  }
+
+  if (xdo->charcodes_valid && _xdo_refresh_charcode_map(mxdo)) {
+    mxdo->keymap_generation++;
+    return;
+  }
+
+  _xdo_free_charcode_map(mxdo);
+  _xdo_populate_charcode_map(mxdo);
+  mxdo->charcodes_valid = True;
+  mxdo->keymap_generation++;
+}
+
+unsigned long xdo_get_keymap_generation(const xdo_t *xdo) {
+  /* Always look for notifications here; callers use this to find out
+   * whether the keymap moved between their own calls */
+  _xdo_mutable(xdo)->keymap_checked = False;
+  xdo_ensure_keymap(xdo);
+  _xdo_mutable(xdo)->keymap_checked = False;
+  return xdo->keymap_generation;
+}
+
+static void _xdo_free_charcode_map(xdo_t *xdo) {
+  free(xdo->charcodes);
+  free(xdo->charcodes_by_char);
+  free(xdo->charcodes_by_keysym);
+  if (xdo->xkb_desc != NULL) {
+    XkbFreeKeyboard(xdo->xkb_desc, 0, True);
+  }
+  xdo->charcodes = NULL;
+  xdo->charcodes_by_char = NULL;
+  xdo->charcodes_by_keysym = NULL;
+  xdo->xkb_desc = NULL;
+  xdo->charcodes_len = 0;
+  xdo->charcodes_index_size = 0;
+  xdo->charcodes_valid = False;
+  xdo->keymap_dirty_first = 0;
+  xdo->keymap_dirty_last = -1;
+}
+
 const char *xdo_version(void) {
   return XDO_VERSION;
 }
@@ -778,6 +1008,7 @@ int xdo_move_mouse(const xdo_t *xdo, int x, int y, int screen)  {
   Window screen_root = RootWindow(xdo->xdpy, screen);
   ret = XWarpPointer(xdo->xdpy, None, screen_root, 0, 0, 0, 0, x, y);
   XFlush(xdo->xdpy);
+  _xdo_pointer_invalidate(xdo);
   return _is_success("XWarpPointer", ret == 0, xdo);
 }
 
@@ -794,62 +1025,374 @@ int xdo_move_mouse_relative_to_window(const xdo_t *xdo, Window window, int x, in
 
 int xdo_move_mouse_relative(const xdo_t *xdo, int x, int y)  {
   int ret = 0;
-  ret = XTestFakeRelativeMotionEvent(xdo->xdpy, x, y, CurrentTime);
+  ret = XTestFakeRelativeMotionEvent(xdo->xdpy, x, y, _xdo_xtest_delay(xdo));
   XFlush(xdo->xdpy);
+  _xdo_pointer_invalidate(xdo);
   return _is_success("XTestFakeRelativeMotionEvent", ret == 0, xdo);
 }
 
+/* Send 'points' as XTest motion, each at its deadline. Points due by the
+ * time we wake up go out together, and we wake at most once a frame, so a
+ * long path costs one flush per frame rather than a round trip per point. */
+static int _xdo_motion_send(const xdo_t *xdo, const motion_point_t *points,
+                            int npoints, unsigned int frame_rate) {
+  long long frame = 1000000 / (frame_rate ? frame_rate : XDO_MOTION_DEFAULT_RATE);
+  long long start = _xdo_monotonic_usec();
+  long long next_frame = start;
+  int ret = XDO_SUCCESS;
+  int i = 0;
+
+  while (i < npoints) {
+    long long wake = start + points[i].at;
+    long long now;
+
+    _xdo_sleep_until(wake > next_frame ? wake : next_frame);
+    now = _xdo_monotonic_usec();
+    while (i < npoints && start + points[i].at <= now) {
+      if (XTestFakeMotionEvent(xdo->xdpy, -1, points[i].x, points[i].y,
+                               CurrentTime) == 0) {
+        ret = XDO_ERROR;
+      }
+      i++;
+    }
+    XFlush(xdo->xdpy);
+
+    /* Frames stay on the grid they started on, however late we woke */
+    while (next_frame <= now) {
+      next_frame += frame;
+    }
+  }
+  _xdo_pointer_invalidate(xdo);
+  return _is_success("XTestFakeMotionEvent", ret, xdo);
+}
+
+/* A random number between -range and range */
+static double _xdo_motion_random(unsigned int *seed, double range) {
+  return range * (2.0 * rand_r(seed) / RAND_MAX - 1.0);
+}
+
+int xdo_move_mouse_smooth(const xdo_t *xdo, int x, int y, int screen,
+                          const xdo_motion_t *motion) {
+  motion_point_t *points;
+  int x0, y0, current_screen;
+  int dx, dy, npoints, i, ret;
+  int step = motion->step > 0 ? motion->step : 1;
+  unsigned int seed = motion->seed;
+  double c1x, c1y, c2x, c2y;
+
+  xdo_get_mouse_location(xdo, &x0, &y0, &current_screen);
+  if (current_screen != screen) {
+    /* XTest moves only within the current screen */
+    return xdo_move_mouse(xdo, x, y, screen);
+  }
+
+  dx = x - x0;
+  dy = y - y0;
+  npoints = ((abs(dx) > abs(dy) ? abs(dx) : abs(dy)) + step - 1) / step;
+  if (npoints == 0) {
+    return XDO_SUCCESS;
+  }
+
+  if (seed == 0) {
+    seed = (unsigned int)_xdo_monotonic_usec();
+  }
+
+  /* Bezier control points sit at the thirds of the line, pushed off to
+   * either side by up to a quarter of its length */
+  c1x = x0 + dx / 3.0;
+  c1y = y0 + dy / 3.0;
+  c2x = x0 + dx * 2 / 3.0;
+  c2y = y0 + dy * 2 / 3.0;
+  if (motion->curve == XDO_MOTION_BEZIER) {
+    double bend1 = _xdo_motion_random(&seed, 0.25);
+    double bend2 = _xdo_motion_random(&seed, 0.25);
+    c1x -= dy * bend1;
+    c1y += dx * bend1;
+    c2x -= dy * bend2;
+    c2y += dx * bend2;
+  }
+
+  points = malloc(npoints * sizeof(motion_point_t));
+  for (i = 0; i < npoints; i++) {
+    double t = (double)(i + 1) / npoints;
+    double u = 1 - t;
+    double px, py;
+
+    switch (motion->curve) {
+      case XDO_MOTION_BEZIER:
+        px = u * u * u * x0 + 3 * u * u * t * c1x + 3 * u * t * t * c2x + t * t * t * x;
+        py = u * u * u * y0 + 3 * u * u * t * c1y + 3 * u * t * t * c2y + t * t * t * y;
+        break;
+      case XDO_MOTION_EASE:
+        t = t * t * (3 - 2 * t);
+        /* fall through */
+      default:
+        px = x0 + dx * t;
+        py = y0 + dy * t;
+        break;
+    }
+
+    if (motion->jitter > 0 && i < npoints - 1) {
+      px += _xdo_motion_random(&seed, motion->jitter);
+      py += _xdo_motion_random(&seed, motion->jitter);
+    }
+    points[i].x = (int)(px < 0 ? px - 0.5 : px + 0.5);
+    points[i].y = (int)(py < 0 ? py - 0.5 : py + 0.5);
+    points[i].at = (long long)i * motion->delay;
+  }
+
+  /* Land exactly, whatever rounding did */
+  points[npoints - 1].x = x;
+  points[npoints - 1].y = y;
+
+  _xdo_debug(xdo, "Moving the mouse from %d,%d to %d,%d in %d points",
+             x0, y0, x, y, npoints);
+  ret = _xdo_motion_send(xdo, points, npoints, motion->frame_rate);
+  free(points);
+  return ret;
+}
+
+/* Read the next record of a pointer path into 'rec'. Binary records give
+ * the time since the previous one, so 'rec' must hold the previous record.
+ * Returns 1 for a record, 0 at the end and -1 if the path is malformed. */
+static int _xdo_path_read(FILE *path, int binary, long *line, path_record_t *rec) {
+  char buf[256];
+  char *got;
+
+  if (binary) {
+    unsigned char raw[10];
+    size_t len = fread(raw, 1, sizeof(raw), path);
+    if (len == 0) {
+      return 0;
+    } else if (len != sizeof(raw)) {
+      fprintf(stderr, "Pointer path ends in the middle of a record\n");
+      return -1;
+    }
+    rec->at += raw[0] | raw[1] << 8 | raw[2] << 16 | (unsigned long)raw[3] << 24;
+    rec->x = (int16_t)(raw[4] | raw[5] << 8);
+    rec->y = (int16_t)(raw[6] | raw[7] << 8);
+    rec->buttons = raw[8] | raw[9] << 8;
+    if (rec->buttons == 0xffff) {
+      rec->buttons = -1;
+    }
+    return 1;
+  }
+
+  while ((got = fgets(buf, sizeof(buf), path)) != NULL) {
+    char *p = buf + strspn(buf, " \t");
+    char *end;
+    double ms;
+
+    (*line)++;
+    if (*p == '#' || *p == '\0' || *p == '\n' || *p == '\r') {
+      continue;
+    }
+
+    ms = strtod(p, &end);
+    if (end == p) {
+      break;
+    }
+    rec->x = strtol(end, &p, 10);
+    if (p == end) {
+      break;
+    }
+    rec->y = strtol(p, &end, 10);
+    if (end == p) {
+      break;
+    }
+    rec->buttons = strtol(end, &p, 0);
+    if (p == end) {
+      rec->buttons = -1;
+    }
+    if (p[strspn(p, " \t\r\n")] != '\0') {
+      break;
+    }
+    rec->at = ms * 1000;
+    return 1;
+  }
+
+  if (got == NULL) {
+    /* Nothing more was read; a last line without a newline was parsed
+     * above like any other */
+    if (ferror(path)) {
+      fprintf(stderr, "Error reading pointer path after line %ld\n", *line);
+      return -1;
+    }
+    return 0;
+  }
+  fprintf(stderr, "Malformed pointer path record on line %ld\n", *line);
+  return -1;
+}
+
+/* Press and release buttons so that exactly 'buttons' are held */
+static int _xdo_path_buttons(const xdo_t *xdo, int *held, int buttons) {
+  int changed = *held ^ buttons;
+  int ret = XDO_SUCCESS;
+  int i;
+
+  for (i = 0; changed >> i != 0; i++) {
+    if (changed & (1 << i)) {
+      if (XTestFakeButtonEvent(xdo->xdpy, i + 1, (buttons >> i) & 1,
+                               CurrentTime) == 0) {
+        ret = XDO_ERROR;
+      }
+    }
+  }
+  *held = buttons;
+  return ret;
+}
+
+int xdo_move_mouse_path(const xdo_t *xdo, FILE *path, xdo_path_stats_t *stats) {
+  path_record_t rec;
+  long long start, now, drift_sum = 0, drift_max = 0;
+  long points = 0, line = 0;
+  /* Buttons past 5 can't be seen, so assume them up */
+  int held = xdo_get_pointer_buttons(xdo) >> 8;
+  int binary = 0;
+  int ret = XDO_SUCCESS;
+  int have;
+  int c = getc(path);
+  struct stat st;
+  /* Reading ahead of a pipe can block until its writer has more, and the
+   * batch read so far must not wait for that */
+  int live = (fstat(fileno(path), &st) != 0 || !S_ISREG(st.st_mode));
+
+  if (c == (unsigned char)XDO_PATH_MAGIC[0]) {
+    char magic[XDO_PATH_MAGIC_LEN];
+    magic[0] = c;
+    if (fread(magic + 1, 1, XDO_PATH_MAGIC_LEN - 1, path) != XDO_PATH_MAGIC_LEN - 1
+        || memcmp(magic, XDO_PATH_MAGIC, XDO_PATH_MAGIC_LEN) != 0) {
+      fprintf(stderr, "Pointer path starts like a binary path, but isn't one\n");
+      return XDO_ERROR;
+    }
+    binary = 1;
+  } else if (c != EOF) {
+    ungetc(c, path);
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  have = _xdo_path_read(path, binary, &line, &rec);
+  start = _xdo_monotonic_usec();
+  now = start;
+
+  while (have > 0) {
+    long long scheduled_sum = 0, earliest;
+    long batch = 0;
+
+    _xdo_sleep_until(start + rec.at);
+    earliest = start + rec.at;
+
+    /* Send everything that is due, then flush once */
+    do {
+      if (XTestFakeMotionEvent(xdo->xdpy, -1, rec.x, rec.y, CurrentTime) == 0) {
+        ret = XDO_ERROR;
+      }
+      if (rec.buttons >= 0 && rec.buttons != held) {
+        ret |= _xdo_path_buttons(xdo, &held, rec.buttons);
+      }
+      if (start + rec.at < earliest) {
+        earliest = start + rec.at;
+      }
+      scheduled_sum += start + rec.at;
+      batch++;
+      if (live) {
+        XFlush(xdo->xdpy);
+      }
+      have = _xdo_path_read(path, binary, &line, &rec);
+    } while (have > 0 && start + rec.at <= _xdo_monotonic_usec());
+    XFlush(xdo->xdpy);
+
+    now = _xdo_monotonic_usec();
+    drift_sum += batch * now - scheduled_sum;
+    if (now - earliest > drift_max) {
+      drift_max = now - earliest;
+    }
+    points += batch;
+  }
+  _xdo_pointer_invalidate(xdo);
+
+  _xdo_debug(xdo, "Replayed %ld points, drift mean %lldus, max %lldus",
+             points, points ? drift_sum / points : 0, drift_max);
+
+  if (stats != NULL) {
+    stats->points = points;
+    stats->seconds = (now - start) / 1000000.0;
+    stats->drift_mean = points ? drift_sum / points : 0;
+    stats->drift_max = drift_max;
+  }
+  if (have < 0) {
+    return XDO_ERROR;
+  }
+  return _is_success("XTestFakeMotionEvent", ret, xdo);
+}
+
 int _xdo_mousebutton(const xdo_t *xdo, Window window, int button, int is_press) {
   int ret = 0;
 
   if (window == CURRENTWINDOW) {
-    ret = XTestFakeButtonEvent(xdo->xdpy, button, is_press, CurrentTime);
+    ret = XTestFakeButtonEvent(xdo->xdpy, button, is_press, _xdo_xtest_delay(xdo));
     XFlush(xdo->xdpy);
+    _xdo_pointer_invalidate(xdo);
     return _is_success("XTestFakeButtonEvent(down)", ret == 0, xdo);
   } else {
     /* Send to specific window */
-    int screen = 0;
     XButtonEvent xbpe;
-    charcodemap_t *active_mod;
-    int active_mod_n;
-
-    xdo_get_mouse_location(xdo, &xbpe.x_root, &xbpe.y_root, &screen);
-    xdo_get_active_modifiers(xdo, &active_mod, &active_mod_n);
-
-    xbpe.window = window;
-    xbpe.button = button;
-    xbpe.display = xdo->xdpy;
-    xbpe.root = RootWindow(xdo->xdpy, screen);
-    xbpe.same_screen = True; /* Should we detect if window is on the same
-                                 screen as cursor? */
-    xbpe.state = xdo_get_input_state(xdo);
-
-    xbpe.subwindow = None;
-    xbpe.time = CurrentTime;
-    xbpe.type = (is_press ? ButtonPress : ButtonRelease);
-
-    /* Get the coordinates of the cursor relative to xbpe.window and also find what
-     * subwindow it might be on */
-    XTranslateCoordinates(xdo->xdpy, xbpe.root, xbpe.window, 
-                          xbpe.x_root, xbpe.y_root, &xbpe.x, &xbpe.y, &xbpe.subwindow);
-
-    /* Normal behavior of 'mouse up' is that the modifier mask includes
-     * 'ButtonNMotionMask' where N is the button being released. This works the
-     * same way with keys, too. */
-    if (!is_press) { /* is mouse up */
-      switch(button) {
-        case 1: xbpe.state |= Button1MotionMask; break;
-        case 2: xbpe.state |= Button2MotionMask; break;
-        case 3: xbpe.state |= Button3MotionMask; break;
-        case 4: xbpe.state |= Button4MotionMask; break;
-        case 5: xbpe.state |= Button5MotionMask; break;
-      }
-    }
-    ret = XSendEvent(xdo->xdpy, window, True, ButtonPressMask, (XEvent *)&xbpe);
+
+    _xdo_init_xbuttonevent(xdo, window, &xbpe);
+    ret = _xdo_send_xbuttonevent(xdo, &xbpe, button, is_press);
     XFlush(xdo->xdpy);
-    free(active_mod);
-    return _is_success("XSendEvent(mousedown)", ret == 0, xdo);
+    return ret;
+  }
+}
+
+/* Fill in everything but the type and button of an event to send to
+ * 'window'. A single XQueryPointer on the window gives the root, the
+ * pointer position relative to both, the subwindow under the pointer and
+ * the modifier state, so this is one round trip. Clicks reuse the result
+ * for both edges, and bursts of clicks for every click. */
+static void _xdo_init_xbuttonevent(const xdo_t *xdo, Window window, XButtonEvent *xbpe) {
+  memset(xbpe, 0, sizeof(*xbpe));
+  xbpe->display = xdo->xdpy;
+  xbpe->window = window;
+  xbpe->time = CurrentTime;
+
+  /* False if the pointer is on another screen than the window */
+  xbpe->same_screen = XQueryPointer(xdo->xdpy, window, &xbpe->root,
+                                    &xbpe->subwindow, &xbpe->x_root,
+                                    &xbpe->y_root, &xbpe->x, &xbpe->y,
+                                    &xbpe->state);
+}
+
+static int _xdo_send_xbuttonevent(const xdo_t *xdo, const XButtonEvent *xbpe,
+                                  int button, int is_press) {
+  XButtonEvent event = *xbpe;
+  int ret;
+
+  event.type = (is_press ? ButtonPress : ButtonRelease);
+  event.button = button;
+
+  /* Normal behavior of 'mouse up' is that the modifier mask includes
+   * 'ButtonNMotionMask' where N is the button being released. This works the
+   * same way with keys, too. */
+  if (!is_press && button >= 1 && button <= 5) {
+    event.state |= Button1MotionMask << (button - 1);
+  }
+  ret = XSendEvent(xdo->xdpy, event.window, True, ButtonPressMask, (XEvent *)&event);
+  return _is_success(is_press ? "XSendEvent(mousedown)" : "XSendEvent(mouseup)",
+                     ret == 0, xdo);
+}
+
+static int _xdo_click_xbuttonevent(const xdo_t *xdo, const XButtonEvent *xbpe,
+                                   int button) {
+  int ret = _xdo_send_xbuttonevent(xdo, xbpe, button, True);
+  if (ret != XDO_SUCCESS) {
+    fprintf(stderr, "xdo_mouse_down failed, aborting click.\n");
+    return ret;
   }
+  xdo_delay_input(xdo, xbpe->window, DEFAULT_DELAY);
+  ret = _xdo_send_xbuttonevent(xdo, xbpe, button, False);
+  XFlush(xdo->xdpy);
+  return ret;
 }
 
 int xdo_mouse_up(const xdo_t *xdo, Window window, int button) {
@@ -860,6 +1403,210 @@ int xdo_mouse_down(const xdo_t *xdo, Window window, int button) {
   return _xdo_mousebutton(xdo, window, button, True);
 }
 
+/* What the pointer tracker knows. Raw events tell it that the pointer
+ * moved, but not where to, so a position is good until the next motion;
+ * raw button events say exactly which buttons are held. */
+struct xdo_pointer_tracker {
+  int xi_opcode;
+  int position_valid;
+  long long position_time; /* when the server told us the position */
+  int x;
+  int y;
+  int screen;
+  int buttons_valid;
+  unsigned int buttons; /* Button1Mask to Button5Mask */
+};
+
+#ifdef HAVE_XI2
+static Bool _xdo_is_pointer_event(Display *dpy, XEvent *event, XPointer arg) {
+  (void)dpy;
+  return event->xcookie.type == GenericEvent
+    && event->xcookie.extension == ((struct xdo_pointer_tracker *)arg)->xi_opcode;
+}
+
+static void _xdo_pointer_handle_event(const xdo_t *xdo, XEvent *event) {
+  struct xdo_pointer_tracker *pointer = xdo->pointer;
+  XIRawEvent *raw;
+  unsigned int mask;
+
+  if (!XGetEventData(xdo->xdpy, &event->xcookie)) {
+    return;
+  }
+  raw = event->xcookie.data;
+  mask = (raw->detail >= 1 && raw->detail <= 5) ? Button1Mask << (raw->detail - 1) : 0;
+  switch (event->xcookie.evtype) {
+    case XI_RawMotion:
+      pointer->position_valid = False;
+      break;
+    case XI_RawButtonPress:
+      pointer->buttons |= mask;
+      break;
+    case XI_RawButtonRelease:
+      pointer->buttons &= ~mask;
+      break;
+  }
+  XFreeEventData(xdo->xdpy, &event->xcookie);
+}
+#endif /* HAVE_XI2 */
+
+/* Catch up on the raw events that have arrived, without waiting for more */
+static void _xdo_pointer_update(const xdo_t *xdo) {
+#ifdef HAVE_XI2
+  XEvent event;
+  while (XCheckIfEvent(xdo->xdpy, &event, _xdo_is_pointer_event,
+                       (XPointer)xdo->pointer)) {
+    _xdo_pointer_handle_event(xdo, &event);
+  }
+#else
+  (void)xdo;
+#endif /* HAVE_XI2 */
+}
+
+/* The pointer position, if the tracker is on and has seen no motion since
+ * it last asked the server. Returns False if the server must be asked. */
+static int _xdo_pointer_cached(const xdo_t *xdo, int *x_ret, int *y_ret,
+                               int *screen_ret) {
+  struct xdo_pointer_tracker *pointer = xdo->pointer;
+
+  if (pointer == NULL) {
+    return False;
+  }
+  _xdo_pointer_update(xdo);
+  if (!pointer->position_valid
+      || _xdo_monotonic_usec() - pointer->position_time > POINTER_TRACKER_MAX_AGE) {
+    return False;
+  }
+  if (x_ret != NULL) *x_ret = pointer->x;
+  if (y_ret != NULL) *y_ret = pointer->y;
+  if (screen_ret != NULL) *screen_ret = pointer->screen;
+  return True;
+}
+
+/* Remember what XQueryPointer said */
+static void _xdo_pointer_record(const xdo_t *xdo, int x, int y, int screen,
+                                unsigned int mask) {
+  struct xdo_pointer_tracker *pointer = xdo->pointer;
+
+  if (pointer == NULL) {
+    return;
+  }
+  pointer->position_valid = True;
+  pointer->position_time = _xdo_monotonic_usec();
+  pointer->x = x;
+  pointer->y = y;
+  pointer->screen = screen;
+  pointer->buttons_valid = True;
+  pointer->buttons = mask & (Button1Mask | Button2Mask | Button3Mask
+                             | Button4Mask | Button5Mask);
+}
+
+/* Forget everything; for after we move the pointer or press buttons
+ * ourselves, since the raw events for that have yet to come back */
+static void _xdo_pointer_invalidate(const xdo_t *xdo) {
+  if (xdo->pointer != NULL) {
+    xdo->pointer->position_valid = False;
+    xdo->pointer->buttons_valid = False;
+  }
+}
+
+int xdo_wait_for_pointer_event(const xdo_t *xdo, useconds_t timeout) {
+#ifdef HAVE_XI2
+  if (xdo->pointer != NULL) {
+    XEvent event;
+
+    /* Without a timeout, wake up once an hour just to wait some more */
+    while (!_xdo_wait_for_event(xdo, &event, _xdo_is_pointer_event,
+                                (XPointer)xdo->pointer,
+                                _xdo_now_usec() + (timeout ? timeout : 3600000000LL))) {
+      if (timeout) {
+        return False;
+      }
+    }
+    _xdo_pointer_handle_event(xdo, &event);
+
+    /* Whatever else came in with it is the same change, as far as anyone
+     * waiting is concerned */
+    _xdo_pointer_update(xdo);
+    return True;
+  }
+#else
+  (void)xdo;
+#endif /* HAVE_XI2 */
+  usleep(timeout);
+  return True;
+}
+
+int xdo_track_pointer(const xdo_t *xdo, int enable) {
+#ifdef HAVE_XI2
+  struct xdo_pointer_tracker *pointer;
+  unsigned char bits[XIMaskLen(XI_LASTEVENT)];
+  XIEventMask mask;
+  int major = 2, minor = 2;
+  int event, error, i;
+
+  if (!enable || xdo->pointer != NULL) {
+    if (!enable && xdo->pointer != NULL) {
+      memset(bits, 0, sizeof(bits));
+      mask.deviceid = XIAllMasterDevices;
+      mask.mask_len = sizeof(bits);
+      mask.mask = bits;
+      for (i = 0; i < ScreenCount(xdo->xdpy); i++) {
+        XISelectEvents(xdo->xdpy, RootWindow(xdo->xdpy, i), &mask, 1);
+      }
+      free(xdo->pointer);
+      _xdo_mutable(xdo)->pointer = NULL;
+    }
+    return XDO_SUCCESS;
+  }
+
+  /* Raw events from master devices are new in XInput 2.1 */
+  pointer = calloc(1, sizeof(struct xdo_pointer_tracker));
+  if (!XQueryExtension(xdo->xdpy, "XInputExtension", &pointer->xi_opcode,
+                       &event, &error)
+      || XIQueryVersion(xdo->xdpy, &major, &minor) != Success
+      || major * 10 + minor < 21) {
+    fprintf(stderr, "The X server does not support XInput 2.1, "
+            "so the pointer can't be tracked.\n");
+    free(pointer);
+    return XDO_ERROR;
+  }
+
+  memset(bits, 0, sizeof(bits));
+  XISetMask(bits, XI_RawMotion);
+  XISetMask(bits, XI_RawButtonPress);
+  XISetMask(bits, XI_RawButtonRelease);
+  mask.deviceid = XIAllMasterDevices;
+  mask.mask_len = sizeof(bits);
+  mask.mask = bits;
+  for (i = 0; i < ScreenCount(xdo->xdpy); i++) {
+    XISelectEvents(xdo->xdpy, RootWindow(xdo->xdpy, i), &mask, 1);
+  }
+  XFlush(xdo->xdpy);
+
+  _xdo_mutable(xdo)->pointer = pointer;
+  return XDO_SUCCESS;
+#else
+  (void)xdo;
+  if (!enable) {
+    return XDO_SUCCESS;
+  }
+  fprintf(stderr, "libxdo was built without XInput 2, "
+          "so the pointer can't be tracked.\n");
+  return XDO_ERROR;
+#endif /* HAVE_XI2 */
+}
+
+unsigned int xdo_get_pointer_buttons(const xdo_t *xdo) {
+  if (xdo->pointer != NULL) {
+    _xdo_pointer_update(xdo);
+    if (xdo->pointer->buttons_valid) {
+      return xdo->pointer->buttons;
+    }
+  }
+  return xdo_get_input_state(xdo) & (Button1Mask | Button2Mask | Button3Mask
+                                     | Button4Mask | Button5Mask);
+}
+
 int xdo_get_mouse_location(const xdo_t *xdo, int *x_ret, int *y_ret,
                            int *screen_num_ret) {
   return xdo_get_mouse_location2(xdo, x_ret, y_ret, screen_num_ret, NULL);
@@ -877,16 +1624,23 @@ int xdo_get_mouse_location2(const xdo_t *xdo, int *x_ret, int *y_ret,
   Window window = 0;
   Window root = 0;
   int dummy_int = 0;
-  unsigned int dummy_uint = 0;
+  unsigned int mask = 0;
   int screencount = ScreenCount(xdo->xdpy);
 
+  /* The window under the pointer changes without motion, so only the
+   * position can come from the pointer tracker */
+  if (window_ret == NULL && _xdo_pointer_cached(xdo, x_ret, y_ret, screen_num_ret)) {
+    return XDO_SUCCESS;
+  }
+
   for (i = 0; i < screencount; i++) {
     Screen *screen = ScreenOfDisplay(xdo->xdpy, i);
     ret = XQueryPointer(xdo->xdpy, RootWindowOfScreen(screen),
                         &root, &window,
-                        &x, &y, &dummy_int, &dummy_int, &dummy_uint);
+                        &x, &y, &dummy_int, &dummy_int, &mask);
     if (ret == True) {
       screen_num = i;
+      _xdo_pointer_record(xdo, x, y, screen_num, mask);
       break;
     }
   }
@@ -926,12 +1680,19 @@ int xdo_get_mouse_location2(const xdo_t *xdo, int *x_ret, int *y_ret,
 
 int xdo_click_window(const xdo_t *xdo, Window window, int button) {
   int ret = 0;
+
+  if (window != CURRENTWINDOW) {
+    XButtonEvent xbpe;
+    _xdo_init_xbuttonevent(xdo, window, &xbpe);
+    return _xdo_click_xbuttonevent(xdo, &xbpe, button);
+  }
+
   ret = xdo_mouse_down(xdo, window, button);
   if (ret != XDO_SUCCESS) {
     fprintf(stderr, "xdo_mouse_down failed, aborting click.\n");
     return ret;
   }
-  usleep(DEFAULT_DELAY);
+  xdo_delay_input(xdo, window, DEFAULT_DELAY);
   ret = xdo_mouse_up(xdo, window, button);
   return ret;
 }
@@ -939,8 +1700,19 @@ int xdo_click_window(const xdo_t *xdo, Window window, int button) {
 int xdo_click_window_multiple(const xdo_t *xdo, Window window, int button,
                        int repeat, useconds_t delay) {
   int ret = 0;
+  XButtonEvent xbpe;
+
+  /* The pointer is not going anywhere during the burst, so look it up once */
+  if (window != CURRENTWINDOW) {
+    _xdo_init_xbuttonevent(xdo, window, &xbpe);
+  }
+
   while (repeat > 0) {
-    ret = xdo_click_window(xdo, window, button);
+    if (window != CURRENTWINDOW) {
+      ret = _xdo_click_xbuttonevent(xdo, &xbpe, button);
+    } else {
+      ret = xdo_click_window(xdo, window, button);
+    }
     if (ret != XDO_SUCCESS) {
       fprintf(stderr, "click failed with %d repeats remaining\n", repeat);
       return ret;
@@ -948,8 +1720,9 @@ int xdo_click_window_multiple(const xdo_t *xdo, Window window, int button,
     repeat--;
 
     /* Sleeping even after the last click is important, so that a call to xdo_set_active_modifiers()
-     * right after won't think that the button is still pressed. */
-    usleep(delay);
+     * right after won't think that the button is still pressed. With server_delay, the
+     * server finishes the clicks before it answers any later query anyway. */
+    xdo_delay_input(xdo, window, delay);
   } /* while (repeat > 0) */
   return ret;
 } /* int xdo_click_window_multiple */
@@ -962,23 +1735,26 @@ int xdo_enter_text_window(const xdo_t *xdo, Window window, const char *string, u
    * divide by two. */
   delay /= 2;
 
+  if (xdo->server_delay) {
+    /* The server keeps the pace, so there is no need to sync on every key */
+    return _xdo_enter_text_window_do(xdo, window, string, INT_MAX, 0, delay);
+  }
+
+  _xdo_track_input_focus(xdo, string);
+
   /* XXX: Add error handling */
   //int nkeys = strlen(string);
   //charcodemap_t *keys = calloc(nkeys, sizeof(charcodemap_t));
   charcodemap_t key;
   //int modifier = 0;
-  setlocale(LC_CTYPE,"");
-  mbstate_t ps = { 0 };
-  ssize_t len;
-  while ( (len = mbsrtowcs(&key.key, &string, 1, &ps)) ) {
-    if (len == -1) {
-      fprintf(stderr, "Invalid multi-byte sequence encountered\n");
-      return XDO_ERROR;
-    }
+  size_t nchars, i;
+  int invalid;
+  wchar_t *chars = _xdo_utf8_decode(string, &nchars, &invalid);
+  for (i = 0; i < nchars; i++) {
+    key.key = chars[i];
     _xdo_charcodemap_from_char(xdo, &key);
     if (key.code == 0 && key.symbol == NoSymbol) {
-      fprintf(stderr, "I don't what key produces '%lc', skipping.\n",
-              key.key);
+      _xdo_report_unknown_char(key.key);
       continue;
     } else {
       //printf("Found key for %c\n", key.key);
@@ -993,99 +1769,936 @@ int xdo_enter_text_window(const xdo_t *xdo, Window window, const char *string, u
 
     //_xdo_send_key(xdo, window, keycode, modstate, True, delay);
     //_xdo_send_key(xdo, window, keycode, modstate, False, delay);
-    xdo_send_keysequence_window_list_do(xdo, window, &key, 1, True, NULL, delay / 2);
+    if (key.needs_binding == 1) {
+      if (_xdo_type_composed(xdo, window, key.key, delay)) {
+        continue;
+      }
+      _xdo_prebind_text(xdo, &key, chars + i + 1, nchars - i - 1);
+    }
+    _xdo_send_keysequence_window_list_do(xdo, window, &key, 1, True, NULL, delay / 2);
     key.needs_binding = 0;
-    xdo_send_keysequence_window_list_do(xdo, window, &key, 1, False, NULL, delay / 2);
+    _xdo_send_keysequence_window_list_do(xdo, window, &key, 1, False, NULL, delay / 2);
 
     /* XXX: Flush here or at the end? or never? */
     //XFlush(xdo->xdpy);
   } /* walk string generating a keysequence */
 
-  //free(keys);
+  _xdo_end_key_operation(xdo, True);
+  _xdo_release_scratch_keycodes(xdo);
+  free(chars);
+  if (invalid) {
+    /* Everything up to the bad sequence has been typed */
+    fprintf(stderr, "Invalid multi-byte sequence encountered\n");
+    return XDO_ERROR;
+  }
   return XDO_SUCCESS;
 }
 
-int _xdo_send_keysequence_window_do(const xdo_t *xdo, Window window, const char *keyseq,
-                        int pressed, int *modifier, useconds_t delay) {
-  int ret = 0;
-  charcodemap_t *keys = NULL;
-  int nkeys = 0;
-
-  if (_xdo_send_keysequence_window_to_keycode_list(xdo, keyseq, &keys, &nkeys) == False) {
-    fprintf(stderr, "Failure converting key sequence '%s' to keycodes\n", keyseq);
-    return 1;
-  }
+int xdo_enter_text_window_batch(const xdo_t *xdo, Window window, const char *string,
+                                int chunk, useconds_t delay) {
+  return _xdo_enter_text_window_do(xdo, window, string, chunk, delay, 0);
+}
 
-  ret = xdo_send_keysequence_window_list_do(xdo, window, keys, nkeys, pressed, modifier, delay);
-  if (keys != NULL) {
-    free(keys);
+/* Type 'string' without syncing on every key. The requests are flushed
+ * every 'chunk' characters, followed by 'chunk_delay'. 'key_delay' is spent
+ * between keys, split between press and release; with xdo->server_delay it
+ * is carried out by the X server and the whole string goes out in one burst. */
+static int _xdo_enter_text_window_do(const xdo_t *xdo, Window window, const char *string,
+                                     int chunk, useconds_t chunk_delay,
+                                     useconds_t key_delay) {
+  charcodemap_t key;
+  int ret = XDO_SUCCESS;
+  int sent = 0;
+  size_t nchars, i;
+  int invalid;
+  wchar_t *chars;
+
+  if (chunk <= 0) {
+    chunk = DEFAULT_BATCH_CHUNK;
   }
+  _xdo_track_input_focus(xdo, string);
 
-  return ret;
+  chars = _xdo_utf8_decode(string, &nchars, &invalid);
+  for (i = 0; i < nchars; i++) {
+    key.key = chars[i];
+    _xdo_charcodemap_from_char(xdo, &key);
+    if (key.code == 0 && key.symbol == NoSymbol) {
+      _xdo_report_unknown_char(key.key);
+      continue;
+    }
+
+    if (key.needs_binding == 1 && _xdo_type_composed(xdo, window, key.key, key_delay)) {
+      /* Typed with keys the keymap already has */
+    } else if (key.needs_binding == 1) {
+      /* Binding a scratch keycode costs round trips no matter what, so
+       * send this one the same way xdo_enter_text_window does. */
+      _xdo_prebind_text(xdo, &key, chars + i + 1, nchars - i - 1);
+      _xdo_send_keysequence_window_list_do(xdo, window, &key, 1, True, NULL,
+                                          key_delay / 2);
+      key.needs_binding = 0;
+      _xdo_send_keysequence_window_list_do(xdo, window, &key, 1, False, NULL,
+                                          key_delay / 2);
+    } else if (_xdo_input_use_xtest(xdo, window)) {
+      /* Only send the group and modifier changes this key actually needs */
+      _xdo_xtest_set_state(xdo, key.modmask, key.group);
+      XTestFakeKeyEvent(xdo->xdpy, key.code, True, _xdo_xtest_delay(xdo));
+      if (key_delay > 0) {
+        xdo_delay_input(xdo, CURRENTWINDOW, key_delay / 2);
+      }
+      XTestFakeKeyEvent(xdo->xdpy, key.code, False, _xdo_xtest_delay(xdo));
+      if (key_delay > 0) {
+        xdo_delay_input(xdo, CURRENTWINDOW, key_delay / 2);
+      }
+    } else {
+      XKeyEvent xk;
+      _xdo_init_xkeyevent(xdo, &xk);
+      xk.window = window;
+      xk.keycode = key.code;
+      xk.state = key.modmask | (key.group << 13);
+      xk.type = KeyPress;
+      XSendEvent(xdo->xdpy, xk.window, True, KeyPressMask, (XEvent *)&xk);
+      if (key_delay > 0) {
+        xdo_delay_input(xdo, window, key_delay / 2);
+      }
+      xk.type = KeyRelease;
+      XSendEvent(xdo->xdpy, xk.window, True, KeyPressMask, (XEvent *)&xk);
+      if (key_delay > 0) {
+        xdo_delay_input(xdo, window, key_delay / 2);
+      }
+    }
+
+    sent++;
+    if (sent % chunk == 0) {
+      XFlush(xdo->xdpy);
+      if (xdo->input_focus_selected) {
+        /* Pick up focus changes without waiting on the server */
+        XEventsQueued(xdo->xdpy, QueuedAfterReading);
+      }
+      if (chunk_delay > 0) {
+        usleep(chunk_delay);
+      }
+    }
+  } /* walk string generating a keysequence */
+
+  /* Leave the keyboard the way we found it */
+  _xdo_end_key_operation(xdo, True);
+  _xdo_release_scratch_keycodes(xdo);
+  XSync(xdo->xdpy, False);
+  free(chars);
+  if (invalid) {
+    fprintf(stderr, "Invalid multi-byte sequence encountered\n");
+    ret = XDO_ERROR;
+  }
+  return ret;
 }
 
-int xdo_send_keysequence_window_list_do(const xdo_t *xdo, Window window, charcodemap_t *keys, 
-                            int nkeys, int pressed, int *modifier, useconds_t delay) {
-  int i = 0;
-  int modstate = 0;
-  int keymapchanged = 0;
+static long long _xdo_now_usec(void) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1000000LL + now.tv_usec;
+}
 
-  /* Find an unused keycode in case we need to bind unmapped keysyms */
-  KeySym *keysyms = NULL;
-  int keysyms_per_keycode = 0;
-  int scratch_keycode = 0; /* Scratch space for temporary keycode bindings */
-  keysyms = XGetKeyboardMapping(xdo->xdpy, xdo->keycode_low,
-                                xdo->keycode_high - xdo->keycode_low,
-                                &keysyms_per_keycode);
+/* Like _xdo_now_usec, but never jumps when the wall clock is set */
+static long long _xdo_monotonic_usec(void) {
+#if defined(MISSING_CLOCK_GETTIME)
+  return _xdo_now_usec();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+#endif
+}
 
-  /* Find a keycode that is unused for scratchspace */
-  for (i = xdo->keycode_low; i <= xdo->keycode_high; i++) {
-    int j = 0;
-    int key_is_empty = 1;
-    for (j = 0; j < keysyms_per_keycode; j++) {
-      /*char *symname;*/
-      int symindex = (i - xdo->keycode_low) * keysyms_per_keycode + j;
-      /*symname = XKeysymToString(keysyms[symindex]);*/
-      if (keysyms[symindex] != 0) {
-        key_is_empty = 0;
-      } else {
-        break;
+/* Sleep until 'deadline' (see _xdo_monotonic_usec). Sleeping to a deadline
+ * rather than for a duration keeps a series of sleeps from drifting. */
+static void _xdo_sleep_until(long long deadline) {
+  long long remaining;
+
+  while ((remaining = deadline - _xdo_monotonic_usec()) > 0) {
+    struct timespec wait;
+    wait.tv_sec = remaining / 1000000;
+    wait.tv_nsec = (remaining % 1000000) * 1000;
+    nanosleep(&wait, NULL);
+  }
+}
+
+/* Take the first event matching 'predicate' off the queue, waiting for one
+ * until 'deadline' (see _xdo_now_usec). Other events stay queued. Returns
+ * False on timeout. */
+static int _xdo_wait_for_event(const xdo_t *xdo, XEvent *event,
+                               Bool (*predicate)(Display *, XEvent *, XPointer),
+                               XPointer arg, long long deadline) {
+  int xfd = ConnectionNumber(xdo->xdpy);
+
+  while (!XCheckIfEvent(xdo->xdpy, event, predicate, arg)) {
+    long long remaining = deadline - _xdo_now_usec();
+    struct timeval wait;
+    fd_set fds;
+
+    if (remaining <= 0) {
+      return False;
+    }
+    wait.tv_sec = remaining / 1000000;
+    wait.tv_usec = remaining % 1000000;
+    FD_ZERO(&fds);
+    FD_SET(xfd, &fds);
+    select(xfd + 1, &fds, NULL, NULL, &wait);
+  }
+  return True;
+}
+
+/* An INCR transfer in progress */
+typedef struct paste_incr {
+  Window requestor;
+  Atom property;
+  Atom type;
+  const char *data;
+  size_t len;
+  size_t offset;
+} paste_incr_t;
+
+/* A selection we own to paste text through */
+typedef struct paste {
+  Atom selection;
+  Time time; /* when we became the owner */
+  const char *utf8;
+  size_t utf8_len;
+  char *latin1; /* the text as STRING, for clients that ask for that */
+  size_t latin1_len;
+  size_t chunk_size;
+  Window manager; /* the clipboard manager's window, if there is one */
+  int done;
+
+  /* INCR transfers in progress. A clipboard manager usually starts one
+   * as soon as we own the selection, so the window we paste into needs
+   * one alongside it. */
+  paste_incr_t incr[SELECTION_INCR_MAX];
+  int nincr;
+} paste_t;
+
+enum {
+  PASTE_ATOM_TARGETS, PASTE_ATOM_UTF8_STRING, PASTE_ATOM_TEXT,
+  PASTE_ATOM_INCR, PASTE_ATOM_TIMESTAMP, PASTE_ATOM_COUNT
+};
+
+static const char *paste_atom_names[PASTE_ATOM_COUNT] = {
+  "TARGETS", "UTF8_STRING", "TEXT", "INCR", "XDO_TIMESTAMP"
+};
+
+/* STRING is Latin-1. Characters outside it become '?'. */
+static char *_xdo_utf8_to_latin1(const char *utf8, size_t len, size_t *latin1_len) {
+  char *latin1 = malloc(len + 1);
+  size_t i = 0, n = 0;
+
+  while (i < len) {
+    unsigned char c = utf8[i];
+    if (c < 0x80) {
+      latin1[n++] = c;
+      i++;
+    } else if ((c == 0xc2 || c == 0xc3) && i + 1 < len
+               && (utf8[i + 1] & 0xc0) == 0x80) {
+      latin1[n++] = ((c & 0x03) << 6) | (utf8[i + 1] & 0x3f);
+      i += 2;
+    } else {
+      /* Skip the rest of this sequence */
+      latin1[n++] = '?';
+      for (i++; i < len && (utf8[i] & 0xc0) == 0x80; i++);
+    }
+  }
+  latin1[n] = '\0';
+  *latin1_len = n;
+  return latin1;
+}
+
+/* A transfer to 'requestor' finished. Clipboard managers ask for the text
+ * as soon as we own the selection, so their transfers don't mean the
+ * paste has happened. */
+static void _xdo_paste_transfer_done(const xdo_t *xdo, paste_t *paste, Window requestor,
+                                     int incr) {
+  _xdo_debug(xdo, "Sent %s to window %ld", incr ? "INCR selection" : "selection",
+             requestor);
+  if (requestor != paste->manager) {
+    paste->done = True;
+  }
+}
+
+static void _xdo_paste_request(const xdo_t *xdo, paste_t *paste, const Atom *atoms,
+                               XSelectionRequestEvent *req) {
+  XSelectionEvent reply;
+  Atom property = (req->property != None) ? req->property : req->target;
+  Atom type = None;
+  const char *data = NULL;
+  size_t len = 0;
+
+  memset(&reply, 0, sizeof(reply));
+  reply.type = SelectionNotify;
+  reply.display = req->display;
+  reply.requestor = req->requestor;
+  reply.selection = req->selection;
+  reply.target = req->target;
+  reply.time = req->time;
+  reply.property = None;
+
+  if (req->selection != paste->selection
+      || (req->time != CurrentTime && req->time < paste->time)) {
+    /* Not ours, or meant for an earlier owner; refuse */
+  } else if (req->target == atoms[PASTE_ATOM_TARGETS]) {
+    Atom targets[4];
+    targets[0] = atoms[PASTE_ATOM_TARGETS];
+    targets[1] = atoms[PASTE_ATOM_UTF8_STRING];
+    targets[2] = XA_STRING;
+    targets[3] = atoms[PASTE_ATOM_TEXT];
+    XChangeProperty(xdo->xdpy, req->requestor, property, XA_ATOM, 32,
+                    PropModeReplace, (unsigned char *)targets, 4);
+    reply.property = property;
+  } else if (req->target == atoms[PASTE_ATOM_UTF8_STRING]
+             || req->target == atoms[PASTE_ATOM_TEXT]) {
+    type = atoms[PASTE_ATOM_UTF8_STRING];
+    data = paste->utf8;
+    len = paste->utf8_len;
+  } else if (req->target == XA_STRING) {
+    type = XA_STRING;
+    data = paste->latin1;
+    len = paste->latin1_len;
+  }
+
+  if (type != None) {
+    if (len <= paste->chunk_size) {
+      XChangeProperty(xdo->xdpy, req->requestor, property, type, 8,
+                      PropModeReplace, (const unsigned char *)data, len);
+      reply.property = property;
+      _xdo_paste_transfer_done(xdo, paste, req->requestor, False);
+    } else if (paste->nincr < SELECTION_INCR_MAX) {
+      /* Too big for one property: announce the size, then hand out a
+       * chunk every time the requestor deletes the property. */
+      paste_incr_t *incr = paste->incr + paste->nincr++;
+      long size = len;
+      XSelectInput(xdo->xdpy, req->requestor, PropertyChangeMask);
+      XChangeProperty(xdo->xdpy, req->requestor, property, atoms[PASTE_ATOM_INCR],
+                      32, PropModeReplace, (unsigned char *)&size, 1);
+      incr->requestor = req->requestor;
+      incr->property = property;
+      incr->type = type;
+      incr->data = data;
+      incr->len = len;
+      incr->offset = 0;
+      reply.property = property;
+    }
+    /* else: too many transfers at once; refuse this one */
+  }
+
+  XSendEvent(xdo->xdpy, req->requestor, False, NoEventMask, (XEvent *)&reply);
+}
+
+/* The INCR transfer that 'event' deleted the property of, or NULL */
+static paste_incr_t *_xdo_paste_incr_find(paste_t *paste, const XPropertyEvent *event) {
+  int i;
+
+  if (event->state != PropertyDelete) {
+    return NULL;
+  }
+  for (i = 0; i < paste->nincr; i++) {
+    if (paste->incr[i].requestor == event->window
+        && paste->incr[i].property == event->atom) {
+      return paste->incr + i;
+    }
+  }
+  return NULL;
+}
+
+/* Stop following property changes on the requestor of 'incr', unless
+ * another transfer to it still needs them */
+static void _xdo_paste_incr_deselect(const xdo_t *xdo, paste_t *paste,
+                                     const paste_incr_t *incr) {
+  int i;
+
+  for (i = 0; i < paste->nincr; i++) {
+    if (paste->incr + i != incr && paste->incr[i].requestor == incr->requestor) {
+      return;
+    }
+  }
+  XSelectInput(xdo->xdpy, incr->requestor, NoEventMask);
+}
+
+/* An INCR requestor deleted the property: give it the next chunk, or an
+ * empty one to say we are done. */
+static void _xdo_paste_incr_next(const xdo_t *xdo, paste_t *paste,
+                                 const XPropertyEvent *event) {
+  paste_incr_t *incr = _xdo_paste_incr_find(paste, event);
+  size_t n;
+
+  if (incr == NULL) {
+    return;
+  }
+  n = incr->len - incr->offset;
+  if (n > paste->chunk_size) {
+    n = paste->chunk_size;
+  }
+  XChangeProperty(xdo->xdpy, incr->requestor, incr->property, incr->type, 8,
+                  PropModeReplace, (const unsigned char *)incr->data + incr->offset, n);
+  incr->offset += n;
+  if (n == 0) {
+    _xdo_paste_incr_deselect(xdo, paste, incr);
+    _xdo_paste_transfer_done(xdo, paste, incr->requestor, True);
+    *incr = paste->incr[--paste->nincr];
+  }
+}
+
+static Bool _xdo_is_paste_event(Display *dpy, XEvent *event, XPointer arg) {
+  paste_t *paste = (paste_t *)arg;
+  (void)dpy;
+
+  switch (event->type) {
+    case SelectionRequest:
+      return event->xselectionrequest.selection == paste->selection;
+    case SelectionClear:
+      return event->xselectionclear.selection == paste->selection;
+    case PropertyNotify:
+      return _xdo_paste_incr_find(paste, &event->xproperty) != NULL;
+  }
+  return False;
+}
+
+/* Get a timestamp from the server by making a zero-length change to a
+ * property on 'window', which must select PropertyChangeMask. */
+static Time _xdo_get_server_time(const xdo_t *xdo, Window window) {
+  Atom atom = XInternAtom(xdo->xdpy, "XDO_TIMESTAMP", False);
+  XEvent event;
+
+  XChangeProperty(xdo->xdpy, window, atom, XA_STRING, 8, PropModeAppend, NULL, 0);
+  XWindowEvent(xdo->xdpy, window, PropertyChangeMask, &event);
+  return event.xproperty.time;
+}
+
+/* Take ownership of 'selection' to serve 'string' from. Returns the window
+ * that owns it, or None if we could not get it. */
+static Window _xdo_paste_own(const xdo_t *xdo, paste_t *paste, const char *selection,
+                             const char *string) {
+  XSetWindowAttributes attr;
+  Window owner;
+  long max_request;
+
+  memset(paste, 0, sizeof(*paste));
+  paste->selection = XInternAtom(xdo->xdpy, selection, False);
+  paste->utf8 = string;
+  paste->utf8_len = strlen(string);
+  paste->latin1 = _xdo_utf8_to_latin1(string, paste->utf8_len, &paste->latin1_len);
+
+  /* XMaxRequestSize is in 4-byte units; leave room for the request header */
+  max_request = XMaxRequestSize(xdo->xdpy) * 4 - 64;
+  paste->chunk_size = (max_request < SELECTION_CHUNK_MAX) ? max_request : SELECTION_CHUNK_MAX;
+
+  paste->manager = XGetSelectionOwner(xdo->xdpy,
+                                      XInternAtom(xdo->xdpy, "CLIPBOARD_MANAGER", False));
+
+  attr.event_mask = PropertyChangeMask;
+  owner = XCreateWindow(xdo->xdpy, DefaultRootWindow(xdo->xdpy), -1, -1, 1, 1, 0,
+                        CopyFromParent, InputOnly, CopyFromParent, CWEventMask, &attr);
+  paste->time = _xdo_get_server_time(xdo, owner);
+  XSetSelectionOwner(xdo->xdpy, paste->selection, owner, paste->time);
+  if (XGetSelectionOwner(xdo->xdpy, paste->selection) != owner) {
+    fprintf(stderr, "Failed to take ownership of the %s selection\n", selection);
+    XDestroyWindow(xdo->xdpy, owner);
+    free(paste->latin1);
+    return None;
+  }
+  return owner;
+}
+
+/* Handle one event from _xdo_is_paste_event. Returns False once someone
+ * else took the selection. */
+static int _xdo_paste_event(const xdo_t *xdo, paste_t *paste, const Atom *atoms,
+                            XEvent *event) {
+  if (event->type == SelectionRequest) {
+    _xdo_paste_request(xdo, paste, atoms, &event->xselectionrequest);
+  } else if (event->type == PropertyNotify) {
+    _xdo_paste_incr_next(xdo, paste, &event->xproperty);
+  } else if (event->type == SelectionClear) {
+    return False;
+  }
+  return True;
+}
+
+/* Give up the selection, if we still have it, and everything that was
+ * set up to serve it */
+static void _xdo_paste_release(const xdo_t *xdo, paste_t *paste, Window owner) {
+  while (paste->nincr > 0) {
+    paste_incr_t *incr = paste->incr + --paste->nincr;
+    _xdo_paste_incr_deselect(xdo, paste, incr);
+  }
+  if (XGetSelectionOwner(xdo->xdpy, paste->selection) == owner) {
+    XSetSelectionOwner(xdo->xdpy, paste->selection, None, paste->time);
+  }
+  XDestroyWindow(xdo->xdpy, owner);
+  XSync(xdo->xdpy, False);
+  free(paste->latin1);
+}
+
+int xdo_enter_text_window_selection(const xdo_t *xdo, Window window, const char *string,
+                                    const char *selection, const char *paste_keyseq,
+                                    useconds_t timeout) {
+  Atom atoms[PASTE_ATOM_COUNT];
+  long long deadline;
+  Window owner;
+  int ret = XDO_SUCCESS;
+  paste_t paste;
+  XEvent event;
+
+  XInternAtoms(xdo->xdpy, (char **)paste_atom_names, PASTE_ATOM_COUNT, False, atoms);
+  owner = _xdo_paste_own(xdo, &paste, selection, string);
+  if (owner == None) {
+    return XDO_ERROR;
+  }
+
+  xdo_send_keysequence_window(xdo, window, paste_keyseq, 0);
+
+  deadline = _xdo_now_usec() + timeout;
+  while (!paste.done) {
+    if (!_xdo_wait_for_event(xdo, &event, _xdo_is_paste_event, (XPointer)&paste,
+                             deadline)) {
+      fprintf(stderr, "Timed out waiting for the paste into window %ld\n", window);
+      ret = XDO_ERROR;
+      break;
+    }
+    if (!_xdo_paste_event(xdo, &paste, atoms, &event)) {
+      fprintf(stderr, "Lost the %s selection before the paste finished\n", selection);
+      ret = XDO_ERROR;
+      break;
+    }
+  }
+
+  _xdo_paste_release(xdo, &paste, owner);
+  return ret;
+}
+
+int xdo_serve_selection(const xdo_t *xdo, const char *selection, const char *string) {
+  Atom atoms[PASTE_ATOM_COUNT];
+  Window owner;
+  paste_t paste;
+  XEvent event;
+
+  XInternAtoms(xdo->xdpy, (char **)paste_atom_names, PASTE_ATOM_COUNT, False, atoms);
+  owner = _xdo_paste_own(xdo, &paste, selection, string);
+  if (owner == None) {
+    return XDO_ERROR;
+  }
+
+  do {
+    XIfEvent(xdo->xdpy, &event, _xdo_is_paste_event, (XPointer)&paste);
+  } while (_xdo_paste_event(xdo, &paste, atoms, &event));
+
+  _xdo_debug(xdo, "Another client took the %s selection", selection);
+  _xdo_paste_release(xdo, &paste, owner);
+  return XDO_SUCCESS;
+}
+
+/* STRING is Latin-1, which maps straight onto the first 256 code points */
+static char *_xdo_latin1_to_utf8(const unsigned char *latin1, size_t len) {
+  char *utf8 = malloc(len * 2 + 1);
+  size_t i, n = 0;
+
+  for (i = 0; i < len; i++) {
+    if (latin1[i] < 0x80) {
+      utf8[n++] = latin1[i];
+    } else {
+      utf8[n++] = 0xc0 | (latin1[i] >> 6);
+      utf8[n++] = 0x80 | (latin1[i] & 0x3f);
+    }
+  }
+  utf8[n] = '\0';
+  return utf8;
+}
+
+/* Matches events on the window given by 'arg' */
+static Bool _xdo_is_window_event(Display *dpy, XEvent *event, XPointer arg) {
+  (void)dpy;
+  return event->xany.window == *(Window *)arg;
+}
+
+static Bool _xdo_is_selection_notify(Display *dpy, XEvent *event, XPointer arg) {
+  (void)dpy;
+  return event->type == SelectionNotify
+    && event->xselection.requestor == *(Window *)arg;
+}
+
+static Bool _xdo_is_new_property(Display *dpy, XEvent *event, XPointer arg) {
+  (void)dpy;
+  return event->type == PropertyNotify
+    && event->xproperty.window == *(Window *)arg
+    && event->xproperty.state == PropertyNewValue;
+}
+
+/* Read and delete the selection data that was put into 'property' on
+ * 'window', following the INCR protocol if the owner uses it. The data is
+ * returned NUL-terminated in a malloc'd buffer. */
+static int _xdo_read_selection_property(const xdo_t *xdo, Window window, Atom property,
+                                        long long deadline, char **data_ret,
+                                        size_t *len_ret, Atom *type_ret) {
+  Atom incr = XInternAtom(xdo->xdpy, "INCR", False);
+  unsigned char *chunk = NULL;
+  unsigned long nitems, after;
+  char *data = NULL;
+  size_t len = 0;
+  int format, is_incr;
+  XEvent event;
+
+  if (XGetWindowProperty(xdo->xdpy, window, property, 0, LONG_MAX / 4, True,
+                         AnyPropertyType, type_ret, &format, &nitems, &after,
+                         &chunk) != Success) {
+    return XDO_ERROR;
+  }
+  is_incr = (*type_ret == incr);
+  if (!is_incr) {
+    data = malloc(nitems + 1);
+    memcpy(data, chunk, nitems);
+    len = nitems;
+  }
+  XFree(chunk);
+
+  /* Deleting the INCR property asked for the first chunk; every chunk we
+   * delete asks for the next, until an empty one */
+  while (is_incr) {
+    if (!_xdo_wait_for_event(xdo, &event, _xdo_is_new_property, (XPointer)&window,
+                             deadline)) {
+      free(data);
+      return XDO_ERROR;
+    }
+    if (event.xproperty.atom != property
+        || XGetWindowProperty(xdo->xdpy, window, property, 0, LONG_MAX / 4, True,
+                              AnyPropertyType, type_ret, &format, &nitems, &after,
+                              &chunk) != Success) {
+      continue;
+    }
+    data = realloc(data, len + nitems + 1);
+    memcpy(data + len, chunk, nitems);
+    len += nitems;
+    is_incr = (nitems > 0);
+    XFree(chunk);
+  }
+
+  data[len] = '\0';
+  *data_ret = data;
+  *len_ret = len;
+  return XDO_SUCCESS;
+}
+
+int xdo_get_selection(const xdo_t *xdo, const char *selection, char **text_ret,
+                      useconds_t timeout) {
+  Atom sel = XInternAtom(xdo->xdpy, selection, False);
+  Atom property = XInternAtom(xdo->xdpy, "XDO_SELECTION", False);
+  Atom targets[2];
+  long long deadline = _xdo_now_usec() + timeout;
+  XSetWindowAttributes attr;
+  int ret = XDO_SUCCESS;
+  Window window;
+  Time time;
+  XEvent event;
+  int i;
+
+  *text_ret = NULL;
+  if (XGetSelectionOwner(xdo->xdpy, sel) == None) {
+    return XDO_SUCCESS;
+  }
+
+  targets[0] = XInternAtom(xdo->xdpy, "UTF8_STRING", False);
+  targets[1] = XA_STRING;
+  attr.event_mask = PropertyChangeMask;
+  window = XCreateWindow(xdo->xdpy, DefaultRootWindow(xdo->xdpy), -1, -1, 1, 1, 0,
+                         CopyFromParent, InputOnly, CopyFromParent, CWEventMask, &attr);
+  time = _xdo_get_server_time(xdo, window);
+
+  /* Owners that can't give UTF8_STRING refuse it; try STRING then */
+  for (i = 0; i < 2 && ret == XDO_SUCCESS && *text_ret == NULL; i++) {
+    char *data;
+    size_t len;
+    Atom type;
+
+    XConvertSelection(xdo->xdpy, sel, targets[i], property, window, time);
+    XFlush(xdo->xdpy);
+    if (!_xdo_wait_for_event(xdo, &event, _xdo_is_selection_notify, (XPointer)&window,
+                             deadline)) {
+      fprintf(stderr, "Timed out reading the %s selection\n", selection);
+      ret = XDO_ERROR;
+    } else if (event.xselection.property != None) {
+      ret = _xdo_read_selection_property(xdo, window, property, deadline,
+                                         &data, &len, &type);
+      if (ret == XDO_SUCCESS && type == XA_STRING) {
+        *text_ret = _xdo_latin1_to_utf8((unsigned char *)data, len);
+        free(data);
+      } else if (ret == XDO_SUCCESS) {
+        *text_ret = data;
+      }
+    }
+  }
+
+  XDestroyWindow(xdo->xdpy, window);
+  /* Property changes we caused may still be on their way */
+  XSync(xdo->xdpy, False);
+  while (XCheckIfEvent(xdo->xdpy, &event, _xdo_is_window_event, (XPointer)&window));
+  return ret;
+}
+
+/* How adaptive typing asks the target whether it has caught up */
+typedef struct probe {
+  Window client; /* window answering _NET_WM_PING, or None to use XSync */
+  Window root;
+  long saved_root_mask;
+  Atom wm_protocols;
+  Atom net_wm_ping;
+  long serial;
+} probe_t;
+
+/* Use _NET_WM_PING if the client owning 'window' supports it. The client
+ * handles the ping after the keys sent before it, so the time to the
+ * answer tells how far behind it is. XSync only tells about the server. */
+static void _xdo_probe_init(const xdo_t *xdo, Window window, probe_t *probe) {
+  XWindowAttributes attr;
+  Window client = None;
+  Atom *protocols = NULL;
+  int nprotocols = 0, i;
+
+  memset(probe, 0, sizeof(*probe));
+  probe->wm_protocols = XInternAtom(xdo->xdpy, "WM_PROTOCOLS", False);
+  probe->net_wm_ping = XInternAtom(xdo->xdpy, "_NET_WM_PING", False);
+
+  if (window == CURRENTWINDOW) {
+    xdo_get_focused_window(xdo, &window);
+  }
+  if (window == None || window == PointerRoot
+      || xdo_find_window_client(xdo, window, &client, XDO_FIND_PARENTS) != XDO_SUCCESS) {
+    return;
+  }
+
+  if (XGetWMProtocols(xdo->xdpy, client, &protocols, &nprotocols)) {
+    for (i = 0; i < nprotocols; i++) {
+      if (protocols[i] == probe->net_wm_ping) {
+        probe->client = client;
+      }
+    }
+    XFree(protocols);
+  }
+  if (probe->client == None) {
+    return;
+  }
+
+  /* The answer is sent to the root window */
+  XGetWindowAttributes(xdo->xdpy, client, &attr);
+  probe->root = attr.root;
+  XGetWindowAttributes(xdo->xdpy, probe->root, &attr);
+  probe->saved_root_mask = attr.your_event_mask;
+  XSelectInput(xdo->xdpy, probe->root, attr.your_event_mask | SubstructureNotifyMask);
+}
+
+/* Events selected on the root only for the probe, and late pongs */
+static Bool _xdo_is_probe_event(Display *dpy, XEvent *event, XPointer arg) {
+  probe_t *probe = (probe_t *)arg;
+  (void)dpy;
+
+  if (event->xany.window != probe->root) {
+    return False;
+  }
+  switch (event->type) {
+    case ClientMessage:
+      return event->xclient.message_type == probe->wm_protocols
+        && (Atom)event->xclient.data.l[0] == probe->net_wm_ping;
+    case CreateNotify: case DestroyNotify: case UnmapNotify: case MapNotify:
+    case ReparentNotify: case ConfigureNotify: case GravityNotify:
+    case CirculateNotify:
+      return !(probe->saved_root_mask & SubstructureNotifyMask);
+  }
+  return False;
+}
+
+static void _xdo_probe_free(const xdo_t *xdo, probe_t *probe) {
+  XEvent event;
+
+  if (probe->client == None) {
+    return;
+  }
+  XSelectInput(xdo->xdpy, probe->root, probe->saved_root_mask);
+  /* Nothing else asked for what the probe made the root report, so it
+   * would only pile up in the queue */
+  XSync(xdo->xdpy, False);
+  while (XCheckIfEvent(xdo->xdpy, &event, _xdo_is_probe_event, (XPointer)probe));
+}
+
+static Bool _xdo_is_pong(Display *dpy, XEvent *event, XPointer arg) {
+  probe_t *probe = (probe_t *)arg;
+  (void)dpy;
+
+  return event->type == ClientMessage
+    && event->xclient.message_type == probe->wm_protocols
+    && (Atom)event->xclient.data.l[0] == probe->net_wm_ping
+    && event->xclient.data.l[1] == probe->serial;
+}
+
+/* How long the target took to catch up, in microseconds, or -1 if it did
+ * not within ADAPTIVE_PROBE_TIMEOUT */
+static long long _xdo_probe(const xdo_t *xdo, probe_t *probe) {
+  long long start = _xdo_now_usec();
+  XEvent event;
+
+  if (probe->client == None) {
+    XSync(xdo->xdpy, False);
+    return _xdo_now_usec() - start;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.xclient.type = ClientMessage;
+  event.xclient.window = probe->client;
+  event.xclient.message_type = probe->wm_protocols;
+  event.xclient.format = 32;
+  event.xclient.data.l[0] = probe->net_wm_ping;
+  /* Meant to be a timestamp; clients only echo it back */
+  event.xclient.data.l[1] = ++probe->serial;
+  event.xclient.data.l[2] = probe->client;
+  XSendEvent(xdo->xdpy, probe->client, False, NoEventMask, &event);
+  XFlush(xdo->xdpy);
+
+  if (!_xdo_wait_for_event(xdo, &event, _xdo_is_pong, (XPointer)probe,
+                           start + ADAPTIVE_PROBE_TIMEOUT)) {
+    return -1;
+  }
+  return _xdo_now_usec() - start;
+}
+
+int xdo_enter_text_window_adaptive(const xdo_t *xdo, Window window, const char *string,
+                                   useconds_t max_delay, xdo_typing_stats_t *stats) {
+  char *round = malloc(strlen(string) + 1);
+  long long start = _xdo_now_usec();
+  long long latency, best = -1;
+  useconds_t delay = ADAPTIVE_START_DELAY;
+  size_t chars = 0;
+  int backoffs = 0;
+  int ret = XDO_SUCCESS;
+  int used_ping;
+  probe_t probe;
+
+  if (delay > max_delay) {
+    delay = max_delay;
+  }
+  _xdo_probe_init(xdo, window, &probe);
+  used_ping = (probe.client != None);
+
+  while (*string != '\0') {
+    const char *end = string;
+    size_t n = 0;
+
+    /* The next ADAPTIVE_ROUND characters; continuation bytes don't count */
+    while (*end != '\0' && (n < ADAPTIVE_ROUND || (*end & 0xc0) == 0x80)) {
+      if ((*end & 0xc0) != 0x80) {
+        n++;
       }
+      end++;
     }
-    if (key_is_empty) {
-      scratch_keycode = i;
+    memcpy(round, string, end - string);
+    round[end - string] = '\0';
+    string = end;
+    chars += n;
+
+    ret = _xdo_enter_text_window_do(xdo, window, round, INT_MAX, 0, delay);
+    if (ret != XDO_SUCCESS) {
       break;
     }
+
+    latency = _xdo_probe(xdo, &probe);
+    if (latency < 0) {
+      /* Not answering pings at all is no use as a measure; go as slow as
+       * allowed and fall back to XSync */
+      _xdo_debug(xdo, "No answer to _NET_WM_PING, probing with XSync");
+      _xdo_probe_free(xdo, &probe);
+      probe.client = None;
+      delay = max_delay;
+      backoffs++;
+      continue;
+    }
+
+    if (best < 0 || latency < best) {
+      best = latency;
+    }
+    if (latency > 2 * best + ADAPTIVE_SLACK) {
+      /* Falling behind: back off hard */
+      delay = (delay * 2 + 1000 < max_delay) ? delay * 2 + 1000 : max_delay;
+      backoffs++;
+    } else {
+      /* Keeping up: speed up gently */
+      delay -= (delay < 100) ? delay : delay / 4;
+    }
+    _xdo_debug(xdo, "Adaptive typing: probe took %lldus, delay now %uus",
+               latency, (unsigned int)delay);
   }
-  XFree(keysyms);
+
+  _xdo_probe_free(xdo, &probe);
+  free(round);
+
+  if (stats != NULL) {
+    stats->chars = chars;
+    stats->seconds = (_xdo_now_usec() - start) / 1000000.0;
+    stats->chars_per_sec = (stats->seconds > 0) ? chars / stats->seconds : 0;
+    stats->final_delay = delay;
+    stats->backoffs = backoffs;
+    stats->used_ping = used_ping;
+  }
+  return ret;
+}
+
+int _xdo_send_keysequence_window_do(const xdo_t *xdo, Window window, const char *keyseq,
+                        int pressed, int *modifier, useconds_t delay) {
+  int ret = 0;
+  charcodemap_t *keys = NULL;
+  int nkeys = 0;
+
+  if (_xdo_send_keysequence_window_to_keycode_list(xdo, keyseq, &keys, &nkeys) == False) {
+    fprintf(stderr, "Failure converting key sequence '%s' to keycodes\n", keyseq);
+    return 1;
+  }
+
+  ret = _xdo_send_keysequence_window_list_do(xdo, window, keys, nkeys, pressed, modifier, delay);
+  if (keys != NULL) {
+    free(keys);
+  }
+
+  return ret;
+}
+
+int xdo_send_keysequence_window_list_do(const xdo_t *xdo, Window window, charcodemap_t *keys, 
+                            int nkeys, int pressed, int *modifier, useconds_t delay) {
+  int ret = _xdo_send_keysequence_window_list_do(xdo, window, keys, nkeys,
+                                                 pressed, modifier, delay);
+  /* Callers outside the library cannot end the key operation themselves.
+   * Keys left down keep their modifiers until they are released, as with
+   * xdo_send_keysequence_window_down. */
+  _xdo_end_key_operation(xdo, !pressed);
+  return ret;
+}
+
+static int _xdo_send_keysequence_window_list_do(const xdo_t *xdo, Window window,
+                                                charcodemap_t *keys, int nkeys,
+                                                int pressed, int *modifier,
+                                                useconds_t delay) {
+  int i = 0;
+  int modstate = 0;
 
   /* Allow passing NULL for modifier in case we don't care about knowing
    * the modifier map state after we finish */
   if (modifier == NULL)
     modifier = &modstate;
 
+  /* Bind every keysym missing from the keymap up front, in as few
+   * keymap changes as possible. The bindings are kept for later calls and
+   * undone by _xdo_release_scratch_keycodes. */
+  _xdo_bind_scratch_keysyms(xdo, keys, nkeys);
+
   for (i = 0; i < nkeys; i++) {
-    if (keys[i].needs_binding == 1) {
-      KeySym keysym_list[] = { keys[i].symbol };
-      _xdo_debug(xdo, "Mapping sym %lu to %d", keys[i].symbol, scratch_keycode);
-      XChangeKeyboardMapping(xdo->xdpy, scratch_keycode, 1, keysym_list, 1);
-      XSync(xdo->xdpy, False);
-      /* override the code in our current key to use the scratch_keycode */
-      keys[i].code = scratch_keycode;
-      keymapchanged = 1;
+    if (keys[i].needs_binding == 1 && keys[i].code == 0) {
+      /* No scratch keycode could be found for this one */
+      continue;
     }
 
     //fprintf(stderr, "keyseqlist_do: Sending %lc %s (%d, mods %x)\n",
             //keys[i].key, (pressed ? "down" : "up"), keys[i].code, *modifier);
     _xdo_send_key(xdo, window, &(keys[i]), *modifier, pressed, delay);
 
-    if (keys[i].needs_binding == 1) {
-      /* If we needed to make a new keymapping for this keystroke, we
-       * should sync with the server now, after the keypress, so that
-       * the next mapping or removal doesn't conflict. */
-      XSync(xdo->xdpy, False);
-    }
-
     if (pressed) {
       *modifier |= keys[i].modmask;
     } else {
@@ -1094,13 +2707,6 @@ int xdo_send_keysequence_window_list_do(const xdo_t *xdo, Window window, charcod
   }
 
 
-  if (keymapchanged) {
-    KeySym keysym_list[] = { 0 };
-    _xdo_debug(xdo, "Reverting scratch keycode (sym %lu to %d)",
-              keys[i].symbol, scratch_keycode);
-    XChangeKeyboardMapping(xdo->xdpy, scratch_keycode, 1, keysym_list, 1);
-  }
-
   /* Necessary? */
   XFlush(xdo->xdpy);
   return XDO_SUCCESS;
@@ -1109,12 +2715,18 @@ int xdo_send_keysequence_window_list_do(const xdo_t *xdo, Window window, charcod
   
 int xdo_send_keysequence_window_down(const xdo_t *xdo, Window window, const char *keyseq,
                          useconds_t delay) {
-  return _xdo_send_keysequence_window_do(xdo, window, keyseq, True, NULL, delay);
+  int ret = _xdo_send_keysequence_window_do(xdo, window, keyseq, True, NULL, delay);
+  /* The keys stay down, and so must the modifiers they need */
+  _xdo_end_key_operation(xdo, False);
+  return ret;
 }
 
 int xdo_send_keysequence_window_up(const xdo_t *xdo, Window window, const char *keyseq,
                        useconds_t delay) {
-  return _xdo_send_keysequence_window_do(xdo, window, keyseq, False, NULL, delay);
+  int ret = _xdo_send_keysequence_window_do(xdo, window, keyseq, False, NULL, delay);
+  _xdo_end_key_operation(xdo, True);
+  _xdo_release_scratch_keycodes(xdo);
+  return ret;
 }
 
 int xdo_send_keysequence_window(const xdo_t *xdo, Window window, const char *keyseq,
@@ -1123,11 +2735,338 @@ int xdo_send_keysequence_window(const xdo_t *xdo, Window window, const char *key
   int modifier = 0;
   ret += _xdo_send_keysequence_window_do(xdo, window, keyseq, True, &modifier, delay / 2);
   ret += _xdo_send_keysequence_window_do(xdo, window, keyseq, False, &modifier, delay / 2);
+  _xdo_end_key_operation(xdo, True);
+  _xdo_release_scratch_keycodes(xdo);
   return ret;
 }
 
-/* Add by Lee Pumphret 2007-07-28
- * Modified slightly by Jordan Sissel */
+struct xdo_keyseq {
+  charcodemap_t *keys;
+  int nkeys;
+};
+
+xdo_keyseq_t *xdo_keyseq_compile(const xdo_t *xdo, const char *keysequence) {
+  xdo_keyseq_t *keyseq = calloc(1, sizeof(xdo_keyseq_t));
+
+  if (_xdo_send_keysequence_window_to_keycode_list(xdo, keysequence,
+                                                   &keyseq->keys, &keyseq->nkeys) == False) {
+    fprintf(stderr, "Failure converting key sequence '%s' to keycodes\n", keysequence);
+    free(keyseq->keys);
+    free(keyseq);
+    keyseq = NULL;
+  }
+  _xdo_mutable(xdo)->keymap_checked = False;
+  return keyseq;
+}
+
+int xdo_keyseq_send_window_down(const xdo_t *xdo, Window window,
+                                xdo_keyseq_t *keyseq, useconds_t delay) {
+  int ret = _xdo_send_keysequence_window_list_do(xdo, window, keyseq->keys,
+                                                keyseq->nkeys, True, NULL, delay);
+  _xdo_end_key_operation(xdo, False);
+  return ret;
+}
+
+int xdo_keyseq_send_window_up(const xdo_t *xdo, Window window,
+                              xdo_keyseq_t *keyseq, useconds_t delay) {
+  int ret = _xdo_send_keysequence_window_list_do(xdo, window, keyseq->keys,
+                                                keyseq->nkeys, False, NULL, delay);
+  _xdo_end_key_operation(xdo, True);
+  _xdo_release_scratch_keycodes(xdo);
+  return ret;
+}
+
+int xdo_keyseq_send_window(const xdo_t *xdo, Window window,
+                           xdo_keyseq_t *keyseq, useconds_t delay) {
+  int ret = 0;
+  int modifier = 0;
+  ret += _xdo_send_keysequence_window_list_do(xdo, window, keyseq->keys,
+                                             keyseq->nkeys, True, &modifier, delay / 2);
+  ret += _xdo_send_keysequence_window_list_do(xdo, window, keyseq->keys,
+                                             keyseq->nkeys, False, &modifier, delay / 2);
+  _xdo_end_key_operation(xdo, True);
+  _xdo_release_scratch_keycodes(xdo);
+  return ret;
+}
+
+int xdo_keyseq_get_chord(const xdo_t *xdo, const xdo_keyseq_t *keyseq,
+                         KeyCode *keycode_ret, unsigned int *modmask_ret) {
+  const charcodemap_t *last;
+  int i;
+
+  if (keyseq == NULL || keyseq->nkeys == 0) {
+    return XDO_ERROR;
+  }
+
+  /* The last key is the one pressed, and has to be in the keymap */
+  last = keyseq->keys + keyseq->nkeys - 1;
+  if (last->code == 0 || last->needs_binding == 1) {
+    return XDO_ERROR;
+  }
+  *keycode_ret = last->code;
+  *modmask_ret = last->modmask;
+
+  /* Everything before it has to be a modifier */
+  for (i = 0; i < keyseq->nkeys - 1; i++) {
+    int mask = 0;
+    if (keyseq->keys[i].code != 0) {
+      mask = _xdo_query_keycode_to_modifier(_xdo_modmap(xdo), keyseq->keys[i].code);
+    }
+    if (mask == 0) {
+      return XDO_ERROR;
+    }
+    *modmask_ret |= mask;
+  }
+  return XDO_SUCCESS;
+}
+
+void xdo_keyseq_free(xdo_keyseq_t *keyseq) {
+  if (keyseq == NULL)
+    return;
+
+  free(keyseq->keys);
+  free(keyseq);
+}
+
+/* One key event of an interleaved stream. XSendEvent key events carry
+ * their own state, so the stream is the same for every window. */
+typedef struct key_event {
+  KeyCode code;
+  unsigned int state;
+  int is_press;
+} key_event_t;
+
+/* Split 'windows' into the ones that get XSendEvent input, which are
+ * moved to the front, and the ones that need XTest. Returns how many
+ * take XSendEvent. */
+static int _xdo_partition_sendevent_windows(const xdo_t *xdo, Window *windows,
+                                            int nwindows) {
+  int i, nsend = 0;
+
+  for (i = 0; i < nwindows; i++) {
+    if (!_xdo_input_use_xtest(xdo, windows[i])) {
+      Window tmp = windows[nsend];
+      windows[nsend++] = windows[i];
+      windows[i] = tmp;
+    }
+  }
+  _xdo_forget_input_window(xdo);
+  return nsend;
+}
+
+/* Send each event to every window before going on to the next one, with
+ * one flush and one delay per round. The cost of a round hardly depends on
+ * the number of windows, since the requests are pipelined. */
+static void _xdo_send_interleaved(const xdo_t *xdo, const Window *windows, int nwindows,
+                                  const key_event_t *events, int nevents,
+                                  useconds_t delay) {
+  XKeyEvent xk;
+  int i, w;
+
+  _xdo_init_xkeyevent(xdo, &xk);
+  for (i = 0; i < nevents; i++) {
+    xk.keycode = events[i].code;
+    xk.state = events[i].state;
+    xk.type = events[i].is_press ? KeyPress : KeyRelease;
+    for (w = 0; w < nwindows; w++) {
+      xk.window = windows[w];
+      XSendEvent(xdo->xdpy, xk.window, True, KeyPressMask, (XEvent *)&xk);
+    }
+    XFlush(xdo->xdpy);
+    if (delay > 0) {
+      usleep(delay);
+    }
+  }
+}
+
+/* How many of 'keys' one round of scratch keycode bindings can cover: up
+ * to the first key whose keysym no longer fits. Always at least one, so
+ * that a key that cannot be bound at all is still gotten past. */
+static int _xdo_scratch_round(const xdo_t *xdo, const charcodemap_t *keys, int nkeys) {
+  int len = _xdo_scratch_pool(xdo);
+  KeySym *bound = calloc(len + 1, sizeof(KeySym));
+  int nbound = 0;
+  int n, i;
+
+  for (n = 0; n < nkeys; n++) {
+    if (keys[n].needs_binding != 1) {
+      continue;
+    }
+    for (i = 0; i < nbound; i++) {
+      if (bound[i] == keys[n].symbol) {
+        break;
+      }
+    }
+    if (i == nbound) {
+      if (nbound == len) {
+        break;
+      }
+      bound[nbound++] = keys[n].symbol;
+    }
+  }
+  free(bound);
+  return (n > 0) ? n : 1;
+}
+
+int xdo_enter_text_windows(const xdo_t *xdo, const Window *windows, int nwindows,
+                           const char *string, useconds_t delay) {
+  Window *targets = malloc(nwindows * sizeof(Window));
+  charcodemap_t *keys;
+  key_event_t *events;
+  size_t nchars, i;
+  int nkeys = 0, nevents, nsend, k, start, end;
+  int ret = XDO_SUCCESS;
+  int invalid;
+  wchar_t *chars;
+
+  memcpy(targets, windows, nwindows * sizeof(Window));
+  nsend = _xdo_partition_sendevent_windows(xdo, targets, nwindows);
+
+  if (nsend > 0) {
+    chars = _xdo_utf8_decode(string, &nchars, &invalid);
+    keys = calloc(nchars + 1, sizeof(charcodemap_t));
+    for (i = 0; i < nchars; i++) {
+      keys[nkeys].key = chars[i];
+      _xdo_charcodemap_from_char(xdo, &keys[nkeys]);
+      if (keys[nkeys].code == 0 && keys[nkeys].symbol == NoSymbol) {
+        _xdo_report_unknown_char(keys[nkeys].key);
+        continue;
+      }
+      nkeys++;
+    }
+
+    /* All windows see the same keymap, so bind as many keysyms as there
+     * are scratch keycodes for, type what they cover and go on with the
+     * rest, like _xdo_prebind_text does for a single window */
+    events = calloc(nkeys * 2 + 1, sizeof(key_event_t));
+    for (start = 0; start < nkeys; start = end) {
+      end = start + _xdo_scratch_round(xdo, keys + start, nkeys - start);
+      _xdo_bind_scratch_keysyms(xdo, keys + start, end - start);
+
+      nevents = 0;
+      for (k = start; k < end; k++) {
+        if (keys[k].code == 0) {
+          /* Nothing to bind it to; reported by _xdo_bind_scratch_keysyms */
+          ret = XDO_ERROR;
+          continue;
+        }
+        events[nevents].code = keys[k].code;
+        events[nevents].state = keys[k].modmask | (keys[k].group << 13);
+        events[nevents + 1] = events[nevents];
+        events[nevents].is_press = True;
+        events[nevents + 1].is_press = False;
+        nevents += 2;
+      }
+
+      /* The same pace as xdo_enter_text_window, which halves the delay
+       * once for press and release and once more per event */
+      _xdo_debug(xdo, "Typing %d keys into %d windows at once", end - start, nsend);
+      _xdo_send_interleaved(xdo, targets, nsend, events, nevents, delay / 4);
+    }
+    _xdo_release_scratch_keycodes(xdo);
+
+    free(events);
+    free(keys);
+    free(chars);
+    if (invalid) {
+      fprintf(stderr, "Invalid multi-byte sequence encountered\n");
+      ret = XDO_ERROR;
+    }
+  }
+
+  /* Whatever goes through XTest goes to the focus, one after another */
+  for (k = nsend; k < nwindows; k++) {
+    ret |= xdo_enter_text_window(xdo, targets[k], string, delay);
+  }
+
+  free(targets);
+  return ret;
+}
+
+static int _xdo_keyseq_send_windows_do(const xdo_t *xdo, const Window *windows,
+                                       int nwindows, xdo_keyseq_t *keyseq,
+                                       int press, int release, useconds_t delay) {
+  int (*keyfunc)(const xdo_t *, Window, xdo_keyseq_t *, useconds_t);
+  Window *targets = malloc(nwindows * sizeof(Window));
+  key_event_t *events;
+  unsigned int modifier = 0;
+  int nsend, nevents = 0, i;
+  int ret = XDO_SUCCESS;
+
+  memcpy(targets, windows, nwindows * sizeof(Window));
+  nsend = _xdo_partition_sendevent_windows(xdo, targets, nwindows);
+
+  if (nsend > 0) {
+    _xdo_bind_scratch_keysyms(xdo, keyseq->keys, keyseq->nkeys);
+    events = calloc(keyseq->nkeys * 2 + 1, sizeof(key_event_t));
+
+    /* The same modifier state xdo_send_keysequence_window_list_do gives
+     * each key: what the keys before it hold down, plus its own */
+    for (i = 0; press && i < keyseq->nkeys; i++) {
+      const charcodemap_t *key = keyseq->keys + i;
+      if (key->code == 0) {
+        continue;
+      }
+      events[nevents].code = key->code;
+      events[nevents].state = modifier | key->modmask | (key->group << 13);
+      events[nevents].is_press = True;
+      nevents++;
+      modifier |= key->modmask;
+    }
+    for (i = 0; release && i < keyseq->nkeys; i++) {
+      const charcodemap_t *key = keyseq->keys + i;
+      if (key->code == 0) {
+        continue;
+      }
+      events[nevents].code = key->code;
+      events[nevents].state = modifier | key->modmask | (key->group << 13);
+      events[nevents].is_press = False;
+      nevents++;
+      modifier &= ~key->modmask;
+    }
+
+    /* A full key press and release splits the delay like
+     * xdo_keyseq_send_window does */
+    _xdo_send_interleaved(xdo, targets, nsend, events, nevents,
+                          (press && release) ? delay / 2 : delay);
+    free(events);
+  }
+
+  if (press && release) {
+    keyfunc = xdo_keyseq_send_window;
+  } else if (press) {
+    keyfunc = xdo_keyseq_send_window_down;
+  } else {
+    keyfunc = xdo_keyseq_send_window_up;
+  }
+  for (i = nsend; i < nwindows; i++) {
+    ret |= keyfunc(xdo, targets[i], keyseq, delay);
+  }
+
+  if (release) {
+    _xdo_release_scratch_keycodes(xdo);
+  }
+  free(targets);
+  return ret;
+}
+
+int xdo_keyseq_send_windows(const xdo_t *xdo, const Window *windows, int nwindows,
+                            xdo_keyseq_t *keyseq, useconds_t delay) {
+  return _xdo_keyseq_send_windows_do(xdo, windows, nwindows, keyseq, True, True, delay);
+}
+
+int xdo_keyseq_send_windows_up(const xdo_t *xdo, const Window *windows, int nwindows,
+                               xdo_keyseq_t *keyseq, useconds_t delay) {
+  return _xdo_keyseq_send_windows_do(xdo, windows, nwindows, keyseq, False, True, delay);
+}
+
+int xdo_keyseq_send_windows_down(const xdo_t *xdo, const Window *windows, int nwindows,
+                                 xdo_keyseq_t *keyseq, useconds_t delay) {
+  return _xdo_keyseq_send_windows_do(xdo, windows, nwindows, keyseq, True, False, delay);
+}
+
+/* Add by Lee Pumphret 2007-07-28
+ * Modified slightly by Jordan Sissel */
 int xdo_get_focused_window(const xdo_t *xdo, Window *window_ret) {
   int ret = 0;
   int unused_revert_ret;
@@ -1234,110 +3173,1199 @@ int xdo_find_window_client(const xdo_t *xdo, Window window, Window *window_ret,
       done = True;
     }
   }
-  return XDO_SUCCESS;
+  return XDO_SUCCESS;
+}
+
+/* Helper functions */
+static KeySym _xdo_keysym_from_char(const xdo_t *xdo, wchar_t key) {
+  int i = _xdo_charcode_index_by_char(xdo, key);
+
+  if (i >= 0) {
+    _xdo_debug(xdo, "Found symbol %s for key '%lc'",
+               _xdo_keysym_name(xdo->charcodes[i].symbol), key);
+    return xdo->charcodes[i].symbol;
+  }
+
+  if (key >= 0x100) key += 0x01000000;
+  if (XKeysymToString(key)) return key;
+  return NoSymbol;
+}
+
+static void _xdo_charcodemap_from_char(const xdo_t *xdo, charcodemap_t *key) {
+  KeySym keysym = _xdo_keysym_from_char(xdo, key->key);
+  _xdo_charcodemap_from_keysym(xdo, key, keysym);
+}
+
+static void _xdo_charcodemap_from_keysym(const xdo_t *xdo, charcodemap_t *key, KeySym keysym) {
+  int i = _xdo_charcode_index_by_keysym(xdo, keysym);
+
+  key->code = 0;
+  key->symbol = keysym;
+  key->group = 0;
+  key->modmask = 0;
+  key->needs_binding = 1;
+
+  if (i >= 0) {
+    key->code = xdo->charcodes[i].code;
+    key->group = xdo->charcodes[i].group;
+    key->modmask = xdo->charcodes[i].modmask;
+    key->needs_binding = 0;
+  }
+}
+
+/* The charcode indexes are open-addressed hash tables of offsets into
+ * xdo->charcodes, with -1 marking an empty slot. Only the first charcode
+ * for a given character or keysym is indexed, which keeps the same
+ * tie-breaking as a linear walk of the charcode map. */
+static unsigned int _xdo_charcode_hash(unsigned long value) {
+  value ^= value >> 16;
+  value *= 0x45d9f3bUL;
+  value ^= value >> 16;
+  return (unsigned int)value;
+}
+
+static void _xdo_index_charcode_map(xdo_t *xdo) {
+  int i = 0;
+  int size = 16;
+  unsigned int mask;
+
+  /* Keep the load factor at or below 1/2 so probe chains stay short */
+  while (size < xdo->charcodes_len * 2) {
+    size <<= 1;
+  }
+  mask = size - 1;
+
+  free(xdo->charcodes_by_char);
+  free(xdo->charcodes_by_keysym);
+  xdo->charcodes_by_char = malloc(size * sizeof(int));
+  xdo->charcodes_by_keysym = malloc(size * sizeof(int));
+  xdo->charcodes_index_size = size;
+  memset(xdo->charcodes_by_char, -1, size * sizeof(int));
+  memset(xdo->charcodes_by_keysym, -1, size * sizeof(int));
+
+  for (i = 0; i < xdo->charcodes_len; i++) {
+    unsigned int slot;
+    int cur;
+
+    slot = _xdo_charcode_hash(xdo->charcodes[i].key) & mask;
+    while ((cur = xdo->charcodes_by_char[slot]) != -1
+           && xdo->charcodes[cur].key != xdo->charcodes[i].key) {
+      slot = (slot + 1) & mask;
+    }
+    if (cur == -1) {
+      xdo->charcodes_by_char[slot] = i;
+    }
+
+    slot = _xdo_charcode_hash(xdo->charcodes[i].symbol) & mask;
+    while ((cur = xdo->charcodes_by_keysym[slot]) != -1
+           && xdo->charcodes[cur].symbol != xdo->charcodes[i].symbol) {
+      slot = (slot + 1) & mask;
+    }
+    if (cur == -1) {
+      xdo->charcodes_by_keysym[slot] = i;
+    }
+  }
+}
+
+static int _xdo_charcode_index_by_char(const xdo_t *xdo, wchar_t key) {
+  unsigned int mask;
+  unsigned int slot;
+  int cur;
+
+  xdo_ensure_keymap(xdo);
+  mask = xdo->charcodes_index_size - 1;
+  if (xdo->charcodes_by_char == NULL) {
+    return -1;
+  }
+
+  slot = _xdo_charcode_hash(key) & mask;
+  while ((cur = xdo->charcodes_by_char[slot]) != -1) {
+    if (xdo->charcodes[cur].key == key) {
+      return cur;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+static int _xdo_charcode_index_by_keysym(const xdo_t *xdo, KeySym keysym) {
+  unsigned int mask;
+  unsigned int slot;
+  int cur;
+
+  xdo_ensure_keymap(xdo);
+  mask = xdo->charcodes_index_size - 1;
+  if (xdo->charcodes_by_keysym == NULL) {
+    return -1;
+  }
+
+  slot = _xdo_charcode_hash(keysym) & mask;
+  while ((cur = xdo->charcodes_by_keysym[slot]) != -1) {
+    if (xdo->charcodes[cur].symbol == keysym) {
+      return cur;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+static int _xdo_has_xtest(const xdo_t *xdo) {
+  int dummy;
+  return (XTestQueryExtension(xdo->xdpy, &dummy, &dummy, &dummy, &dummy) == True);
+}
+
+static void _xdo_populate_charcode_map(xdo_t *xdo) {
+  /* assert xdo->display is valid */
+  int keycodes_length = 0;
+  int keycode;
+
+  int use_cache = (getenv("XDO_KEYMAP_CACHE") != NULL);
+  uint64_t fingerprint = 0;
+
+  /* Ask to hear about changes before reading the keymap, so none are missed */
+  _xdo_select_keymap_events(xdo);
+
+  XDisplayKeycodes(xdo->xdpy, &(xdo->keycode_low), &(xdo->keycode_high));
+  XModifierKeymap *modmap = XGetModifierMapping(xdo->xdpy);
+  KeySym *keysyms = XGetKeyboardMapping(xdo->xdpy, xdo->keycode_low,
+                                        xdo->keycode_high - xdo->keycode_low + 1,
+                                        &xdo->keysyms_per_keycode);
+
+  /* Building the map below needs the whole XKB keymap. If we've built it
+   * for this exact keymap before, load that instead. */
+  if (use_cache) {
+    fingerprint = _xdo_keymap_fingerprint(xdo, modmap, keysyms);
+    if (_xdo_keymap_cache_load(xdo, fingerprint)) {
+      XFree(keysyms);
+      XFreeModifiermap(modmap);
+      _xdo_index_charcode_map(xdo);
+      return;
+    }
+  }
+  XFree(keysyms);
+
+  XkbDescPtr desc = XkbGetMap(xdo->xdpy, XkbAllClientInfoMask, XkbUseCoreKbd);
+  if (desc == NULL) {
+    _xdo_eprintf(xdo, False, "Failed to get the XKB keyboard map.");
+    XFreeModifiermap(modmap);
+    return;
+  }
+
+  for (keycode = xdo->keycode_low; keycode <= xdo->keycode_high; keycode++) {
+    keycodes_length += XkbKeyNumSyms(desc, keycode);
+  }
+
+  xdo->charcodes = calloc(keycodes_length + 1, sizeof(charcodemap_t));
+  xdo->charcodes_len = _xdo_charcodes_for_keycodes(desc, modmap, xdo->keycode_low,
+                                                   xdo->keycode_high, xdo->charcodes);
+  xdo->xkb_desc = desc;
+  XFreeModifiermap(modmap);
+
+  if (use_cache) {
+    _xdo_keymap_cache_store(xdo, fingerprint);
+  }
+
+  _xdo_index_charcode_map(xdo);
+}
+
+/* Fill 'out' with the charcodes of keycodes first..last, in keycode order,
+ * and return how many there were. 'out' must have room for
+ * XkbKeyNumSyms() entries per keycode. This only looks at 'desc' and
+ * 'modmap' and does not talk to the X server. */
+static int _xdo_charcodes_for_keycodes(XkbDescPtr desc, XModifierKeymap *modmap,
+                                       int first, int last, charcodemap_t *out) {
+  int idx = 0;
+  int keycode, group, groups, level, modmask, num_map;
+
+  for (keycode = first; keycode <= last; keycode++) {
+    groups = XkbKeyNumGroups(desc, keycode);
+    for (group = 0; group < groups; group++) {
+      XkbKeyTypePtr key_type = XkbKeyKeyType(desc, keycode, group);
+      for (level = 0; level < key_type->num_levels; level++) {
+        KeySym keysym = XkbKeySymEntry(desc, keycode, level, group);
+        modmask = 0;
+
+        for (num_map = 0; num_map < key_type->map_count; num_map++) {
+          XkbKTMapEntryRec map = key_type->map[num_map];
+          if (map.active && map.level == level) {
+            modmask = map.mods.mask;
+            break;
+          }
+        }
+
+        memset(&out[idx], 0, sizeof(out[idx]));
+        out[idx].key = _keysym_to_char(keysym);
+        out[idx].code = keycode;
+        out[idx].group = group;
+        out[idx].modmask = modmask | _xdo_query_keycode_to_modifier(modmap, keycode);
+        out[idx].symbol = keysym;
+
+        idx++;
+      }
+    }
+  }
+  return idx;
+}
+
+/* Bring the charcodes of the keycodes marked dirty up to date, leaving the
+ * rest of the map alone. Returns False if the whole map must be rebuilt. */
+static int _xdo_refresh_charcode_map(xdo_t *xdo) {
+  XkbDescPtr desc = xdo->xkb_desc;
+  int first = xdo->keymap_dirty_first;
+  int last = xdo->keymap_dirty_last;
+  XModifierKeymap *modmap;
+  charcodemap_t *charcodes;
+  int before, after, len, i, keycode, added = 0;
+
+  xdo->keymap_dirty_last = xdo->keymap_dirty_first - 1;
+  if (desc == NULL || first < desc->min_key_code || last > desc->max_key_code) {
+    return False;
+  }
+
+  if (XkbGetKeySyms(xdo->xdpy, first, last - first + 1, desc) != Success) {
+    return False;
+  }
+  modmap = XGetModifierMapping(xdo->xdpy);
+
+  for (keycode = first; keycode <= last; keycode++) {
+    added += XkbKeyNumSyms(desc, keycode);
+  }
+
+  /* The map is in keycode order: keep what comes before and after the
+   * range, and regenerate the range itself. */
+  for (before = 0; before < xdo->charcodes_len && xdo->charcodes[before].code < first; before++);
+  for (after = before; after < xdo->charcodes_len && xdo->charcodes[after].code <= last; after++);
+
+  charcodes = calloc(before + added + (xdo->charcodes_len - after) + 1, sizeof(charcodemap_t));
+  memcpy(charcodes, xdo->charcodes, before * sizeof(charcodemap_t));
+  len = before + _xdo_charcodes_for_keycodes(desc, modmap, first, last, charcodes + before);
+  for (i = after; i < xdo->charcodes_len; i++) {
+    charcodes[len++] = xdo->charcodes[i];
+  }
+  XFreeModifiermap(modmap);
+
+  _xdo_debug(xdo, "Refreshed charcodes for keycodes %d-%d", first, last);
+  free(xdo->charcodes);
+  xdo->charcodes = charcodes;
+  xdo->charcodes_len = len;
+  _xdo_index_charcode_map(xdo);
+  return True;
+}
+
+/* On-disk cache of the charcode map, enabled with XDO_KEYMAP_CACHE.
+ *
+ * Files live in $XDG_CACHE_HOME/xdotool (or ~/.cache/xdotool) and are
+ * named after a fingerprint of the keymap: the XKB rules and names, the
+ * keycode range, the core keyboard mapping and the modifier mapping. All
+ * of these are cheap to fetch compared to the XKB keymap that building
+ * the charcode map needs. A file holds a header followed by the
+ * charcodemap_t array as it is in memory, so it is only valid for the same
+ * build of libxdo on the same architecture; the header checks for that. */
+
+#define KEYMAP_CACHE_MAGIC "xdokmap1"
+
+typedef struct keymap_cache_header {
+  char magic[8];
+  uint32_t entry_size;
+  uint32_t count;
+  uint64_t fingerprint;
+  int32_t keycode_low;
+  int32_t keycode_high;
+  int32_t keysyms_per_keycode;
+  int32_t reserved;
+} keymap_cache_header_t;
+
+/* 64-bit FNV-1a */
+static uint64_t _xdo_fnv1a(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static uint64_t _xdo_keymap_fingerprint(const xdo_t *xdo, XModifierKeymap *modmap,
+                                        const KeySym *keysyms) {
+  uint64_t hash = 14695981039346656037ULL;
+  int nkeysyms = (xdo->keycode_high - xdo->keycode_low + 1) * xdo->keysyms_per_keycode;
+  Atom rules_atom = XInternAtom(xdo->xdpy, "_XKB_RULES_NAMES", True);
+
+  if (rules_atom != None) {
+    Atom type;
+    int format;
+    unsigned long nitems, bytes_after;
+    unsigned char *rules = NULL;
+
+    if (XGetWindowProperty(xdo->xdpy, DefaultRootWindow(xdo->xdpy), rules_atom,
+                           0, 1024, False, AnyPropertyType, &type, &format,
+                           &nitems, &bytes_after, &rules) == Success && rules != NULL) {
+      hash = _xdo_fnv1a(hash, rules, nitems * (format / 8));
+      XFree(rules);
+    }
+  }
+
+  hash = _xdo_fnv1a(hash, &xdo->keycode_low, sizeof(xdo->keycode_low));
+  hash = _xdo_fnv1a(hash, &xdo->keycode_high, sizeof(xdo->keycode_high));
+  hash = _xdo_fnv1a(hash, &xdo->keysyms_per_keycode, sizeof(xdo->keysyms_per_keycode));
+  hash = _xdo_fnv1a(hash, keysyms, nkeysyms * sizeof(KeySym));
+  hash = _xdo_fnv1a(hash, modmap->modifiermap, 8 * modmap->max_keypermod);
+  return hash;
+}
+
+/* Returns False if there is nowhere to put the cache */
+static int _xdo_keymap_cache_path(char *path, size_t size, uint64_t fingerprint) {
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int len;
+
+  if (cache_home != NULL && *cache_home != '\0') {
+    len = snprintf(path, size, "%s/xdotool", cache_home);
+  } else if (home != NULL && *home != '\0') {
+    len = snprintf(path, size, "%s/.cache/xdotool", home);
+  } else {
+    return False;
+  }
+
+  if (fingerprint != 0) {
+    len += snprintf(path + len, size - len, "/keymap-%016llx",
+                    (unsigned long long)fingerprint);
+  }
+  return len > 0 && (size_t)len < size;
+}
+
+static int _xdo_keymap_cache_load(xdo_t *xdo, uint64_t fingerprint) {
+  char path[4096];
+  struct stat st;
+  const keymap_cache_header_t *header;
+  void *map;
+  int fd;
+  int ok = False;
+
+  if (!_xdo_keymap_cache_path(path, sizeof(path), fingerprint)) {
+    return False;
+  }
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return False;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(keymap_cache_header_t)) {
+    close(fd);
+    return False;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return False;
+  }
+
+  header = map;
+  if (memcmp(header->magic, KEYMAP_CACHE_MAGIC, sizeof(header->magic)) == 0
+      && header->entry_size == sizeof(charcodemap_t)
+      && header->fingerprint == fingerprint
+      && header->keycode_low == xdo->keycode_low
+      && header->keycode_high == xdo->keycode_high
+      && header->keysyms_per_keycode == xdo->keysyms_per_keycode
+      && (size_t)st.st_size == sizeof(*header) + header->count * sizeof(charcodemap_t)) {
+    xdo->charcodes = calloc(header->count + 1, sizeof(charcodemap_t));
+    memcpy(xdo->charcodes, (const char *)map + sizeof(*header),
+           header->count * sizeof(charcodemap_t));
+    xdo->charcodes_len = header->count;
+    ok = True;
+    _xdo_debug(xdo, "Loaded %d charcodes from keymap cache %s",
+               xdo->charcodes_len, path);
+  } else {
+    _xdo_debug(xdo, "Ignoring invalid keymap cache %s", path);
+  }
+
+  munmap(map, st.st_size);
+  return ok;
+}
+
+/* Write the cache to a temporary file and rename it into place, so that
+ * other processes never see a partial file. Failures are not fatal. */
+static void _xdo_keymap_cache_store(const xdo_t *xdo, uint64_t fingerprint) {
+  char dir[4096], path[4096], tmppath[4200];
+  keymap_cache_header_t header;
+  char *slash;
+  FILE *fp;
+  int fd, ok;
+
+  if (!_xdo_keymap_cache_path(dir, sizeof(dir), 0)
+      || !_xdo_keymap_cache_path(path, sizeof(path), fingerprint)) {
+    return;
+  }
+
+  /* Create the parent (~/.cache) too, if needed */
+  slash = strrchr(dir, '/');
+  if (slash != NULL && slash != dir) {
+    *slash = '\0';
+    mkdir(dir, 0700);
+    *slash = '/';
+  }
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    _xdo_debug(xdo, "Can't create keymap cache directory %s: %s", dir, strerror(errno));
+    return;
+  }
+
+  snprintf(tmppath, sizeof(tmppath), "%s.%ld.tmp", path, (long)getpid());
+  fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+    _xdo_debug(xdo, "Can't write keymap cache %s: %s", tmppath, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, KEYMAP_CACHE_MAGIC, sizeof(header.magic));
+  header.entry_size = sizeof(charcodemap_t);
+  header.count = xdo->charcodes_len;
+  header.fingerprint = fingerprint;
+  header.keycode_low = xdo->keycode_low;
+  header.keycode_high = xdo->keycode_high;
+  header.keysyms_per_keycode = xdo->keysyms_per_keycode;
+
+  ok = fwrite(&header, sizeof(header), 1, fp) == 1
+       && fwrite(xdo->charcodes, sizeof(charcodemap_t), xdo->charcodes_len, fp)
+          == (size_t)xdo->charcodes_len;
+  if (fclose(fp) != 0 || !ok || rename(tmppath, path) != 0) {
+    _xdo_debug(xdo, "Failed writing keymap cache %s", path);
+    unlink(tmppath);
+    return;
+  }
+  _xdo_debug(xdo, "Wrote %d charcodes to keymap cache %s", xdo->charcodes_len, path);
+}
+
+/* Most of libxdo takes 'const xdo_t *', but a few caches in xdo_t are
+ * filled in on first use. Every xdo_t comes from
+ * xdo_new_with_opened_display, so it is never actually const. */
+static xdo_t *_xdo_mutable(const xdo_t *xdo) {
+  return (xdo_t *)xdo;
+}
+
+/* Does a keymap row of 'per' keysyms hold 'keysym' the way we bind scratch
+ * keycodes? We only set column 0, but an XKB server reads that back with
+ * group 1 repeated into the other groups and case pairs filled in, so
+ * column 0 is all that tells. An empty row has to be empty throughout. */
+static int _xdo_scratch_row_holds(const KeySym *syms, int per, KeySym keysym) {
+  int j;
+
+  if (keysym != NoSymbol) {
+    return per > 0 && syms[0] == keysym;
+  }
+  for (j = 0; j < per; j++) {
+    if (syms[j] != NoSymbol) {
+      return False;
+    }
+  }
+  return True;
+}
+
+/* Does a keymap change of 'count' keycodes starting at 'first' come from
+ * someone other than us? Another client may bind a free keycode too, so a
+ * change to scratch keycodes only counts as ours if the server now has
+ * what we put there; checking that takes one round trip, but only when
+ * the change is to scratch keycodes at all. */
+static int _xdo_keymap_change_is_foreign(const xdo_t *xdo, int first, int count) {
+  int *slots = malloc(count * sizeof(int));
+  int keycode, i, keysyms_per_keycode;
+  int foreign = False;
+  KeySym *keysyms;
+
+  for (keycode = first; keycode < first + count; keycode++) {
+    slots[keycode - first] = -1;
+    for (i = 0; i < xdo->scratch_keycodes_len; i++) {
+      if (xdo->scratch_keycodes[i] == keycode) {
+        slots[keycode - first] = i;
+        break;
+      }
+    }
+    if (slots[keycode - first] < 0) {
+      free(slots);
+      return True;
+    }
+  }
+
+  keysyms = XGetKeyboardMapping(xdo->xdpy, first, count, &keysyms_per_keycode);
+  for (i = 0; i < count && !foreign && keysyms != NULL; i++) {
+    foreign = !_xdo_scratch_row_holds(keysyms + i * keysyms_per_keycode,
+                                      keysyms_per_keycode,
+                                      xdo->scratch_keysyms[slots[i]]);
+  }
+  if (keysyms == NULL) {
+    foreign = True;
+  } else {
+    XFree(keysyms);
+  }
+  free(slots);
+  return foreign;
+}
+
+static Bool _xdo_is_keymap_event(Display *dpy, XEvent *event, XPointer arg) {
+  const xdo_t *xdo = (const xdo_t *)arg;
+  (void)dpy;
+
+  if (event->type == MappingNotify) {
+    return event->xmapping.request == MappingKeyboard
+           || event->xmapping.request == MappingModifier;
+  }
+  if (xdo->xkb_event_type != 0 && event->type == xdo->xkb_event_type) {
+    int xkb_type = ((XkbAnyEvent *)event)->xkb_type;
+    return xkb_type == XkbMapNotify || xkb_type == XkbNewKeyboardNotify;
+  }
+  return False;
+}
+
+/* Ask the server to tell us about keymap changes. MappingNotify is always
+ * sent; the XKB events carry more detail. */
+static void _xdo_select_keymap_events(const xdo_t *xdo) {
+  int opcode, event_base, error_base, major = XkbMajorVersion, minor = XkbMinorVersion;
+  unsigned int mask = XkbMapNotifyMask | XkbNewKeyboardNotifyMask;
+
+  if (xdo->xkb_event_type != 0) {
+    return;
+  }
+  if (XkbQueryExtension(xdo->xdpy, &opcode, &event_base, &error_base, &major, &minor)) {
+    _xdo_mutable(xdo)->xkb_event_type = event_base;
+    XkbSelectEvents(xdo->xdpy, XkbUseCoreKbd, mask, mask);
+  }
+}
+
+/* Record that 'count' keycodes starting at 'first', or the whole keymap if
+ * 'all' is set, have changed. Nothing is fetched until the map is next
+ * needed. Changes to our own scratch keycodes are ignored. */
+static void _xdo_note_keymap_change(const xdo_t *xdo, int first, int count, int all) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+  int last = first + count - 1;
+
+  if (!all && !_xdo_keymap_change_is_foreign(xdo, first, count)) {
+    return;
+  }
+
+  mxdo->scratch_keycodes_valid = False;
+  if (all) {
+    _xdo_debug(xdo, "Keymap changed, dropping keymap and scratch keycodes");
+    mxdo->charcodes_valid = False;
+    if (xdo->modmap != NULL) {
+      XFreeModifiermap(xdo->modmap);
+      mxdo->modmap = NULL;
+    }
+    return;
+  }
+
+  _xdo_debug(xdo, "Keymap changed (keycodes %d-%d)", first, last);
+  if (xdo->keymap_dirty_last < xdo->keymap_dirty_first) {
+    mxdo->keymap_dirty_first = first;
+    mxdo->keymap_dirty_last = last;
+  } else {
+    if (first < xdo->keymap_dirty_first) {
+      mxdo->keymap_dirty_first = first;
+    }
+    if (last > xdo->keymap_dirty_last) {
+      mxdo->keymap_dirty_last = last;
+    }
+  }
+}
+
+/* Consume any keymap change notifications we have received and note
+ * what they make stale. They are removed from the queue even when the
+ * Display belongs to the caller (see xdo_new_with_opened_display); Xlib
+ * has no non-blocking way to peek at them in place. This does not block, but it reads the socket and
+ * scans the event queue, so lookups only come here once per library call
+ * (see keymap_checked). */
+static void _xdo_check_keymap_events(const xdo_t *xdo) {
+  XEvent event;
+
+  _xdo_mutable(xdo)->keymap_checked = True;
+
+  /* XCheckIfEvent flushes the output buffer when nothing matches, which
+   * would undo batching; only look when there is something to look at.
+   * QueuedAfterReading also picks up a MappingNotify still sitting in the
+   * socket without flushing, which QueuedAlready would miss. */
+  if (XEventsQueued(xdo->xdpy, QueuedAfterReading) == 0) {
+    return;
+  }
+
+  while (XCheckIfEvent(xdo->xdpy, &event, _xdo_is_keymap_event, (XPointer)xdo)) {
+    if (event.type == MappingNotify) {
+      XRefreshKeyboardMapping(&event.xmapping);
+      if (event.xmapping.request == MappingModifier) {
+        /* Modifiers go into every charcode's modmask */
+        _xdo_note_keymap_change(xdo, 0, 0, True);
+      } else {
+        _xdo_note_keymap_change(xdo, event.xmapping.first_keycode,
+                                event.xmapping.count, False);
+      }
+    } else if (((XkbAnyEvent *)&event)->xkb_type == XkbNewKeyboardNotify) {
+      _xdo_note_keymap_change(xdo, 0, 0, True);
+    } else {
+      XkbMapNotifyEvent *map = (XkbMapNotifyEvent *)&event;
+      if ((map->changed & XkbModifierMapMask)
+          || ((map->changed & XkbKeyTypesMask) && map->num_types > 0)) {
+        _xdo_note_keymap_change(xdo, 0, 0, True);
+      } else if (map->changed & XkbKeySymsMask) {
+        _xdo_note_keymap_change(xdo, map->first_key_sym, map->num_key_syms, False);
+      }
+    }
+  }
+}
+
+/* Find the unused keycodes we can bind keysyms that are not in the keymap
+ * to. The set is looked up once and then kept until the server tells us
+ * the keymap has changed. Keycodes we have bound ourselves stay in the
+ * pool across a rescan. Returns the number of scratch keycodes. */
+static int _xdo_scratch_pool(const xdo_t *xdo) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+  KeySym *keysyms = NULL;
+  int keysyms_per_keycode = 0;
+  int keycode_count = xdo->keycode_high - xdo->keycode_low + 1;
+  KeyCode *old_keycodes = xdo->scratch_keycodes;
+  KeySym *old_keysyms = xdo->scratch_keysyms;
+  unsigned long *old_last_used = xdo->scratch_last_used;
+  int old_len = xdo->scratch_keycodes_len;
+  int keycode, old = 0;
+
+  _xdo_select_keymap_events(xdo);
+  _xdo_check_keymap_events(xdo);
+  if (xdo->scratch_keycodes_valid) {
+    return xdo->scratch_keycodes_len;
+  }
+
+  keysyms = XGetKeyboardMapping(xdo->xdpy, xdo->keycode_low, keycode_count,
+                                &keysyms_per_keycode);
+
+  mxdo->scratch_keycodes = calloc(keycode_count, sizeof(KeyCode));
+  mxdo->scratch_keysyms = calloc(keycode_count, sizeof(KeySym));
+  mxdo->scratch_last_used = calloc(keycode_count, sizeof(unsigned long));
+  mxdo->scratch_keycodes_len = 0;
+  for (keycode = xdo->keycode_low; keycode <= xdo->keycode_high; keycode++) {
+    KeySym *syms = keysyms + (keycode - xdo->keycode_low) * keysyms_per_keycode;
+    KeySym ours = NoSymbol;
+
+    /* Both lists are sorted by keycode */
+    while (old < old_len && old_keycodes[old] < keycode) {
+      old++;
+    }
+    if (old < old_len && old_keycodes[old] == keycode) {
+      ours = old_keysyms[old];
+    }
+
+    if (_xdo_scratch_row_holds(syms, keysyms_per_keycode, ours)) {
+      int n = mxdo->scratch_keycodes_len++;
+      mxdo->scratch_keycodes[n] = keycode;
+      mxdo->scratch_keysyms[n] = ours;
+      mxdo->scratch_last_used[n] = (ours != NoSymbol) ? old_last_used[old] : 0;
+    }
+  }
+  XFree(keysyms);
+  free(old_keycodes);
+  free(old_keysyms);
+  free(old_last_used);
+  mxdo->scratch_keycodes_valid = True;
+
+  _xdo_debug(xdo, "Found %d unused keycodes", xdo->scratch_keycodes_len);
+  return xdo->scratch_keycodes_len;
+}
+
+/* Send the keysyms of the scratch keycodes marked in 'dirty' to the server,
+ * with one XChangeKeyboardMapping per run of consecutive keycodes. */
+static void _xdo_store_scratch_keysyms(const xdo_t *xdo, const char *dirty) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+  int start, end;
+
+  for (start = 0; start < xdo->scratch_keycodes_len; start = end) {
+    end = start + 1;
+    if (!dirty[start]) {
+      continue;
+    }
+    while (end < xdo->scratch_keycodes_len && dirty[end]
+           && xdo->scratch_keycodes[end] == xdo->scratch_keycodes[end - 1] + 1) {
+      end++;
+    }
+    _xdo_debug(xdo, "Changing keymap for keycodes %d-%d",
+               xdo->scratch_keycodes[start], xdo->scratch_keycodes[end - 1]);
+    XChangeKeyboardMapping(xdo->xdpy, xdo->scratch_keycodes[start], 1,
+                           xdo->scratch_keysyms + start, end - start);
+    mxdo->keymap_changes++;
+  }
+}
+
+/* Order in which scratch keycodes are given up: empty ones first, then
+ * from least to most recently used. */
+static unsigned long _xdo_scratch_age(const xdo_t *xdo, int slot) {
+  if (xdo->scratch_keysyms[slot] == NoSymbol) {
+    return 0;
+  }
+  return xdo->scratch_last_used[slot] + 1;
+}
+
+/* Point every key in 'keys' that needs binding at a scratch keycode with
+ * its keysym. Keysyms that are still bound from earlier calls are reused;
+ * otherwise a free scratch keycode is taken, or the least recently used
+ * one that this call does not need. Keys that cannot be bound are left
+ * with a code of 0. */
+static void _xdo_bind_scratch_keysyms(const xdo_t *xdo, charcodemap_t *keys, int nkeys) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+  unsigned long now;
+  char *dirty = NULL;
+  int changed = 0;
+  int i, slot, len;
+
+  for (i = 0; i < nkeys; i++) {
+    if (keys[i].needs_binding == 1) {
+      break;
+    }
+  }
+  if (i == nkeys) {
+    /* Nothing to bind; don't bother the server */
+    return;
+  }
+
+  len = _xdo_scratch_pool(xdo);
+  now = ++mxdo->scratch_clock;
+  dirty = calloc(len + 1, sizeof(char));
+
+  for (i = 0; i < nkeys; i++) {
+    int victim = -1;
+
+    if (keys[i].needs_binding != 1) {
+      continue;
+    }
+
+    for (slot = 0; slot < len; slot++) {
+      if (xdo->scratch_keysyms[slot] == keys[i].symbol) {
+        break;
+      }
+      /* Prefer an empty keycode, then the least recently used one. Never
+       * take one that an earlier key in this call is using. */
+      if (xdo->scratch_last_used[slot] == now) {
+        continue;
+      }
+      if (victim < 0 || _xdo_scratch_age(xdo, slot) < _xdo_scratch_age(xdo, victim)) {
+        victim = slot;
+      }
+    }
+
+    if (slot == len) {
+      if (victim < 0) {
+        fprintf(stderr, "No unused keycode to bind keysym %lu to, skipping.\n",
+                keys[i].symbol);
+        keys[i].code = 0;
+        continue;
+      }
+      slot = victim;
+      _xdo_debug(xdo, "Mapping sym %s to %d", _xdo_keysym_name(keys[i].symbol),
+                 xdo->scratch_keycodes[slot]);
+      mxdo->scratch_keysyms[slot] = keys[i].symbol;
+      dirty[slot] = 1;
+      changed = 1;
+    }
+
+    mxdo->scratch_last_used[slot] = now;
+    keys[i].code = xdo->scratch_keycodes[slot];
+  }
+
+  if (changed) {
+    _xdo_store_scratch_keysyms(xdo, dirty);
+    /* Make sure the new mapping is in place before any key uses it */
+    XSync(xdo->xdpy, False);
+  }
+  free(dirty);
+}
+
+#if (defined(__SSE2__) || defined(__AVX2__)) && WCHAR_MAX > 0xffff
+#define XDO_SIMD_ASCII
+#endif
+
+/* Widen the run of ASCII at the start of 's' into 'out' and return its
+ * length. Most text is mostly ASCII, so this is where decoding spends its
+ * time; with SSE2 or AVX2 it checks and widens 16 or 32 bytes at once. */
+static size_t _xdo_ascii_run(const unsigned char *s, size_t len, wchar_t *out) {
+  size_t i = 0;
+
+#if defined(XDO_SIMD_ASCII) && defined(__AVX2__)
+  for (; i + 32 <= len; i += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)(s + i));
+    int k;
+    if (_mm256_movemask_epi8(bytes) != 0) {
+      break;
+    }
+    for (k = 0; k < 32; k += 8) {
+      __m128i eight = _mm_loadl_epi64((const __m128i *)(s + i + k));
+      _mm256_storeu_si256((__m256i *)(out + i + k), _mm256_cvtepu8_epi32(eight));
+    }
+  }
+#endif
+#if defined(XDO_SIMD_ASCII)
+  for (; i + 16 <= len; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo, hi;
+    if (_mm_movemask_epi8(bytes) != 0) {
+      break;
+    }
+    lo = _mm_unpacklo_epi8(bytes, zero);
+    hi = _mm_unpackhi_epi8(bytes, zero);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128((__m128i *)(out + i + 12), _mm_unpackhi_epi16(hi, zero));
+  }
+#endif
+
+  for (; i < len && s[i] < 0x80; i++) {
+    out[i] = s[i];
+  }
+  return i;
+}
+
+/* Decode UTF-8 text into a newly allocated array of characters, in one
+ * pass and whatever the locale. Decoding stops at the first invalid
+ * sequence (overlong, surrogate, out of range or cut off), which sets
+ * *invalid_ret; what came before it is still returned. */
+static wchar_t *_xdo_utf8_decode(const char *string, size_t *nchars_ret,
+                                 int *invalid_ret) {
+  const unsigned char *s = (const unsigned char *)string;
+  size_t len = strlen(string);
+  size_t i = 0, n = 0;
+  wchar_t *chars = malloc((len + 1) * sizeof(wchar_t));
+
+  *invalid_ret = False;
+  while (i < len) {
+    size_t run = _xdo_ascii_run(s + i, len - i, chars + n);
+    unsigned long c, min;
+    size_t need, k;
+
+    i += run;
+    n += run;
+    if (i == len) {
+      break;
+    }
+
+    c = s[i];
+    if (c >= 0xc2 && c <= 0xdf) {
+      need = 1;
+      c &= 0x1f;
+      min = 0x80;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      need = 2;
+      c &= 0x0f;
+      min = 0x800;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      need = 3;
+      c &= 0x07;
+      min = 0x10000;
+    } else {
+      *invalid_ret = True;
+      break;
+    }
+
+    for (k = 1; k <= need; k++) {
+      if (i + k >= len || (s[i + k] & 0xc0) != 0x80) {
+        break;
+      }
+      c = (c << 6) | (s[i + k] & 0x3f);
+    }
+    if (k <= need || c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+      *invalid_ret = True;
+      break;
+    }
+
+    chars[n++] = c;
+    i += need + 1;
+  }
+  *nchars_ret = n;
+  return chars;
 }
 
-/* Helper functions */
-static KeySym _xdo_keysym_from_char(const xdo_t *xdo, wchar_t key) {
-  int i = 0;
-  int len = xdo->charcodes_len;
+/* The character is printed as UTF-8 so this works whatever the locale */
+static void _xdo_report_unknown_char(wchar_t c) {
+  char utf8[5];
+  unsigned long u = c;
+
+  if (u < 0x80) {
+    utf8[0] = u;
+    utf8[1] = '\0';
+  } else if (u < 0x800) {
+    utf8[0] = 0xc0 | (u >> 6);
+    utf8[1] = 0x80 | (u & 0x3f);
+    utf8[2] = '\0';
+  } else if (u < 0x10000) {
+    utf8[0] = 0xe0 | (u >> 12);
+    utf8[1] = 0x80 | ((u >> 6) & 0x3f);
+    utf8[2] = 0x80 | (u & 0x3f);
+    utf8[3] = '\0';
+  } else {
+    utf8[0] = 0xf0 | (u >> 18);
+    utf8[1] = 0x80 | ((u >> 12) & 0x3f);
+    utf8[2] = 0x80 | ((u >> 6) & 0x3f);
+    utf8[3] = 0x80 | (u & 0x3f);
+    utf8[4] = '\0';
+  }
+  fprintf(stderr, "I don't what key produces '%s', skipping.\n", utf8);
+}
 
-  printf("Finding symbol for key '%lc' (keys %d)\n", key, len);
-  for (i = 0; i < len; i++) {
-    //printf("  => %c vs %c (%d)\n",
-           //key, xdo->charcodes[i].key, (xdo->charcodes[i].key == key));
-    if (xdo->charcodes[i].key == key) {
-      printf("  => MATCH to symbol: %lu\n", xdo->charcodes[i].symbol);
-      return xdo->charcodes[i].symbol;
+/* One Compose or dead key sequence that produces a single character */
+typedef struct compose_entry {
+  wchar_t key;
+  int len;
+  KeySym keysyms[COMPOSE_MAX_SEQUENCE];
+} compose_entry_t;
+
+/* The sequences of the locale's compose table, by character */
+struct xdo_compose {
+  compose_entry_t *entries; /* sorted by character, then shortest first */
+  size_t nentries;
+};
+
+static int _xdo_compose_entry_cmp(const void *a, const void *b) {
+  const compose_entry_t *x = a, *y = b;
+  if (x->key != y->key) {
+    return (x->key < y->key) ? -1 : 1;
+  }
+  return x->len - y->len;
+}
+
+#ifdef HAVE_XKB_COMPOSE_ITERATOR
+static struct xkb_compose_table *_xdo_compose_table_new(struct xkb_context *ctx) {
+  struct xkb_compose_table *table = NULL;
+  const char *locale = getenv("LC_ALL");
+
+  /* The order libxkbcommon's documentation recommends */
+  if (locale == NULL || *locale == '\0') {
+    locale = getenv("LC_CTYPE");
+  }
+  if (locale == NULL || *locale == '\0') {
+    locale = getenv("LANG");
+  }
+  if (locale != NULL && *locale != '\0') {
+    table = xkb_compose_table_new_from_locale(ctx, locale, XKB_COMPOSE_COMPILE_NO_FLAGS);
+  }
+  if (table == NULL) {
+    table = xkb_compose_table_new_from_locale(ctx, "en_US.UTF-8", XKB_COMPOSE_COMPILE_NO_FLAGS);
+  }
+  return table;
+}
+#endif /* HAVE_XKB_COMPOSE_ITERATOR */
+
+/* Read the compose table into xdo->compose. Without libxkbcommon's table
+ * iterator, or without a compose table, it stays empty and characters
+ * missing from the keymap are always bound to scratch keycodes. */
+static void _xdo_load_compose(xdo_t *xdo) {
+  struct xdo_compose *compose = calloc(1, sizeof(struct xdo_compose));
+#ifdef HAVE_XKB_COMPOSE_ITERATOR
+  struct xkb_context *ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+  struct xkb_compose_table *table = (ctx != NULL) ? _xdo_compose_table_new(ctx) : NULL;
+  struct xkb_compose_table_iterator *iter;
+  struct xkb_compose_table_entry *entry;
+  size_t size = 0;
+
+  if (table != NULL) {
+    iter = xkb_compose_table_iterator_new(table);
+    while ((entry = xkb_compose_table_iterator_next(iter)) != NULL) {
+      const xkb_keysym_t *sequence;
+      size_t len, i;
+      wchar_t key = 0;
+
+      if (xkb_compose_table_entry_keysym(entry) != NoSymbol) {
+        key = _keysym_to_char(xkb_compose_table_entry_keysym(entry));
+      } else {
+        /* No keysym: use the text if it is a single character */
+        const char *utf8 = xkb_compose_table_entry_utf8(entry);
+        size_t nchars;
+        int invalid;
+        wchar_t *chars = _xdo_utf8_decode(utf8 ? utf8 : "", &nchars, &invalid);
+        if (nchars == 1 && !invalid) {
+          key = chars[0];
+        }
+        free(chars);
+      }
+
+      sequence = xkb_compose_table_entry_sequence(entry, &len);
+      if (key == 0 || len > COMPOSE_MAX_SEQUENCE) {
+        continue;
+      }
+
+      if (compose->nentries == size) {
+        size = size ? size * 2 : 1024;
+        compose->entries = realloc(compose->entries, size * sizeof(compose_entry_t));
+      }
+      compose->entries[compose->nentries].key = key;
+      compose->entries[compose->nentries].len = len;
+      for (i = 0; i < len; i++) {
+        compose->entries[compose->nentries].keysyms[i] = sequence[i];
+      }
+      compose->nentries++;
     }
+    xkb_compose_table_iterator_free(iter);
+    xkb_compose_table_unref(table);
+    qsort(compose->entries, compose->nentries, sizeof(compose_entry_t),
+          _xdo_compose_entry_cmp);
   }
+  if (ctx != NULL) {
+    xkb_context_unref(ctx);
+  }
+  _xdo_debug(xdo, "Loaded %lu compose sequences", (unsigned long)compose->nentries);
+#endif /* HAVE_XKB_COMPOSE_ITERATOR */
 
-  if (key >= 0x100) key += 0x01000000;
-  if (XKeysymToString(key)) return key;
-  return NoSymbol;
+  xdo->compose = compose;
 }
 
-static void _xdo_charcodemap_from_char(const xdo_t *xdo, charcodemap_t *key) {
-  KeySym keysym = _xdo_keysym_from_char(xdo, key->key);
-  _xdo_charcodemap_from_keysym(xdo, key, keysym);
+static void _xdo_free_compose(xdo_t *xdo) {
+  if (xdo->compose != NULL) {
+    free(xdo->compose->entries);
+    free(xdo->compose);
+    xdo->compose = NULL;
+  }
 }
 
-static void _xdo_charcodemap_from_keysym(const xdo_t *xdo, charcodemap_t *key, KeySym keysym) {
-  int i = 0;
-  int len = xdo->charcodes_len;
+/* Find the shortest sequence for 'c' whose keysyms are all in the keymap,
+ * so it can be typed without changing the keymap. */
+static int _xdo_compose_lookup(const xdo_t *xdo, wchar_t c, charcodemap_t *keys,
+                               int *nkeys_ret) {
+  const struct xdo_compose *compose;
+  size_t lo = 0, hi, i;
+  int k;
 
-  key->code = 0;
-  key->symbol = keysym;
-  key->group = 0;
-  key->modmask = 0;
-  key->needs_binding = 1;
+  if (xdo->compose == NULL) {
+    _xdo_load_compose(_xdo_mutable(xdo));
+  }
+  compose = xdo->compose;
+
+  /* Find the first entry for 'c' */
+  hi = compose->nentries;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (compose->entries[mid].key < c) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
 
-  for (i = 0; i < len; i++) {
-    if (xdo->charcodes[i].symbol == keysym) {
-      key->code = xdo->charcodes[i].code;
-      key->group = xdo->charcodes[i].group;
-      key->modmask = xdo->charcodes[i].modmask;
-      key->needs_binding = 0;
-      return;
+  for (i = lo; i < compose->nentries && compose->entries[i].key == c; i++) {
+    const compose_entry_t *entry = compose->entries + i;
+    for (k = 0; k < entry->len; k++) {
+      _xdo_charcodemap_from_keysym(xdo, &keys[k], entry->keysyms[k]);
+      keys[k].key = 0;
+      if (keys[k].needs_binding == 1) {
+        break;
+      }
+    }
+    if (k == entry->len) {
+      *nkeys_ret = entry->len;
+      return True;
     }
   }
+  return False;
 }
 
-static int _xdo_has_xtest(const xdo_t *xdo) {
-  int dummy;
-  return (XTestQueryExtension(xdo->xdpy, &dummy, &dummy, &dummy, &dummy) == True);
-}
+/* Type a character that is not in the keymap with a Compose or dead key
+ * sequence, if there is one the keymap can type. This avoids binding a
+ * scratch keycode, and the keymap change every client has to process.
+ * Compose is handled by the input method of whoever has focus, so this is
+ * only done for input sent with XTest, and only if xdo->use_compose says
+ * the target can be trusted to do it. */
+static int _xdo_type_composed(const xdo_t *xdo, Window window, wchar_t c,
+                              useconds_t delay) {
+  charcodemap_t keys[COMPOSE_MAX_SEQUENCE];
+  int nkeys, i;
+
+  if (!xdo->use_compose || !_xdo_input_use_xtest(xdo, window)
+      || !_xdo_compose_lookup(xdo, c, keys, &nkeys)) {
+    return False;
+  }
+  _xdo_debug(xdo, "Typing U+%04lX with a %d key compose sequence",
+             (unsigned long)c, nkeys);
 
-static void _xdo_populate_charcode_map(xdo_t *xdo) {
-  /* assert xdo->display is valid */
-  int keycodes_length = 0;
-  int idx = 0;
-  int keycode, group, groups, level, modmask, num_map;
+  for (i = 0; i < nkeys; i++) {
+    _xdo_send_keysequence_window_list_do(xdo, window, &keys[i], 1, True, NULL, delay / 2);
+    _xdo_send_keysequence_window_list_do(xdo, window, &keys[i], 1, False, NULL, delay / 2);
+  }
+  return True;
+}
 
-  XDisplayKeycodes(xdo->xdpy, &(xdo->keycode_low), &(xdo->keycode_high));
-  XModifierKeymap *modmap = XGetModifierMapping(xdo->xdpy);
-  KeySym *keysyms = XGetKeyboardMapping(xdo->xdpy, xdo->keycode_low,
-                                        xdo->keycode_high - xdo->keycode_low + 1,
-                                        &xdo->keysyms_per_keycode);
-  XFree(keysyms);
+/* Bind 'key' and the keysyms of the characters after it in 'rest' that
+ * are not in the keymap, as many as fit in the scratch keycodes, so that a
+ * run of such characters costs one keymap change instead of one each.
+ * Keysyms that are already bound count too, so they are not given up. */
+static void _xdo_prebind_text(const xdo_t *xdo, const charcodemap_t *key,
+                              const wchar_t *rest, size_t nrest) {
+  charcodemap_t *pending = NULL;
+  charcodemap_t next;
+  int npending = 0;
+  size_t n;
+  int len, i;
+
+  for (i = 0; i < xdo->scratch_keycodes_len; i++) {
+    if (xdo->scratch_keysyms[i] == key->symbol) {
+      /* Already bound, nothing to do until we reach an unbound one */
+      return;
+    }
+  }
 
-  /* Add 2 to the size because the range [low, high] is inclusive */
-  /* Add 2 more for tab (\t) and newline (\n) */
-  keycodes_length = ((xdo->keycode_high - xdo->keycode_low) + 1)
-                     * xdo->keysyms_per_keycode;
+  len = _xdo_scratch_pool(xdo);
+  if (len == 0) {
+    return;
+  }
 
-  xdo->charcodes = calloc(keycodes_length, sizeof(charcodemap_t));
-  XkbDescPtr desc = XkbGetMap(xdo->xdpy, XkbAllClientInfoMask, XkbUseCoreKbd);
+  pending = calloc(len, sizeof(charcodemap_t));
+  pending[npending++] = *key;
+  for (n = 0; npending < len && n < nrest; n++) {
+    next.key = rest[n];
+    _xdo_charcodemap_from_char(xdo, &next);
+    if (next.needs_binding != 1) {
+      continue;
+    }
+    for (i = 0; i < npending; i++) {
+      if (pending[i].symbol == next.symbol) {
+        break;
+      }
+    }
+    if (i == npending) {
+      pending[npending++] = next;
+    }
+  }
 
-  for (keycode = xdo->keycode_low; keycode <= xdo->keycode_high; keycode++) {
-    groups = XkbKeyNumGroups(desc, keycode);
-    for (group = 0; group < groups; group++) {
-      XkbKeyTypePtr key_type = XkbKeyKeyType(desc, keycode, group);
-      for (level = 0; level < key_type->num_levels; level++) {
-        KeySym keysym = XkbKeycodeToKeysym(xdo->xdpy, keycode, group, level);
-        modmask = 0;
+  _xdo_bind_scratch_keysyms(xdo, pending, npending);
+  free(pending);
+}
 
-        for (num_map = 0; num_map < key_type->map_count; num_map++) {
-          XkbKTMapEntryRec map = key_type->map[num_map];
-          if (map.active && map.level == level) {
-            modmask = map.mods.mask;
-            break;
-          }
-        }
+/* Put the original (empty) mapping back on every scratch keycode we bound.
+ * This is done once at the end of a whole operation, not after every key,
+ * since each keymap change is broadcast to all clients. */
+static void _xdo_release_scratch_keycodes(const xdo_t *xdo) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+  char *dirty = NULL;
+  int slot, changed = 0;
 
-        xdo->charcodes[idx].key = _keysym_to_char(keysym);
-        xdo->charcodes[idx].code = keycode;
-        xdo->charcodes[idx].group = group;
-        xdo->charcodes[idx].modmask = modmask | _xdo_query_keycode_to_modifier(modmap, keycode);
-        xdo->charcodes[idx].symbol = keysym;
+  if (xdo->scratch_keycodes_len == 0) {
+    return;
+  }
 
-        idx++;
-      }
+  _xdo_check_keymap_events(xdo);
+  dirty = calloc(xdo->scratch_keycodes_len, sizeof(char));
+  for (slot = 0; slot < xdo->scratch_keycodes_len; slot++) {
+    if (xdo->scratch_keysyms[slot] != NoSymbol) {
+      mxdo->scratch_keysyms[slot] = NoSymbol;
+      dirty[slot] = 1;
+      changed = 1;
     }
   }
-  xdo->charcodes_len = idx;
-  XkbFreeClientMap(desc, 0, 1);
-  XFreeModifiermap(modmap);
+
+  if (changed) {
+    _xdo_store_scratch_keysyms(xdo, dirty);
+    XFlush(xdo->xdpy);
+    _xdo_debug(xdo, "Reverted scratch keycodes, %d keymap changes so far",
+               xdo->keymap_changes);
+  }
+  free(dirty);
 }
 
 /* context-free functions */
@@ -1345,12 +4373,78 @@ wchar_t _keysym_to_char(KeySym keysym) {
   return (wchar_t)xkb_keysym_to_utf32(keysym);
 }
 
+/* Index of the first keysym_names entry whose name matches 'name' in any
+ * case, or -1. Aliases from symbol_map are in the table too. */
+static int _xdo_keysym_name_index(const char *name, int *exact) {
+  unsigned int hash = keysym_name_hash(name);
+  unsigned int seed, slot;
+
+  seed = keysym_name_displacements[keysym_name_seed(hash, 0) % KEYSYM_NAME_BUCKETS];
+  slot = keysym_name_slots[keysym_name_seed(hash, seed) % KEYSYM_NAME_SLOTS];
+  if (slot == KEYSYM_NAME_EMPTY) {
+    return -1;
+  }
+  *exact = (strcmp(keysym_names[slot].name, name) == 0);
+  if (!*exact && strcasecmp(keysym_names[slot].name, name) != 0) {
+    return -1;
+  }
+  return slot;
+}
+
+/* Resolve a key name like XStringToKeysym, but through the generated table
+ * and ignoring case when there is no exact match. */
+static KeySym _xdo_keysym_from_name(const char *name) {
+  int exact = 0;
+  int first = _xdo_keysym_name_index(name, &exact);
+  int i;
+  KeySym sym;
+
+  if (exact) {
+    return keysym_names[first].keysym;
+  }
+
+  /* Names differing only in case are adjacent; 'a' and 'A' are different
+   * keys, so prefer an exact match. */
+  for (i = first + 1; first >= 0 && i < KEYSYM_NAMES_LEN
+                      && strcasecmp(keysym_names[i].name, name) == 0; i++) {
+    if (strcmp(keysym_names[i].name, name) == 0) {
+      return keysym_names[i].keysym;
+    }
+  }
+
+  /* Unicode (U20AC), numeric (0x1008ff14) and vendor keysym names */
+  sym = XStringToKeysym(name);
+  if (sym != NoSymbol || first < 0) {
+    return sym;
+  }
+  return keysym_names[first].keysym;
+}
+
+static int _xdo_keysym_value_cmp(const void *key, const void *member) {
+  KeySym keysym = *(const KeySym *)key;
+  KeySym other = keysym_names[*(const unsigned short *)member].keysym;
+  return (keysym > other) - (keysym < other);
+}
+
+/* The name of a keysym, for messages */
+static const char *_xdo_keysym_name(KeySym keysym) {
+  const unsigned short *found;
+  const char *name;
+
+  found = bsearch(&keysym, keysym_values, KEYSYM_VALUES_LEN,
+                  sizeof(keysym_values[0]), _xdo_keysym_value_cmp);
+  if (found != NULL) {
+    return keysym_names[*found].name;
+  }
+  name = XKeysymToString(keysym);
+  return name ? name : "NoSymbol";
+}
+
 int _xdo_send_keysequence_window_to_keycode_list(const xdo_t *xdo, const char *keyseq,
                                      charcodemap_t **keys, int *nkeys) {
   char *tokctx = NULL;
   const char *tok = NULL;
   char *keyseq_copy = NULL, *strptr = NULL;
-  int i = 0;
 
   /* Array of keys to press, in order given by keyseq */
   int keys_size = 10;
@@ -1370,13 +4464,8 @@ int _xdo_send_keysequence_window_to_keycode_list(const xdo_t *xdo, const char *k
     if (strptr != NULL)
       strptr = NULL;
 
-    /* Check if 'tok' (string keysym) is an alias to another key */
-    /* symbol_map comes from xdo.util */
-    for (i = 0; symbol_map[i] != NULL; i+=2)
-      if (!strcasecmp(tok, symbol_map[i]))
-        tok = symbol_map[i + 1];
-
-    sym = XStringToKeysym(tok);
+    /* Aliases from symbol_map in xdo_util.h are part of the table */
+    sym = _xdo_keysym_from_name(tok);
     if (sym == NoSymbol) {
       /* Accept a number as a explicit keycode */
       if (isdigit(tok[0])) {
@@ -1401,7 +4490,7 @@ int _xdo_send_keysequence_window_to_keycode_list(const xdo_t *xdo, const char *k
     (*nkeys)++;
     if (*nkeys == keys_size) {
       keys_size *= 2;
-      *keys = realloc(*keys, keys_size * sizeof(KeyCode));
+      *keys = realloc(*keys, keys_size * sizeof(charcodemap_t));
     }
   }
 
@@ -1514,29 +4603,37 @@ void _xdo_send_key(const xdo_t *xdo, Window window, charcodemap_t *key,
   /* Properly ensure the modstate is set by finding a key
    * that activates each bit in the modifier state */
   int mask = modstate | key->modmask;
-  int use_xtest = 0;
+  int use_xtest = _xdo_input_use_xtest(xdo, window);
 
-  if (window == CURRENTWINDOW) {
-    use_xtest = 1;
-  } else {
-    Window focuswin = 0;
-    xdo_get_focused_window(xdo, &focuswin);
-    if (focuswin == window) {
-      use_xtest = 1;
-    }
-  }
   if (use_xtest) {
-    printf("XTEST: Sending key %d %s\n", key->code, is_press ? "down" : "up");
-    XkbStateRec state;
-    XkbGetState(xdo->xdpy, XkbUseCoreKbd, &state);
-    int current_group = state.group;
-    XkbLockGroup(xdo->xdpy, XkbUseCoreKbd, key->group);
-    if (mask)
-      _xdo_send_modifier(xdo, mask, is_press);
+    xdo_t *mxdo = _xdo_mutable(xdo);
+    /* A modifier key sent on its own already sets its modifier; pressing
+     * it again through the modifier map would only add events. */
+    int own = _xdo_query_keycode_to_modifier(_xdo_modmap(xdo), key->code);
+    mask &= ~own & ~xdo->xtest_explicit_mods;
+
+    _xdo_debug(xdo, "XTEST: Sending key %d %s", key->code, is_press ? "down" : "up");
+    if (is_press) {
+      /* Only the modifiers and group that differ from the previous key
+       * are changed; _xdo_xtest_restore_state undoes the rest once the
+       * whole sequence has been sent. */
+      _xdo_xtest_set_state(xdo, mask, key->group);
+      mxdo->xtest_explicit_mods |= own;
+    } else {
+      if (!xdo->xtest_active) {
+        /* Releasing keys pressed by someone else, such as an earlier
+         * 'keydown': assume their modifiers are still held so that
+         * restoring the state lets go of them afterwards. */
+        _xdo_xtest_set_state(xdo, 0, key->group);
+        mxdo->xtest_mods = mask;
+      }
+      mxdo->xtest_explicit_mods &= ~own;
+    }
     //printf("XTEST: Sending key %d %s %x %d\n", key->code, is_press ? "down" : "up", key->modmask, key->group);
-    XTestFakeKeyEvent(xdo->xdpy, key->code, is_press, CurrentTime);
-    XkbLockGroup(xdo->xdpy, XkbUseCoreKbd, current_group);
-    XSync(xdo->xdpy, False);
+    XTestFakeKeyEvent(xdo->xdpy, key->code, is_press, _xdo_xtest_delay(xdo));
+    if (!xdo->server_delay) {
+      XSync(xdo->xdpy, False);
+    }
   } else {
     /* Since key events have 'state' (shift, etc) in the event, we don't
      * need to worry about key press ordering. */
@@ -1549,6 +4646,15 @@ void _xdo_send_key(const xdo_t *xdo, Window window, charcodemap_t *key,
     XSendEvent(xdo->xdpy, xk.window, True, KeyPressMask, (XEvent *)&xk);
   }
 
+  xdo_delay_input(xdo, use_xtest ? CURRENTWINDOW : window, delay);
+}
+
+void xdo_delay_input(const xdo_t *xdo, Window window, useconds_t delay) {
+  if (xdo->server_delay && window == CURRENTWINDOW) {
+    _xdo_mutable(xdo)->xtest_delay_pending += delay;
+    return;
+  }
+
   /* Skipping the usleep if delay is 0 is much faster than calling usleep(0) */
   XFlush(xdo->xdpy);
   if (delay > 0) {
@@ -1556,6 +4662,17 @@ void _xdo_send_key(const xdo_t *xdo, Window window, charcodemap_t *key,
   }
 }
 
+/* The delay to give the next XTest event, in milliseconds. Anything short
+ * of a whole millisecond is kept for the event after, so the total comes
+ * out right even for sub-millisecond delays. */
+static unsigned long _xdo_xtest_delay(const xdo_t *xdo) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+  unsigned long ms = xdo->xtest_delay_pending / 1000;
+
+  mxdo->xtest_delay_pending %= 1000;
+  return ms;
+}
+
 int _xdo_query_keycode_to_modifier(XModifierKeymap *modmap, KeyCode keycode) {
   int i = 0, j = 0;
   int max = modmap->max_keypermod;
@@ -1581,24 +4698,198 @@ int _xdo_query_keycode_to_modifier(XModifierKeymap *modmap, KeyCode keycode) {
   return 0;
 }
 
-void _xdo_send_modifier(const xdo_t *xdo, int modmask, int is_press) {
-  XModifierKeymap *modifiers = XGetModifierMapping(xdo->xdpy);
+/* Press and release modifier keys to go from one modifier mask to
+ * another, without syncing. Used when a whole string is sent at once. */
+void _xdo_send_modifier_transition(const xdo_t *xdo, XModifierKeymap *modmap,
+                                   int from_mask, int to_mask) {
   int mod_index, mod_key, keycode;
 
   for (mod_index = ShiftMapIndex; mod_index <= Mod5MapIndex; mod_index++) {
-    if (modmask & (1 << mod_index)) {
-      for (mod_key = 0; mod_key < modifiers->max_keypermod; mod_key++) {
-        keycode = modifiers->modifiermap[mod_index * modifiers->max_keypermod + mod_key];
-        if (keycode) {
-          XTestFakeKeyEvent(xdo->xdpy, keycode, is_press, CurrentTime);
-          XSync(xdo->xdpy, False);
-          break;
-        }
+    int bit = (1 << mod_index);
+    int is_press;
+
+    if ((from_mask & bit) == (to_mask & bit)) {
+      continue;
+    }
+    is_press = (to_mask & bit) != 0;
+
+    for (mod_key = 0; mod_key < modmap->max_keypermod; mod_key++) {
+      keycode = modmap->modifiermap[mod_index * modmap->max_keypermod + mod_key];
+      if (keycode) {
+        XTestFakeKeyEvent(xdo->xdpy, keycode, is_press, _xdo_xtest_delay(xdo));
+        break;
       }
     }
   }
+}
+
+static XModifierKeymap *_xdo_modmap(const xdo_t *xdo) {
+  if (xdo->modmap == NULL) {
+    _xdo_mutable(xdo)->modmap = XGetModifierMapping(xdo->xdpy);
+  }
+  return xdo->modmap;
+}
+
+/* Move the injected modifiers and the locked group to what the next key
+ * needs, sending only the transitions that are actually required. The
+ * first call after the state was restored records the group to go back
+ * to. */
+static void _xdo_xtest_set_state(const xdo_t *xdo, int modmask, int group) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+
+  if (!xdo->xtest_active) {
+    XkbStateRec state;
+    XkbGetState(xdo->xdpy, XkbUseCoreKbd, &state);
+    mxdo->xtest_orig_group = mxdo->xtest_group = state.group;
+    mxdo->xtest_mods = 0;
+    mxdo->xtest_active = True;
+  }
+
+  if (group != xdo->xtest_group) {
+    XkbLockGroup(xdo->xdpy, XkbUseCoreKbd, group);
+    mxdo->xtest_group = group;
+  }
+  if (modmask != xdo->xtest_mods) {
+    _xdo_send_modifier_transition(xdo, _xdo_modmap(xdo), xdo->xtest_mods, modmask);
+    mxdo->xtest_mods = modmask;
+  }
+}
+
+/* Put back the group that was locked before we started sending keys and,
+ * if 'release_mods' is set, let go of the modifiers we pressed. Keys left
+ * down on purpose keep their modifiers until a later release. */
+static void _xdo_xtest_restore_state(const xdo_t *xdo, int release_mods) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+
+  if (!xdo->xtest_active) {
+    return;
+  }
+
+  if (xdo->xtest_group != xdo->xtest_orig_group) {
+    XkbLockGroup(xdo->xdpy, XkbUseCoreKbd, xdo->xtest_orig_group);
+    mxdo->xtest_group = xdo->xtest_orig_group;
+  }
+  if (release_mods) {
+    _xdo_send_modifier_transition(xdo, _xdo_modmap(xdo), xdo->xtest_mods, 0);
+    mxdo->xtest_mods = 0;
+    mxdo->xtest_active = False;
+  }
+  XFlush(xdo->xdpy);
+}
+
+/* Switch between XTest and XSendEvent input. Modifiers and a group set
+ * with XTest would stay in effect for whatever has focus, so they are put
+ * back when input moves away from XTest. */
+static void _xdo_set_input_use_xtest(const xdo_t *xdo, int use_xtest) {
+  if (!use_xtest) {
+    _xdo_xtest_restore_state(xdo, True);
+  }
+  _xdo_mutable(xdo)->input_use_xtest = use_xtest;
+}
+
+static Bool _xdo_is_focus_event(Display *dpy, XEvent *event, XPointer arg) {
+  const xdo_t *xdo = (const xdo_t *)arg;
+  (void)dpy;
+
+  return (event->type == FocusIn || event->type == FocusOut)
+    && event->xfocus.window == xdo->input_window;
+}
+
+/* Apply the focus changes we have been told about to input_use_xtest.
+ * Only changes of the focus to or from the window itself count, as that
+ * is what xdo_get_focused_window compares against. */
+static void _xdo_check_focus_events(const xdo_t *xdo) {
+  XEvent event;
+
+  if (XEventsQueued(xdo->xdpy, QueuedAlready) == 0) {
+    return;
+  }
+
+  while (XCheckIfEvent(xdo->xdpy, &event, _xdo_is_focus_event, (XPointer)xdo)) {
+    int detail = event.xfocus.detail;
+    if (event.xfocus.mode == NotifyGrab || event.xfocus.mode == NotifyUngrab) {
+      continue;
+    }
+    if (detail == NotifyAncestor || detail == NotifyInferior
+        || detail == NotifyNonlinear) {
+      _xdo_set_input_use_xtest(xdo, event.type == FocusIn);
+      _xdo_debug(xdo, "Window %ld %s focus, sending keys with %s",
+                 xdo->input_window, event.type == FocusIn ? "got" : "lost",
+                 xdo->input_use_xtest ? "XTest" : "XSendEvent");
+    }
+  }
+}
+
+/* Should keys for 'window' be sent with XTest rather than XSendEvent?
+ * XTest input goes to whatever has focus, so it is only used when the
+ * window has focus. This is worked out on the first key of an operation
+ * and kept until _xdo_end_key_operation, which every library call that
+ * sends keys ends with. */
+static int _xdo_input_use_xtest(const xdo_t *xdo, Window window) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+  Window focuswin = 0;
+
+  if (window == CURRENTWINDOW) {
+    return True;
+  }
+  switch (xdo->input_method) {
+    case XDO_INPUT_XTEST: return True;
+    case XDO_INPUT_SENDEVENT: return False;
+  }
+
+  if (xdo->input_resolved && xdo->input_window == window) {
+    if (xdo->input_focus_selected) {
+      _xdo_check_focus_events(xdo);
+    }
+    return xdo->input_use_xtest;
+  }
+
+  _xdo_forget_input_window(xdo);
+  mxdo->input_window = window;
+  if (xdo->input_track_focus) {
+    XWindowAttributes attr;
+    /* Ask for focus changes before looking at the focus, so none are
+     * missed in between */
+    if (XGetWindowAttributes(xdo->xdpy, window, &attr)) {
+      mxdo->input_saved_mask = attr.your_event_mask;
+      XSelectInput(xdo->xdpy, window, attr.your_event_mask | FocusChangeMask);
+      mxdo->input_focus_selected = True;
+    }
+  }
+  xdo_get_focused_window(xdo, &focuswin);
+  _xdo_set_input_use_xtest(xdo, focuswin == window);
+  mxdo->input_resolved = True;
+  return xdo->input_use_xtest;
+}
+
+/* Long texts take long enough to type that the focus may move while
+ * they are; follow it instead of sending the rest to the wrong place. */
+static void _xdo_track_input_focus(const xdo_t *xdo, const char *string) {
+  if (strlen(string) >= TRACK_FOCUS_MIN_LENGTH) {
+    _xdo_mutable(xdo)->input_track_focus = True;
+  }
+}
+
+static void _xdo_forget_input_window(const xdo_t *xdo) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+  XEvent event;
+
+  if (xdo->input_focus_selected) {
+    XSelectInput(xdo->xdpy, xdo->input_window, xdo->input_saved_mask);
+    while (XEventsQueued(xdo->xdpy, QueuedAlready) > 0
+           && XCheckIfEvent(xdo->xdpy, &event, _xdo_is_focus_event, (XPointer)xdo));
+    mxdo->input_focus_selected = False;
+  }
+  mxdo->input_resolved = False;
+}
 
-  XFreeModifiermap(modifiers);
+/* Called once a key operation has sent all its keys */
+static void _xdo_end_key_operation(const xdo_t *xdo, int release_mods) {
+  _xdo_xtest_restore_state(xdo, release_mods);
+  _xdo_forget_input_window(xdo);
+  _xdo_mutable(xdo)->input_track_focus = False;
+  /* The next call looks for keymap changes again */
+  _xdo_mutable(xdo)->keymap_checked = False;
 }
 
 int xdo_get_active_modifiers(const xdo_t *xdo, charcodemap_t **keys,
@@ -1610,12 +4901,17 @@ int xdo_get_active_modifiers(const xdo_t *xdo, charcodemap_t **keys,
   int keys_size = 10;
   int keycode = 0;
   int mod_index, mod_key;
-  XModifierKeymap *modifiers = XGetModifierMapping(xdo->xdpy);
+  XModifierKeymap *modifiers;
   *nkeys = 0;
   *keys = malloc(keys_size * sizeof(charcodemap_t));
 
   XQueryKeymap(xdo->xdpy, keymap);
 
+  /* The round trip brought in any modifier mapping change, so the cached
+   * modifier map is current after this */
+  _xdo_check_keymap_events(xdo);
+  modifiers = _xdo_modmap(xdo);
+
   for (mod_index = ShiftMapIndex; mod_index <= Mod5MapIndex; mod_index++) {
     for (mod_key = 0; mod_key < modifiers->max_keypermod; mod_key++) {
       keycode = modifiers->modifiermap[mod_index * modifiers->max_keypermod + mod_key];
@@ -1634,14 +4930,12 @@ int xdo_get_active_modifiers(const xdo_t *xdo, charcodemap_t **keys,
 
         if (*nkeys == keys_size) {
           keys_size *= 2;
-          *keys = realloc(keys, keys_size * sizeof(charcodemap_t));
+          *keys = realloc(*keys, keys_size * sizeof(charcodemap_t));
         }
       }
     }
   } 
 
-  XFreeModifiermap(modifiers);
-
   return XDO_SUCCESS;
 }
 
@@ -1653,6 +4947,11 @@ unsigned int xdo_get_input_state(const xdo_t *xdo) {
 
   XQueryPointer(xdo->xdpy, root, &dummy, &dummy,
                 &root_x, &root_y, &win_x, &win_y, &mask);
+  if (xdo->pointer != NULL) {
+    xdo->pointer->buttons_valid = True;
+    xdo->pointer->buttons = mask & (Button1Mask | Button2Mask | Button3Mask
+                                    | Button4Mask | Button5Mask);
+  }
 
   return mask;
 }
@@ -1661,11 +4960,30 @@ const char **xdo_get_symbol_map(void) {
   return symbol_map;
 }
 
+/* Caps_Lock is toggled on every clear/set of the active modifiers, so
+ * only resolve it once per keymap; setxkbmap can move it. */
+static xdo_keyseq_t *_xdo_caps_lock_keyseq(const xdo_t *xdo) {
+  xdo_t *mxdo = _xdo_mutable(xdo);
+  unsigned long generation = xdo_get_keymap_generation(xdo);
+
+  if (xdo->caps_lock_keyseq != NULL
+      && xdo->caps_lock_keyseq_generation != generation) {
+    xdo_keyseq_free(xdo->caps_lock_keyseq);
+    mxdo->caps_lock_keyseq = NULL;
+  }
+  if (xdo->caps_lock_keyseq == NULL) {
+    mxdo->caps_lock_keyseq = xdo_keyseq_compile(xdo, "Caps_Lock");
+    mxdo->caps_lock_keyseq_generation = generation;
+  }
+  return xdo->caps_lock_keyseq;
+}
+
 int xdo_clear_active_modifiers(const xdo_t *xdo, Window window, charcodemap_t *active_mods, int active_mods_n) {
   int ret = 0;
   unsigned int input_state = xdo_get_input_state(xdo);
-  xdo_send_keysequence_window_list_do(xdo, window, active_mods,
+  _xdo_send_keysequence_window_list_do(xdo, window, active_mods,
                           active_mods_n, False, NULL, DEFAULT_DELAY);
+  _xdo_end_key_operation(xdo, True);
 
   if (input_state & Button1MotionMask)
     ret = xdo_mouse_up(xdo, window, 1);
@@ -1681,8 +4999,9 @@ int xdo_clear_active_modifiers(const xdo_t *xdo, Window window, charcodemap_t *a
     /* explicitly use down+up here since xdo_send_keysequence_window alone will track the modifiers
      * incurred by a key (like shift, or caps) and send them on the 'up' sequence.
      * That seems to break things with Caps_Lock only, so let's be explicit here. */
-    ret = xdo_send_keysequence_window_down(xdo, window, "Caps_Lock", DEFAULT_DELAY);
-    ret += xdo_send_keysequence_window_up(xdo, window, "Caps_Lock", DEFAULT_DELAY);
+    xdo_keyseq_t *caps_lock = _xdo_caps_lock_keyseq(xdo);
+    ret = xdo_keyseq_send_window_down(xdo, window, caps_lock, DEFAULT_DELAY);
+    ret += xdo_keyseq_send_window_up(xdo, window, caps_lock, DEFAULT_DELAY);
   }
 
   XSync(xdo->xdpy, False);
@@ -1692,8 +5011,9 @@ int xdo_clear_active_modifiers(const xdo_t *xdo, Window window, charcodemap_t *a
 int xdo_set_active_modifiers(const xdo_t *xdo, Window window, charcodemap_t *active_mods, int active_mods_n) {
   int ret = 0;
   unsigned int input_state = xdo_get_input_state(xdo);
-  xdo_send_keysequence_window_list_do(xdo, window, active_mods,
+  _xdo_send_keysequence_window_list_do(xdo, window, active_mods,
                           active_mods_n, True, NULL, DEFAULT_DELAY);
+  _xdo_end_key_operation(xdo, True);
   if (input_state & Button1MotionMask)
     ret = xdo_mouse_down(xdo, window, 1);
   if (!ret && input_state & Button2MotionMask)
@@ -1708,14 +5028,97 @@ int xdo_set_active_modifiers(const xdo_t *xdo, Window window, charcodemap_t *act
     /* explicitly use down+up here since xdo_send_keysequence_window alone will track the modifiers
      * incurred by a key (like shift, or caps) and send them on the 'up' sequence.
      * That seems to break things with Caps_Lock only, so let's be explicit here. */
-    ret = xdo_send_keysequence_window_down(xdo, window, "Caps_Lock", DEFAULT_DELAY);
-    ret += xdo_send_keysequence_window_up(xdo, window, "Caps_Lock", DEFAULT_DELAY);
+    xdo_keyseq_t *caps_lock = _xdo_caps_lock_keyseq(xdo);
+    ret = xdo_keyseq_send_window_down(xdo, window, caps_lock, DEFAULT_DELAY);
+    ret += xdo_keyseq_send_window_up(xdo, window, caps_lock, DEFAULT_DELAY);
   }
 
   XSync(xdo->xdpy, False);
   return ret;
 }
 
+struct xdo_modifiers {
+  charcodemap_t *keys; /* held modifier keys */
+  int nkeys;
+  unsigned int buttons; /* Button1Mask to Button5Mask */
+  int caps_lock;
+  int cleared; /* whether xdo_modifiers_clear let go of them */
+};
+
+xdo_modifiers_t *xdo_modifiers_save(const xdo_t *xdo) {
+  xdo_modifiers_t *mods = calloc(1, sizeof(xdo_modifiers_t));
+  XkbStateRec state;
+
+  /* One request has the buttons, the lock state and which modifiers are
+   * held; only when some are does it take a look at the keys. */
+  if (XkbGetState(xdo->xdpy, XkbUseCoreKbd, &state) != Success) {
+    xdo_get_active_modifiers(xdo, &mods->keys, &mods->nkeys);
+    mods->buttons = xdo_get_input_state(xdo);
+  } else {
+    if (state.base_mods != 0) {
+      xdo_get_active_modifiers(xdo, &mods->keys, &mods->nkeys);
+    }
+    mods->buttons = state.ptr_buttons;
+    mods->caps_lock = (state.locked_mods & LockMask) != 0;
+  }
+  mods->buttons &= Button1Mask | Button2Mask | Button3Mask | Button4Mask | Button5Mask;
+  return mods;
+}
+
+/* Press or release everything in the snapshot as one burst of requests.
+ * They are processed in order with whatever is sent next, so there is no
+ * need to wait for them. */
+static void _xdo_modifiers_send(const xdo_t *xdo, const xdo_modifiers_t *mods,
+                                int is_press) {
+  int i;
+
+  for (i = 0; i < mods->nkeys; i++) {
+    XTestFakeKeyEvent(xdo->xdpy, mods->keys[i].code, is_press, CurrentTime);
+  }
+  for (i = 0; i < 5; i++) {
+    if (mods->buttons & (Button1Mask << i)) {
+      XTestFakeButtonEvent(xdo->xdpy, i + 1, is_press, CurrentTime);
+    }
+  }
+  if (mods->caps_lock) {
+    XkbLockModifiers(xdo->xdpy, XkbUseCoreKbd, LockMask, is_press ? LockMask : 0);
+  }
+  XFlush(xdo->xdpy);
+  if (mods->buttons) {
+    _xdo_pointer_invalidate(xdo);
+  }
+}
+
+int xdo_modifiers_clear(const xdo_t *xdo, Window window, xdo_modifiers_t *mods) {
+  if (!_xdo_has_xtest(xdo)) {
+    return xdo_clear_active_modifiers(xdo, window, mods->keys, mods->nkeys);
+  }
+  if (!mods->cleared) {
+    _xdo_modifiers_send(xdo, mods, False);
+    mods->cleared = True;
+  }
+  return XDO_SUCCESS;
+}
+
+int xdo_modifiers_restore(const xdo_t *xdo, Window window, xdo_modifiers_t *mods) {
+  if (!_xdo_has_xtest(xdo)) {
+    return xdo_set_active_modifiers(xdo, window, mods->keys, mods->nkeys);
+  }
+  if (mods->cleared) {
+    _xdo_modifiers_send(xdo, mods, True);
+    mods->cleared = False;
+  }
+  return XDO_SUCCESS;
+}
+
+void xdo_modifiers_free(xdo_modifiers_t *mods) {
+  if (mods == NULL)
+    return;
+
+  free(mods->keys);
+  free(mods);
+}
+
 int xdo_get_pid_window(const xdo_t *xdo, Window window) {
   Atom type;
   int size;
@@ -1746,7 +5149,7 @@ int xdo_wait_for_mouse_move_from(const xdo_t *xdo, int origin_x, int origin_y) {
   ret = xdo_get_mouse_location(xdo, &x, &y, NULL);
   while (tries > 0 && 
          (x == origin_x && y == origin_y)) {
-    usleep(30000);
+    xdo_wait_for_pointer_event(xdo, 30000);
     ret = xdo_get_mouse_location(xdo, &x, &y, NULL);
     tries--;
   }
@@ -1761,7 +5164,7 @@ int xdo_wait_for_mouse_move_to(const xdo_t *xdo, int dest_x, int dest_y) {
 
   ret = xdo_get_mouse_location(xdo, &x, &y, NULL);
   while (tries > 0 && (x != dest_x && y != dest_y)) {
-    usleep(30000);
+    xdo_wait_for_pointer_event(xdo, 30000);
     ret = xdo_get_mouse_location(xdo, &x, &y, NULL);
     tries--;
   }
@@ -12,6 +12,7 @@
 #include <X11/Xlib.h>
 #include <X11/X.h>
 #include <unistd.h>
+#include <stdio.h>
 #include <wchar.h>
 
 /**
@@ -68,6 +69,29 @@ typedef enum {
   XDO_FEATURE_XTEST, /** Is XTest available? */
 } XDO_FEATURES;
 
+/**
+ * How keyboard input is delivered to a window other than CURRENTWINDOW.
+ * @see xdo_t.input_method
+ */
+typedef enum {
+  XDO_INPUT_AUTO, /** XTest if the window has focus, XSendEvent otherwise */
+  XDO_INPUT_XTEST, /** Always XTest; input goes to the focused window */
+  XDO_INPUT_SENDEVENT, /** Always XSendEvent to the window */
+} XDO_INPUT_METHOD;
+
+/**
+ * A key sequence resolved to keycodes, ready to be sent.
+ * @see xdo_keyseq_compile
+ */
+typedef struct xdo_keyseq xdo_keyseq_t;
+
+/**
+ * The held modifier keys, pressed mouse buttons and caps lock state at
+ * some point in time.
+ * @see xdo_modifiers_save
+ */
+typedef struct xdo_modifiers xdo_modifiers_t;
+
 /**
  * The main context.
  */
@@ -106,6 +130,134 @@ typedef struct xdo {
   /** Feature flags, such as XDO_FEATURE_XTEST, etc... */
   int features_mask;
 
+  /** @internal Hash index from character to offset in charcodes */
+  int *charcodes_by_char;
+
+  /** @internal Hash index from KeySym to offset in charcodes */
+  int *charcodes_by_keysym;
+
+  /** @internal Number of slots in each charcode index (a power of two) */
+  int charcodes_index_size;
+
+  /** @internal Keycodes with no keysyms, usable for temporary bindings */
+  KeyCode *scratch_keycodes;
+
+  /** @internal Length of scratch_keycodes */
+  int scratch_keycodes_len;
+
+  /** @internal Is scratch_keycodes up to date with the server's keymap? */
+  int scratch_keycodes_valid;
+
+  /** @internal KeySym currently bound to each scratch keycode, or NoSymbol */
+  KeySym *scratch_keysyms;
+
+  /** @internal When each scratch keycode was last used, for LRU reuse */
+  unsigned long *scratch_last_used;
+
+  /** @internal Counter for scratch_last_used */
+  unsigned long scratch_clock;
+
+  /** @internal Event type of XKB events, or 0 if not yet queried */
+  int xkb_event_type;
+
+  /** Number of keyboard mapping changes made so far. Each one makes every
+   * client on the display refetch its keymap. */
+  int keymap_changes;
+
+  /** Let the X server carry out delays between XTest input events instead
+   * of sleeping in the client. Timed sequences are then sent without
+   * waiting, and the server replays them at the right pace. Delays are
+   * rounded to milliseconds. Only applies to input sent with XTest, that is
+   * to CURRENTWINDOW or the focused window.
+   * @see xdo_delay_input */
+  int server_delay;
+
+  /** @internal Delay in microseconds to put on the next XTest event */
+  useconds_t xtest_delay_pending;
+
+  /** @internal Compiled "Caps_Lock", used when clearing modifiers */
+  xdo_keyseq_t *caps_lock_keyseq;
+
+  /** @internal Is the charcode map built? It may still have keycodes
+   * waiting to be refreshed, see keymap_dirty_first */
+  int charcodes_valid;
+
+  /** @internal XKB keymap the charcode map was built from, kept so that
+   * changes can be applied to it. NULL if the map came from the cache. */
+  struct _XkbDesc *xkb_desc;
+
+  /** @internal First keycode whose charcodes need refreshing */
+  int keymap_dirty_first;
+
+  /** @internal Last keycode whose charcodes need refreshing, or less than
+   * keymap_dirty_first if none do */
+  int keymap_dirty_last;
+
+  /** @internal Bumped whenever the charcode map changes */
+  unsigned long keymap_generation;
+
+  /** @internal Modifier map used for XTest key injection, fetched on
+   * first use and dropped when the modifier mapping changes */
+  XModifierKeymap *modmap;
+
+  /** @internal True while XTest key injection is tracking the state below */
+  int xtest_active;
+
+  /** @internal Modifiers we have pressed on behalf of the keys sent */
+  int xtest_mods;
+
+  /** @internal Modifiers whose keys were sent explicitly and are still down */
+  int xtest_explicit_mods;
+
+  /** @internal XKB group currently locked for the keys sent */
+  int xtest_group;
+
+  /** @internal XKB group to go back to when injection is done */
+  int xtest_orig_group;
+
+  /** How keys sent to a specific window are delivered, one of
+   * XDO_INPUT_METHOD. With XDO_INPUT_AUTO (the default) the focus is
+   * checked once per operation, which costs a round trip; the other
+   * methods skip the check. */
+  int input_method;
+
+  /** @internal Window the input method was last worked out for */
+  Window input_window;
+
+  /** @internal Is input_use_xtest valid for input_window? */
+  int input_resolved;
+
+  /** @internal Does input_window have focus, so XTest can be used? */
+  int input_use_xtest;
+
+  /** @internal Follow focus changes on input_window while sending */
+  int input_track_focus;
+
+  /** @internal Are we selecting focus events on input_window? */
+  int input_focus_selected;
+
+  /** @internal Our event mask on input_window before we added to it */
+  long input_saved_mask;
+
+  /** @internal Compose and dead key sequences, loaded on first use */
+  struct xdo_compose *compose;
+
+  /** @internal Pointer state kept from XInput 2 raw events, see xdo_track_pointer */
+  struct xdo_pointer_tracker *pointer;
+
+  /** @internal keymap_generation that caps_lock_keyseq was compiled for */
+  unsigned long caps_lock_keyseq_generation;
+
+  /** Type characters missing from the keymap with a Compose or dead key
+   * sequence from the locale's Compose file, when the keymap has the keys
+   * for one, instead of binding a spare keycode. Only used for XTest input,
+   * and only works if the focused client handles Compose. Off unless the
+   * XDO_USE_COMPOSE environment variable is set. */
+  int use_compose;
+
+  /** @internal Keymap events were already looked at during this call */
+  int keymap_checked;
+
 } xdo_t;
 
 
@@ -212,10 +364,40 @@ xdo_t* xdo_new(const char *display);
  * @param display the string display name
  * @param close_display_when_freed If true, we will close the display when
  * xdo_free is called. Otherwise, we leave it open.
+ *
+ * libxdo selects keyboard mapping notifications on this display and takes
+ * MappingNotify and XKB map events off its event queue when they arrive, so
+ * your own XNextEvent loop will not see them. It calls
+ * XRefreshKeyboardMapping for each MappingNotify, so XKeysymToKeycode and
+ * friends stay current; use xdo_get_keymap_generation to learn of changes.
  */
 xdo_t* xdo_new_with_opened_display(Display *xdpy, const char *display,
                                    int close_display_when_freed);
 
+/**
+ * Build the keyboard map (xdo->charcodes and friends) if it is not built
+ * yet, or rebuild it if the keyboard mapping has changed since.
+ *
+ * The keyboard map is not built by xdo_new, only when something first
+ * needs it, since that takes several round trips to the X server. The
+ * keyboard functions in libxdo call this themselves; call it before
+ * reading xdo->charcodes directly.
+ */
+void xdo_ensure_keymap(const xdo_t *xdo);
+
+/**
+ * Get a number that changes whenever libxdo's keyboard map does.
+ *
+ * libxdo follows keyboard mapping changes on its own (such as a layout
+ * switch with setxkbmap, or xmodmap), updating only the keys that changed.
+ * This checks for such changes without blocking and applies them, so
+ * callers that keep their own data derived from the keyboard map can tell
+ * when to recompute it. It is cheap to call when nothing changed.
+ *
+ * @return the keymap generation.
+ */
+unsigned long xdo_get_keymap_generation(const xdo_t *xdo);
+
 /**
  * Return a string representing the version of this library
  */
@@ -254,6 +436,104 @@ int xdo_move_mouse_relative_to_window(const xdo_t *xdo, Window window, int x, in
  */
 int xdo_move_mouse_relative(const xdo_t *xdo, int x, int y);
 
+/**
+ * The shape of the path xdo_move_mouse_smooth takes.
+ */
+typedef enum {
+  XDO_MOTION_LINEAR, /**< a straight line at constant speed */
+  XDO_MOTION_EASE,   /**< a straight line, speeding up, then slowing down */
+  XDO_MOTION_BEZIER  /**< a randomly bent curve, more like a hand moves */
+} xdo_motion_curve_t;
+
+/** Frames per second xdo_move_mouse_smooth sends points at by default. */
+#define XDO_MOTION_DEFAULT_RATE 60
+
+/**
+ * How xdo_move_mouse_smooth gets to its target.
+ */
+typedef struct xdo_motion {
+  xdo_motion_curve_t curve;
+
+  /** Pixels between points along the path, at least 1. */
+  int step;
+
+  /** Microseconds between points. */
+  useconds_t delay;
+
+  /** How many times a second to send the points that are due, usually the
+   * refresh rate of the display. 0 means XDO_MOTION_DEFAULT_RATE. */
+  unsigned int frame_rate;
+
+  /** Move each point but the last up to this many pixels off the path. */
+  int jitter;
+
+  /** Seed for the random parts of the path; 0 picks one. */
+  unsigned int seed;
+} xdo_motion_t;
+
+/**
+ * Move the mouse to a specific location through a series of points, like a
+ * real mouse would, instead of jumping there.
+ *
+ * Points are sent with XTest and paced against absolute deadlines, so
+ * delays don't add up. Points that are due in the same frame go out
+ * together, with one flush per frame.
+ *
+ * Moving to another screen jumps there, like xdo_move_mouse.
+ *
+ * @param x the target X coordinate on the screen in pixels.
+ * @param y the target Y coordinate on the screen in pixels.
+ * @param screen the screen (number) you want to move on.
+ * @param motion the shape and speed of the path.
+ */
+int xdo_move_mouse_smooth(const xdo_t *xdo, int x, int y, int screen,
+                          const xdo_motion_t *motion);
+
+/** The first bytes of a binary pointer path, see xdo_move_mouse_path. */
+#define XDO_PATH_MAGIC "\x89XDOPATH"
+#define XDO_PATH_MAGIC_LEN 8
+
+/**
+ * How well xdo_move_mouse_path kept to the schedule. Drift is how long
+ * after its timestamp a point was actually sent.
+ */
+typedef struct xdo_path_stats {
+  long points;
+  double seconds;
+  long long drift_mean; /**< microseconds */
+  long long drift_max; /**< microseconds */
+} xdo_path_stats_t;
+
+/**
+ * Replay a recorded pointer path, moving the mouse and pressing buttons at
+ * the times given. Records are read from 'path' as they are needed, so a
+ * path can be any length and can come from a pipe.
+ *
+ * A path is either text or binary. Text paths have a record per line:
+ *
+ *   milliseconds x y [buttons]
+ *
+ * where milliseconds (fractions are fine) count from the start of the
+ * replay and buttons is a bitmask of the buttons held, 1 for button 1, 2
+ * for button 2, 4 for button 3 and so on. Without it, buttons are left
+ * alone. Blank lines and lines starting with '#' are skipped.
+ *
+ * Binary paths start with XDO_PATH_MAGIC, followed by 10 byte records of
+ * little-endian integers: a uint32 of microseconds since the previous
+ * record, int16 x and y, and a uint16 of buttons, 0xffff to leave them
+ * alone.
+ *
+ * Points are sent with XTest over this one connection, each at its
+ * deadline against a monotonic clock. Buttons still held at the end stay
+ * held, like after xdo_mouse_down.
+ *
+ * @param path the file to read records from.
+ * @param stats if not NULL, filled in with how it went.
+ * @return XDO_ERROR if the path is malformed or the X server refused a
+ *   point, XDO_SUCCESS otherwise.
+ */
+int xdo_move_mouse_path(const xdo_t *xdo, FILE *path, xdo_path_stats_t *stats);
+
 /**
  * Send a mouse press (aka mouse down) for a given button at the current mouse
  * location.
@@ -336,6 +616,10 @@ int xdo_click_window(const xdo_t *xdo, Window window, int button);
  * Send a one or more clicks for a specific mouse button at the current mouse
  * location.
  *
+ * When sending to a window, the pointer position and modifier state are
+ * looked up once for the whole burst, so moving the mouse during it does
+ * not change where the clicks land.
+ *
  * @param window The window you want to send the event to or CURRENTWINDOW
  * @param button The mouse button. Generally, 1 is left, 2 is middle, 3 is
  *    right, 4 is wheel up, 5 is wheel down.
@@ -349,13 +633,151 @@ int xdo_click_window_multiple(const xdo_t *xdo, Window window, int button,
  * If you want to send a specific key or key sequence, such as "alt+l", you
  * want instead xdo_send_keysequence_window(...).
  *
+ * Characters that are not in the keymap are typed with a Compose or dead key
+ * sequence from the locale's compose table when the keymap has one and the
+ * input goes through XTest. Otherwise a spare keycode is bound to them.
+ *
  * @param window The window you want to send keystrokes to or CURRENTWINDOW
- * @param string The string to type, like "Hello world!"
+ * @param string The string to type in UTF-8, like "Hello world!"
  * @param delay The delay between keystrokes in microseconds. 12000 is a decent
  *    choice if you don't have other plans.
  */
 int xdo_enter_text_window(const xdo_t *xdo, Window window, const char *string, useconds_t delay);
 
+/**
+ * Type a string to the specified window as one batch of input events.
+ *
+ * Unlike xdo_enter_text_window, this does not sync with the X server after
+ * every key. Modifier and keyboard group changes are only sent when the
+ * next character needs different ones, and the requests are flushed once
+ * per chunk of characters. Characters that need a temporary keycode
+ * binding are still sent one at a time.
+ *
+ * @param window The window you want to send keystrokes to or CURRENTWINDOW
+ * @param string The string to type in UTF-8, like "Hello world!"
+ * @param chunk How many characters to send between flushes. If 0 or less,
+ *    a default of 64 is used.
+ * @param delay The delay after each chunk in microseconds.
+ */
+int xdo_enter_text_window_batch(const xdo_t *xdo, Window window, const char *string,
+                                int chunk, useconds_t delay);
+
+/**
+ * Type a string to several windows at once.
+ *
+ * Windows that would get their input with XSendEvent all get each key
+ * event before the next one is sent, with one flush and one delay per
+ * event, so typing into many windows takes about as long as typing into
+ * one. Characters missing from the keymap are all bound before typing
+ * starts, so there can be no more of them than spare keycodes. Windows
+ * that need XTest are typed into afterwards, one at a time, like
+ * xdo_enter_text_window.
+ *
+ * @param windows The windows to send keystrokes to
+ * @param nwindows How many windows there are
+ * @param string The string to type in UTF-8, like "Hello world!"
+ * @param delay The delay between keystrokes in microseconds.
+ */
+int xdo_enter_text_windows(const xdo_t *xdo, const Window *windows, int nwindows,
+                           const char *string, useconds_t delay);
+
+/**
+ * Type a string to the specified window by pasting it.
+ *
+ * This takes ownership of a selection, sends the paste key sequence to the
+ * window and serves the text when the window asks for it, so the whole
+ * text costs a handful of key events whatever its length. Large texts are
+ * sent with the INCR protocol. The selection is given up afterwards, which
+ * leaves it empty; to keep what was in it before, fetch that first with
+ * xdo_get_selection and put it back with xdo_serve_selection.
+ *
+ * @param window The window to paste into or CURRENTWINDOW
+ * @param string The string to type, in UTF-8
+ * @param selection The selection to use, like "CLIPBOARD" or "PRIMARY"
+ * @param paste_keyseq The keys the window pastes that selection with, like
+ *    "ctrl+v" or "shift+Insert"
+ * @param timeout How long to wait for the window to ask for the text, in
+ *    microseconds
+ */
+int xdo_enter_text_window_selection(const xdo_t *xdo, Window window, const char *string,
+                                    const char *selection, const char *paste_keyseq,
+                                    useconds_t timeout);
+
+/**
+ * Get the contents of a selection as text.
+ *
+ * @param selection The selection to read, like "CLIPBOARD" or "PRIMARY"
+ * @param text_ret Where to store the text, in UTF-8. Free it with free().
+ *    Set to NULL if the selection is empty or its owner has no text.
+ * @param timeout How long to wait for the owner, in microseconds
+ */
+int xdo_get_selection(const xdo_t *xdo, const char *selection, char **text_ret,
+                      useconds_t timeout);
+
+/**
+ * Take ownership of a selection and serve 'string' from it until another
+ * client takes the selection. This blocks until then, so callers that need
+ * to go on usually run it in a child process with its own xdo_t.
+ *
+ * @param selection The selection to own, like "CLIPBOARD" or "PRIMARY"
+ * @param string The text to serve, in UTF-8
+ */
+int xdo_serve_selection(const xdo_t *xdo, const char *selection, const char *string);
+
+/**
+ * What xdo_enter_text_window_adaptive achieved.
+ */
+typedef struct xdo_typing_stats {
+  /** How many characters were typed */
+  size_t chars;
+
+  /** How long it took, in seconds */
+  double seconds;
+
+  /** chars / seconds */
+  double chars_per_sec;
+
+  /** The delay between keys it ended up with, in microseconds */
+  useconds_t final_delay;
+
+  /** How many times the target fell behind and typing slowed down */
+  int backoffs;
+
+  /** True if the target was probed with _NET_WM_PING, False for XSync */
+  int used_ping;
+} xdo_typing_stats_t;
+
+/**
+ * Type a string to the specified window as fast as it can take it.
+ *
+ * The text is typed in rounds of a few dozen characters. After each round
+ * the window's client is sent a _NET_WM_PING, which it answers only once
+ * it has handled the keys sent before it. While the answers come back
+ * quickly the delay between keys is cut; when they slow down the delay is
+ * doubled. Clients that don't support _NET_WM_PING are probed with XSync,
+ * which only tells when the X server has caught up.
+ *
+ * @param window The window you want to send keystrokes to or CURRENTWINDOW
+ * @param string The string to type in UTF-8, like "Hello world!"
+ * @param max_delay The longest delay between keystrokes to back off to,
+ *    in microseconds.
+ * @param stats If not NULL, filled in with what was achieved.
+ */
+int xdo_enter_text_window_adaptive(const xdo_t *xdo, Window window, const char *string,
+                                   useconds_t max_delay, xdo_typing_stats_t *stats);
+
+/**
+ * Wait between two input events sent to a window.
+ *
+ * If xdo->server_delay is set and the input goes through XTest (window is
+ * CURRENTWINDOW), the delay is put on the next XTest event and the X server
+ * waits instead. Otherwise this flushes pending requests and sleeps.
+ *
+ * @param window The window input is being sent to or CURRENTWINDOW
+ * @param delay The delay in microseconds.
+ */
+void xdo_delay_input(const xdo_t *xdo, Window window, useconds_t delay);
+
 /**
  * Send a keysequence to the specified window.
  *
@@ -395,6 +817,95 @@ int xdo_send_keysequence_window_up(const xdo_t *xdo, Window window,
  */
 int xdo_send_keysequence_window_down(const xdo_t *xdo, Window window,
                          const char *keysequence, useconds_t delay);
+
+/**
+ * Resolve a key sequence to keycodes once, for sending it many times.
+ *
+ * Parsing a key sequence means looking up every key name and searching the
+ * keymap for it. xdo_send_keysequence_window does that on every call;
+ * a compiled key sequence can be sent with xdo_keyseq_send_window without
+ * any of that work and without allocating memory.
+ *
+ * The result reflects the keymap at the time of the call. Compile the key
+ * sequence again if the keyboard mapping changes.
+ *
+ * @param keysequence The key sequence, same as for
+ *   xdo_send_keysequence_window.
+ * @return A new key sequence or NULL if it is invalid. Free it with
+ *   xdo_keyseq_free.
+ */
+xdo_keyseq_t *xdo_keyseq_compile(const xdo_t *xdo, const char *keysequence);
+
+/**
+ * Send a compiled key sequence, press and release.
+ *
+ * @see xdo_send_keysequence_window
+ */
+int xdo_keyseq_send_window(const xdo_t *xdo, Window window,
+                           xdo_keyseq_t *keyseq, useconds_t delay);
+
+/**
+ * Send key release (up) events for a compiled key sequence.
+ *
+ * @see xdo_send_keysequence_window_up
+ */
+int xdo_keyseq_send_window_up(const xdo_t *xdo, Window window,
+                              xdo_keyseq_t *keyseq, useconds_t delay);
+
+/**
+ * Send key press (down) events for a compiled key sequence.
+ *
+ * @see xdo_send_keysequence_window_down
+ */
+int xdo_keyseq_send_window_down(const xdo_t *xdo, Window window,
+                                xdo_keyseq_t *keyseq, useconds_t delay);
+
+/**
+ * Get the keycode and modifier mask a compiled key sequence like
+ * "ctrl+alt+t" stands for, such as for XGrabKey. All keys but the last
+ * one must be modifiers, and the last one must be in the keymap.
+ *
+ * @param keycode_ret The keycode of the last key.
+ * @param modmask_ret The modifiers of the other keys, plus those the last
+ *   key's keysym needs (such as Shift for "A").
+ * @return XDO_SUCCESS, or XDO_ERROR if the sequence is not such a chord.
+ */
+int xdo_keyseq_get_chord(const xdo_t *xdo, const xdo_keyseq_t *keyseq,
+                         KeyCode *keycode_ret, unsigned int *modmask_ret);
+
+/**
+ * Send a compiled key sequence to several windows at once.
+ *
+ * Windows that would get their input with XSendEvent (see
+ * xdo_t.input_method) all get each key event before the next one is sent,
+ * with one flush and one delay per event, so typing into many windows
+ * takes about as long as typing into one. Windows that need XTest get the
+ * sequence afterwards, one at a time, like xdo_keyseq_send_window.
+ *
+ * @param windows The windows to send keystrokes to
+ * @param nwindows How many windows there are
+ * @param keyseq The key sequence from xdo_keyseq_compile
+ * @param delay The delay between keystrokes in microseconds.
+ */
+int xdo_keyseq_send_windows(const xdo_t *xdo, const Window *windows, int nwindows,
+                            xdo_keyseq_t *keyseq, useconds_t delay);
+
+/**
+ * Like xdo_keyseq_send_windows, but only press the keys.
+ */
+int xdo_keyseq_send_windows_down(const xdo_t *xdo, const Window *windows, int nwindows,
+                                 xdo_keyseq_t *keyseq, useconds_t delay);
+
+/**
+ * Like xdo_keyseq_send_windows, but only release the keys.
+ */
+int xdo_keyseq_send_windows_up(const xdo_t *xdo, const Window *windows, int nwindows,
+                               xdo_keyseq_t *keyseq, useconds_t delay);
+
+/**
+ * Free a key sequence from xdo_keyseq_compile.
+ */
+void xdo_keyseq_free(xdo_keyseq_t *keyseq);
                          
 /**
  * Send a series of keystrokes.
@@ -776,6 +1287,50 @@ int xdo_get_window_property(const xdo_t *xdo, Window window, const char *propert
  */
 unsigned int xdo_get_input_state(const xdo_t *xdo);
 
+/**
+ * Keep track of the pointer from XInput 2 raw events, so that asking where
+ * it is or which buttons are held does not take a round trip to the X
+ * server every time.
+ *
+ * The tracker learns from raw motion that the pointer moved, but not where
+ * to, so the next xdo_get_mouse_location asks the server; until then it is
+ * answered from what the server said last. Moves that make no raw events,
+ * like XWarpPointer from other clients, are caught by asking again at least
+ * every 100ms. Held buttons come straight from raw button events.
+ * Waiting for the mouse to move, as in xdo_wait_for_mouse_move_from, wakes
+ * up on motion at once, though it still checks now and then for moves that
+ * make no raw events.
+ *
+ * Tracking is off unless enabled here or by setting XDO_TRACK_POINTER in
+ * the environment. It needs libxdo built with XInput 2 and an X server
+ * with XInput 2.1 or newer.
+ *
+ * @param enable True to start tracking, False to stop.
+ * @return XDO_ERROR if the pointer can't be tracked, XDO_SUCCESS otherwise.
+ */
+int xdo_track_pointer(const xdo_t *xdo, int enable);
+
+/**
+ * Get the mouse buttons that are held, as a mask of Button1Mask to
+ * Button5Mask. With xdo_track_pointer this rarely needs the X server.
+ *
+ * @return the button mask
+ */
+unsigned int xdo_get_pointer_buttons(const xdo_t *xdo);
+
+/**
+ * Wait for the pointer to move or for a button to change. Everything that
+ * has arrived by the time this wakes up is taken at once, so a burst of
+ * motion counts as one change.
+ *
+ * This needs xdo_track_pointer. Without it there is nothing to wait on,
+ * so this sleeps for 'timeout' and says the pointer may have changed.
+ *
+ * @param timeout the longest to wait, in microseconds, or 0 for no limit.
+ * @return True if the pointer changed (or may have), False on timeout.
+ */
+int xdo_wait_for_pointer_event(const xdo_t *xdo, useconds_t timeout);
+
 /**
  * If you need the symbol map, use this method.
  *
@@ -816,6 +1371,38 @@ int xdo_set_active_modifiers(const xdo_t *xdo, Window window,
                              charcodemap_t *active_mods,
                              int active_mods_n);
 
+/**
+ * Take a snapshot of the held modifier keys, pressed mouse buttons and
+ * caps lock. This usually costs one round trip to the X server, two if
+ * modifier keys are held.
+ *
+ * Use it instead of xdo_get_active_modifiers, xdo_clear_active_modifiers
+ * and xdo_set_active_modifiers, which query the state again for every
+ * call and send each key and button on its own.
+ *
+ * @return A snapshot to free with xdo_modifiers_free.
+ */
+xdo_modifiers_t *xdo_modifiers_save(const xdo_t *xdo);
+
+/**
+ * Release everything held in the snapshot and turn off caps lock, in one
+ * burst of XTest requests without waiting for the X server. Without XTest
+ * this falls back to xdo_clear_active_modifiers for the window.
+ *
+ * Clearing again before xdo_modifiers_restore does nothing.
+ */
+int xdo_modifiers_clear(const xdo_t *xdo, Window window, xdo_modifiers_t *mods);
+
+/**
+ * Press and lock again what xdo_modifiers_clear let go of.
+ */
+int xdo_modifiers_restore(const xdo_t *xdo, Window window, xdo_modifiers_t *mods);
+
+/**
+ * Free a snapshot from xdo_modifiers_save.
+ */
+void xdo_modifiers_free(xdo_modifiers_t *mods);
+
 /**
  * Get the position of the current viewport.
  *
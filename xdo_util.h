@@ -19,4 +19,32 @@ static const char *symbol_map[] = {
   NULL, NULL,
 };
 
+/* Case-insensitive hash of a key name, shared by gen_keysym_table.c and
+ * the lookups in xdo.c. Mix it with keysym_name_seed to pick one of a
+ * family of hash functions; the generator searches for seeds that make the
+ * table collision free. */
+static inline unsigned int keysym_name_hash(const char *name) {
+  unsigned int h = 2166136261u;
+
+  for (; *name != '\0'; name++) {
+    unsigned char c = *name;
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    h = (h ^ c) * 16777619u;
+  }
+  return h;
+}
+
+static inline unsigned int keysym_name_seed(unsigned int hash, unsigned int seed) {
+  /* FNV alone distributes short names poorly, finish with a mix */
+  hash ^= seed * 0x9e3779b9u;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
 #endif /* ifndef _XDO_UTIL_H_ */
@@ -235,6 +235,7 @@ struct dispatch {
 
   /* Action functions */
   { "behave", cmd_behave, },
+  { "bind", cmd_bind, },
   { "behave_screen_edge", cmd_behave_screen_edge, },
   { "click", cmd_click, },
   { "getmouselocation", cmd_getmouselocation, },
@@ -44,6 +44,7 @@ int cmd_exec(context_t *context);
 int cmd_sleep(context_t *context);
 int cmd_behave(context_t *context);
 int cmd_behave_screen_edge(context_t *context);
+int cmd_bind(context_t *context);
 int cmd_click(context_t *context);
 int cmd_getactivewindow(context_t *context);
 int cmd_getmouselocation(context_t *context);